@@ -11,14 +11,15 @@
 ## few fixes have all been for compatability and are made under the
 ## same license. I also migrated the crypto to openssl.
 
-import nimutils/[box, random, unicodeid, pubsub, sinks, misc, texttable],
+import nimutils/[box, random, unicodeid, linebreak, pubsub, sinks, misc,
+                 texttable],
        nimutils/[file, process, filetable, encodings, advisory_lock]
 import nimutils/[sha, aes, prp, hexdump, markdown, htmlparse, net]
 import nimutils/[colortable, rope_base, rope_styles, rope_construct,
                  rope_prerender, rope_ansirender, switchboard, subproc]
-export box, random, unicodeid, pubsub, sinks, misc, random, texttable,
-       file, process, filetable, encodings, advisory_lock, sha, aes, prp,
-       hexdump, markdown, htmlparse, net
+export box, random, unicodeid, linebreak, pubsub, sinks, misc, random,
+       texttable, file, process, filetable, encodings, advisory_lock, sha,
+       aes, prp, hexdump, markdown, htmlparse, net
 export colortable, rope_base, rope_styles, rope_construct, rope_prerender,
        rope_ansirender, switchboard, subproc
 
@@ -30,3 +31,4 @@ export colortable, rope_base, rope_styles, rope_construct, rope_prerender,
 ## `managedtmp` because it adds a destructor you might not want.
 ## `randwords`  because it does have a huge data structure embedded, which
 ##              isn't worth it if you're not using it.
+## `asyncsubproc` because it pulls in asyncdispatch.
@@ -0,0 +1,166 @@
+## Runs subprocesses from an `asyncdispatch` event loop, so that many
+## children can be driven alongside network I/O in one thread.
+##
+## Each child's switchboard gets an epoll (Linux) or kqueue (macOS)
+## descriptor that's registered with the dispatcher. When it's ready,
+## we take one non-blocking trip through the switchboard.
+##
+## This isn't imported by default, since it pulls in `asyncdispatch`.
+##
+## :Copyright: 2023, Crash Override, Inc.
+
+import asyncdispatch, asyncstreams, os, posix, switchboard, subproc
+
+type
+  AsyncSubProcessObj = object
+    ctx*:         SubProcess
+    stdout*:      FutureStream[string]
+    stderr*:      FutureStream[string]
+    pollFd:       AsyncFD
+    pending:      Future[void]
+    stdinData:    string
+    killWhenDone: bool
+    started:      bool
+  AsyncSubProcess* = ref AsyncSubProcessObj
+
+# Switchboard callbacks get the switchboard's `extra` pointer (which
+# is us) and the party's.
+proc asyncStdoutCb(extra: pointer, party: pointer, data: cstring, l: int)
+    {.cdecl, gcsafe.} =
+  {.cast(gcsafe).}:
+    let chunk = binaryCstringToString(data, l)
+    asyncCheck cast[AsyncSubProcess](extra).stdout.write(chunk)
+
+proc asyncStderrCb(extra: pointer, party: pointer, data: cstring, l: int)
+    {.cdecl, gcsafe.} =
+  {.cast(gcsafe).}:
+    let chunk = binaryCstringToString(data, l)
+    asyncCheck cast[AsyncSubProcess](extra).stderr.write(chunk)
+
+proc newAsyncSubProcess*(exe:  string,
+                         args: seq[string],
+                         newStdin                = "",
+                         closeStdIn              = false,
+                         pty                     = false,
+                         capture                 = SpIoOutErr,
+                         combineCapture          = false,
+                         stream                  = SpIoNone,
+                         env:  openarray[string] = [],
+                         newProcessGroup         = false,
+                         deadlineUsec            = 0,
+                         cpuLimitSec             = 0,
+                         memoryLimit             = 0,
+                         fdLimit                 = 0): AsyncSubProcess =
+  ## Sets up a subprocess to be driven by `wait()`. Parameters are as
+  ## with `runCommand()`.
+  ##
+  ## Output on the streams selected by `stream` gets written to the
+  ## `stdout` and `stderr` FutureStreams as it arrives, and those
+  ## complete when the process is done. Streaming doesn't affect
+  ## `capture`; you can do both.
+  result = AsyncSubProcess(stdinData:    newStdin,
+                           killWhenDone: newProcessGroup)
+
+  result.stdout = newFutureStream[string]("asyncsubproc.stdout")
+  result.stderr = newFutureStream[string]("asyncsubproc.stderr")
+
+  # A zero timeout, since we only enter the switchboard when we
+  # already know something is ready.
+  result.ctx.initCommand(exe, args, result.stdinData, closeStdin, pty,
+                         SpIoNone, false, capture, combineCapture, 0, env,
+                         newProcessGroup, deadlineUsec, cpuLimitSec,
+                         memoryLimit, fdLimit)
+
+  if (ord(stream) and ord(SpIoStdout)) != 0:
+    result.ctx.setIoCallback(SpIoStdout, asyncStdoutCb)
+  if (ord(stream) and ord(SpIoStderr)) != 0:
+    result.ctx.setIoCallback(SpIoStderr, asyncStderrCb)
+
+proc start*(p: AsyncSubProcess) =
+  ## Spawns the child. `wait()` calls this if you haven't.
+  if p.started:
+    return
+
+  let fd = newPollFd()
+  if fd < 0:
+    raiseOSError(osLastError())
+
+  p.started = true
+  p.pollFd  = AsyncFD(fd)
+
+  # The C side holds a pointer to us until we're done.
+  GC_ref(p)
+  p.ctx.setExtra(cast[pointer](p))
+  p.ctx.start()
+  register(p.pollFd)
+
+proc waitForIo(p: AsyncSubProcess, maxWaitMs: int) {.async.} =
+  # Only one read callback is outstanding at a time; if we time out,
+  # the same one gets reused on the next pass.
+  if p.pending == nil or p.pending.finished:
+    let fut   = newFuture[void]("asyncsubproc.waitForIo")
+    p.pending = fut
+    addRead(p.pollFd, proc (fd: AsyncFD): bool =
+      if not fut.finished:
+        fut.complete()
+      return true)
+
+  discard await withTimeout(p.pending, maxWaitMs)
+
+proc wait*(p: AsyncSubProcess, maxWaitMs = 100): Future[ExecOutput]
+    {.async.} =
+  ## Drives the subprocess until it's done, and returns its results.
+  ## `maxWaitMs` is the longest we'll go without I/O before checking
+  ## on the process anyway, which bounds how late a deadline fires.
+  p.start()
+
+  while true:
+    let unwatched = p.ctx.syncPollFd(cint(p.pollFd))
+    if unwatched < 0:
+      break
+    elif unwatched == 0:
+      await p.waitForIo(maxWaitMs)
+    else:
+      await sleepAsync(0)
+    if p.ctx.poll():
+      break
+
+  unregister(p.pollFd)
+  discard posix.close(cint(p.pollFd))
+
+  # The descriptors can close a moment before the exit; don't block
+  # the loop in waitpid().
+  while not p.ctx.hasExited():
+    await sleepAsync(1)
+
+  p.ctx.prepareResults()
+  p.stdout.complete()
+  p.stderr.complete()
+
+  result = p.ctx.getExecOutput()
+
+  if p.killWhenDone:
+    p.ctx.killTree()
+
+  GC_unref(p)
+
+proc runCommandAsync*(exe:  string,
+                      args: seq[string],
+                      newStdin        = "",
+                      closeStdIn      = false,
+                      pty             = false,
+                      capture         = SpIoOutErr,
+                      combineCapture  = false,
+                      env             = newSeq[string](),
+                      newProcessGroup = false,
+                      deadlineUsec    = 0,
+                      cpuLimitSec     = 0,
+                      memoryLimit     = 0,
+                      fdLimit         = 0,
+                      maxWaitMs       = 100): Future[ExecOutput] {.async.} =
+  ## The async version of `runCommand()`.
+  let p = newAsyncSubProcess(exe, args, newStdin, closeStdin, pty, capture,
+                             combineCapture, SpIoNone, env, newProcessGroup,
+                             deadlineUsec, cpuLimitSec, memoryLimit, fdLimit)
+
+  return await p.wait(maxWaitMs)
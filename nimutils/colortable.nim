@@ -312,12 +312,26 @@ var
   showColor              = if existsEnv("NO_COLOR"): false else: true
   unicodeOverAnsi:  bool = true
   color24Bit:       bool = false
+  renderGeneration: int  = 0
 
 template getColorTable*(): OrderedTable = colorTable
 template get8BitTable*(): OrderedTable  = color8Bit
 
+proc getRenderGeneration*(): int =
+  ## Renderers cache things (like escape sequences per style) that
+  ## depend on the color settings and the style maps. This changes
+  ## whenever those do.
+  return renderGeneration
+
+proc invalidateRenderCaches*() =
+  ## The setters here call this for you. But if you modify
+  ## `colorTable` or `color8Bit` directly, or change a style object in
+  ## place, call this afterward.
+  renderGeneration += 1
+
 proc setShowColor*(val: bool) =
   showColor = val
+  invalidateRenderCaches()
 
 proc getShowColor*(): bool =
   return showColor
@@ -330,6 +344,7 @@ proc getUnicodeOverAnsi*(): bool =
 
 proc setColor24Bit*(val: bool) =
   color24Bit = val
+  invalidateRenderCaches()
 
 proc getColor24Bit*(): bool =
   return color24Bit
@@ -353,6 +368,8 @@ proc autoDetectTermPrefs*() =
   if term in ["xterm-kitty"] or termprog == "WezTerm":
     unicodeOverAnsi = false
 
+  invalidateRenderCaches()
+
 proc hexColorTo8Bit*(hex: string): int =
   # Returns -1 if invalid.
   var color: int
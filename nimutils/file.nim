@@ -1,7 +1,7 @@
 ## :Author: John Viega (john@crashoverride.com)
 ## :Copyright: 2023, Crash Override, Inc.
 
-import os, posix, strutils, posix_utils
+import os, posix, strutils, posix_utils, tables, times, sequtils
 
 proc getMyAppPath(): string {.importc.}
 
@@ -94,38 +94,123 @@ template hasOtherExeBit*(info: Stat): bool =
 template hasAnyExeBit*(info: Stat): bool =
   (info.st_mode and S_IXALL) != 0
 
+{.emit: """
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// The kernel already knows how to answer "can the effective user
+// run this?", including supplementary groups and ACLs, so we ask it
+// instead of re-deriving the answer from the mode bits.
+static int
+is_exe_for_euid(const char *path)
+{
+  struct stat info;
+
+  if (stat(path, &info) != 0 || !S_ISREG(info.st_mode)) {
+    return 0;
+  }
+
+  return faccessat(AT_FDCWD, path, X_OK, AT_EACCESS) == 0;
+}
+""".}
+
+proc is_exe_for_euid(s: cstring): cint {.cdecl,importc,nodecl.}
+
 proc isExecutable*(path: string): bool =
+  ## Returns true if `path` is a regular file that the effective user
+  ## is allowed to execute.
+  return is_exe_for_euid(cstring(path)) != 0
+
+type ExeCacheEntry = object
+  dirs:   seq[string]
+  mtimes: seq[times.Time]
+  found:  seq[string]
+
+var
+  exeCache {.threadvar.}: Table[string, ExeCacheEntry] # Per thread, no lock.
+  appLocated = false
+  appDir:      string
+  appName:     string
+
+proc getAppLocation(): (string, string) =
+  if not appLocated:
+    (appDir, appName) = getMyAppPath().splitPath()
+    appLocated        = true
+
+  return (appDir, appName)
+
+proc dirMTime(dir: string): times.Time =
+  # A directory's mtime changes whenever an entry is added, removed or
+  # renamed, which is exactly when a PATH lookup could change.
   try:
-    let info = stat(path)
+    return getLastModificationTime(dir)
+  except:
+    return times.Time()
 
-    if not info.isFile():
+proc isStillValid(entry: ExeCacheEntry): bool =
+  for i, dir in entry.dirs:
+    if dir.dirMTime() != entry.mtimes[i]:
       return false
 
-    if not info.hasAnyExeBit():
-      return false
+  return true
 
-    let myeuid = geteuid()
+proc isRelative(path: string): bool =
+  # Anything resolvePath() would resolve against the cwd, including
+  # an empty PATH entry.
+  return path == "" or path[0] notin {'/', '~'}
 
-    if myeuid == 0:
-      return true
+proc exeCacheKey(cmdName: string, extraPaths: seq[string],
+                 usePath: bool): string =
+  var relative = ('/' in cmdName and cmdName.isRelative()) or
+                 extraPaths.anyIt(it.isRelative())
 
-    if info.st_uid == myeuid:
-      return info.hasUserExeBit()
+  result = cmdName & "\0" & extraPaths.join("\0") & "\0"
+  if usePath:
+    let path = getEnv("PATH")
+    result &= path
+    if not relative:
+      relative = path.split(":").anyIt(it.isRelative())
+
+  # The same lookup can find something else after a chdir.
+  if relative:
+    result &= "\0" & getCurrentDir()
+
+proc findAllExePathsUncached(cmdName:    string,
+                             extraPaths: seq[string],
+                             usePath:    bool): ExeCacheEntry =
+  let
+    (mydir, me) = getAppLocation()
+  var
+    targetName  = cmdName
+    allPaths    = extraPaths
 
-    var groupinfo: array[0 .. 255, Gid]
-    let numGroups = getgroups(255, addr groupinfo)
+  if usePath:
+    allPaths &= getEnv("PATH").split(":")
 
-    if info.st_gid in groupinfo[0 ..< numGroups]:
-      return info.hasGroupExeBit()
+  if '/' in cmdName:
+    let tup    = resolvePath(cmdName).splitPath()
+    targetName = tup.tail
+    allPaths   = @[tup.head] & allPaths
 
-    return info.hasOtherExeBit()
+  # Grab the mtimes before we look, so that anything that changes
+  # while we're searching forces a re-scan next time.
+  for item in allPaths:
+    let path = resolvePath(item)
+    if path notin result.dirs:
+      result.dirs.add(path)
+      result.mtimes.add(path.dirMTime())
 
-  except:
-    return false # Couldn't stat.
+  for path in result.dirs:
+    if me == targetName and path == mydir: continue # Don't ever find ourself.
+    let potential = joinPath(path, targetName)
+    if potential.isExecutable():
+      result.found.add(potential)
 
 proc findAllExePaths*(cmdName:    string,
                       extraPaths: seq[string] = @[],
-                      usePath                 = true): seq[string] =
+                      usePath                 = true,
+                      useCache                = true): seq[string] =
   ##
   ## The priority here is to the passed command name, but if and only
   ## if it is a path; we're assuming that they want to try to run
@@ -138,31 +223,43 @@ proc findAllExePaths*(cmdName:    string,
   ##
   ## If all else fails, we search the PATH environment variable.
   ##
-  ## Note that we don't check for permissions problems (including
-  ## not-executable), and we do not open the file, so there's the
-  ## chance of the executable going away before we try to run it.
+  ## Results are cached per thread, keyed on the command name, the
+  ## extra paths and the value of PATH, plus the current directory if
+  ## any of those are relative. A cached result is only used
+  ## if none of the searched directories has a new mtime, so adding
+  ## or removing a binary is noticed, but a `chmod` of an existing
+  ## file is not; call `clearExeCache()` if you do that, or pass
+  ## `useCache = false`.
+  ##
+  ## Note that we do not open the file, so there's the chance of the
+  ## executable going away before we try to run it.
   ##
   ## The point is, the caller should eanticipate failure.
-  let
-    (mydir, me) = getMyAppPath().splitPath()
-  var
-    targetName  = cmdName
-    allPaths    = extraPaths
+  if not useCache:
+    return findAllExePathsUncached(cmdName, extraPaths, usePath).found
 
-  if usePath:
-    allPaths &= getEnv("PATH").split(":")
+  let key = exeCacheKey(cmdName, extraPaths, usePath)
 
-  if '/' in cmdName:
-    let tup    = resolvePath(cmdName).splitPath()
-    targetName = tup.tail
-    allPaths   = @[tup.head] & allPaths
+  if key in exeCache and exeCache[key].isStillValid():
+    return exeCache[key].found
 
-  for item in allPaths:
-    let path = resolvePath(item)
-    if me == targetName and path == mydir: continue # Don't ever find ourself.
-    let potential = joinPath(path, targetName)
-    if potential.isExecutable():
-      result.add(potential)
+  let entry     = findAllExePathsUncached(cmdName, extraPaths, usePath)
+  exeCache[key] = entry
+
+  return entry.found
+
+proc prewarmExeCache*(cmdNames:   openarray[string],
+                      extraPaths: seq[string] = @[],
+                      usePath                 = true) =
+  ## Resolve a set of commands up front (e.g., at startup), so that
+  ## later calls to `findAllExePaths()` and `runCommand()` only need
+  ## to check directory mtimes.
+  for item in cmdNames:
+    discard item.findAllExePaths(extraPaths, usePath)
+
+proc clearExeCache*() =
+  ## Drop every cached executable lookup.
+  exeCache.clear()
 
 {.emit: """
 #include <unistd.h>
@@ -9,12 +9,23 @@
 ## :Copyright: 2022, 2023, Crash Override, Inc.
 
 
-import tables, strutils, os, system/nimscript
+import tables, strutils, os, system/nimscript, rope_base, rope_construct
 
 type
   FileTable*        = Table[string, string]
   OrderedFileTable* = OrderedTable[string, string]
 
+  RopeFileEntry = object
+    contents: string
+    isBlob:   bool
+    rope:     Rope
+
+  RopeFileTable* = ref object
+    ## Embedded documents that become ropes the first time they're
+    ## asked for, instead of all of them at startup. See
+    ## `newRopeFileTable()`.
+    entries: OrderedTable[string, RopeFileEntry]
+
 
 proc staticListFiles*(arg: string): seq[string] =
   # Unfortunately, for whatever reason, system/nimutils's listFiles()
@@ -69,6 +80,77 @@ template newOrderedFileTable*(dir: static[string]): OrderedFileTable =
     ret[key] = fileContents
   ret
 
+proc toRopeFileTable*(files: openarray[(string, string)]): RopeFileTable =
+  ## Takes (file name, contents) pairs. Files ending in `.rope` are
+  ## taken to be `serializeRope()` output, and anything else to be
+  ## markdown. If there's both, the `.rope` file wins. Keys are file
+  ## names without the extension.
+  result = RopeFileTable()
+
+  for (filename, contents) in files:
+    let
+      parts  = splitFile(filename)
+      isBlob = parts.ext == ".rope"
+
+    if isBlob or parts.name notin result.entries:
+      result.entries[parts.name] = RopeFileEntry(contents: contents,
+                                                 isBlob:   isBlob)
+
+template newRopeFileTable*(dir: static[string]): RopeFileTable =
+  ## Like `newOrderedFileTable()`, but gives ropes. Nothing gets parsed
+  ## until a document is first looked up, and documents that were
+  ## converted ahead of time with `writeRopeBlobs()` (say, by a build
+  ## step) just get deserialized.
+  const files = block:
+    var
+      ret:  seq[(string, string)]
+      path = instantiationInfo(fullPaths = true).filename.splitPath().head
+      dst  = path.joinPath(dir)
+
+    let pwd = staticExec("cd " & dst & "; pwd")
+
+    for filename in staticListFiles(dst[0 ..< ^1]):
+      ret.add((filename, staticRead(pwd.joinPath(filename))))
+    ret
+
+  toRopeFileTable(files)
+
+proc `[]`*(t: RopeFileTable, key: string): Rope =
+  ## Returns the document as a rope, converting it on first use. Each
+  ## call returns the same rope, so use `&`, not `+`, to add to it.
+  let entry = addr t.entries[key]
+
+  if entry.rope == nil:
+    if entry.isBlob:
+      entry.rope = entry.contents.deserializeRope()
+    else:
+      entry.rope = entry.contents.htmlStringToRope()
+    entry.contents = ""
+
+  return entry.rope
+
+proc contains*(t: RopeFileTable, key: string): bool =
+  return key in t.entries
+
+proc len*(t: RopeFileTable): int =
+  return t.entries.len()
+
+iterator keys*(t: RopeFileTable): string =
+  for key in t.entries.keys():
+    yield key
+
+proc writeRopeBlobs*(srcDir, dstDir: string) =
+  ## Converts each markdown file in `srcDir` to a rope, and writes it
+  ## to `dstDir` under the same name, with a `.rope` extension. Run
+  ## this from a build step and point `newRopeFileTable()` at `dstDir`
+  ## to keep all parsing out of startup.
+  for kind, path in walkDir(srcDir):
+    if kind != pcFile or path.endsWith(".rope"):
+      continue
+    let name = splitFile(path).name & ".rope"
+    writeFile(dstDir.joinPath(name), readFile(path).htmlStringToRope().
+              serializeRope())
+
 when isMainModule:
   const x = newFileTable("/Users/viega/dev/sami/src/help/")
 
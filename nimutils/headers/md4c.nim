@@ -9884,6 +9884,67 @@ c_markdown_to_html(char *mdoc, size_t len, void *outobj, size_t flags) {
   return md_html(mdoc, len, x, outobj, flags & 0x1ffff, flags >> 28);
 }
 
+// Drives the parser with caller-supplied callbacks, instead of the
+// HTML renderer.
+int
+c_markdown_parse(char *mdoc, size_t len, size_t flags, void *enter_block,
+                 void *leave_block, void *enter_span, void *leave_span,
+                 void *text, void *userdata) {
+  MD_PARSER parser = {
+    .abi_version = 0,
+    .flags       = flags & 0x1ffff,
+    .enter_block = (int (*)(MD_BLOCKTYPE, void *, void *))enter_block,
+    .leave_block = (int (*)(MD_BLOCKTYPE, void *, void *))leave_block,
+    .enter_span  = (int (*)(MD_SPANTYPE, void *, void *))enter_span,
+    .leave_span  = (int (*)(MD_SPANTYPE, void *, void *))leave_span,
+    .text        = (int (*)(MD_TEXTTYPE, const MD_CHAR *, MD_SIZE,
+                            void *))text,
+    .debug_log   = NULL,
+    .syntax      = NULL
+  };
+
+  return md_parse(mdoc, len, &parser, userdata);
+}
+
+// Decodes an entity the same way render_entity() does. Returns how
+// many codepoints went into `out`, or 0 if it isn't an entity we know,
+// in which case it should be left as-is.
+int
+c_md_decode_entity(const char *text, size_t size, unsigned *out) {
+  if (size > 3 && text[1] == '#') {
+    unsigned codepoint = 0;
+
+    if (text[2] == 'x' || text[2] == 'X') {
+      for (size_t i = 3; i < size - 1; i++) {
+        codepoint = 16 * codepoint + hex_val(text[i]);
+      }
+    } else {
+      for (size_t i = 2; i < size - 1; i++) {
+        codepoint = 10 * codepoint + (text[i] - '0');
+      }
+    }
+
+    if (codepoint == 0 || codepoint > 0x10ffff) {
+      codepoint = 0xfffd;
+    }
+    out[0] = codepoint;
+    return 1;
+  }
+
+  const struct entity *ent = entity_lookup(text, size);
+
+  if (ent == NULL) {
+    return 0;
+  }
+
+  out[0] = ent->codepoints[0];
+  if (ent->codepoints[1]) {
+    out[1] = ent->codepoints[1];
+    return 2;
+  }
+  return 1;
+}
+
 #ifdef __cplusplus
     }  /* extern "C" { */
 #endif
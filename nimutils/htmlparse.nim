@@ -26,6 +26,42 @@ type
     root: HtmlNode
     cur:  HtmlNode
 
+  HtmlSlice* = object
+    ## A range of bytes in an `HtmlCompactTree`'s arena.
+    offset*: int32
+    len*:    int32
+
+  HtmlCompactNode* = object
+    kind*:      HtmlNodeType
+    parent*:    int32 # -1 for the root.
+    firstKid*:  int32 # -1 if none.
+    lastKid:    int32
+    next*:      int32 # Next sibling, or -1.
+    contents*:  HtmlSlice
+    attrStart*: int32 # Index into the tree's `attrs`.
+    attrCount*: int32
+
+  HtmlCompactAttr* = object
+    name*:  HtmlSlice
+    value*: HtmlSlice
+
+  HtmlCompactTree* = ref object
+    ## The same tree `parseDocument()` gives, but in three flat
+    ## arrays instead of a ref object per node and a table per
+    ## element: the nodes, linked by index; all the text, names and
+    ## values in one arena; and all the attributes, each element's
+    ## together.
+    nodes*: seq[HtmlCompactNode]
+    attrs*: seq[HtmlCompactAttr]
+    arena*: string
+    cur:    int32
+
+  HtmlNodeView* = object
+    ## A node in an `HtmlCompactTree`. Has the same accessors as
+    ## `HtmlNode` does, so code can be generic over the two.
+    tree*: HtmlCompactTree
+    ix*:   int32
+
 proc stringize(n: HtmlNode, indent = 0): string =
   let c = n.contents.replace("\n", "\\n")
   result = Rune(' ').repeat(indent) & " - " & c & " (" & $(n.kind) & ")" & "\n"
@@ -70,6 +106,117 @@ proc parseDocument*(html: string): HtmlNode =
   make_gumbo(cstring(html), cast[pointer](addr walker))
   result = walker.root
 
+proc hasAttr*(n: HtmlNode, name: string): bool =
+  return name in n.attrs
+
+proc getAttr*(n: HtmlNode, name: string): string =
+  ## Returns "" if the attribute isn't there.
+  return n.attrs.getOrDefault(name)
+
+proc tagName*(n: HtmlNode): string =
+  ## The element's name. Gumbo doesn't normalize tags it doesn't
+  ## know, so for those we strip the angle brackets ourselves.
+  if n.contents.startswith('<') and n.contents[^1] == '>':
+    return n.contents[1 ..< ^1]
+  return n.contents
+
+proc make_gumbo_compact(html: cstring, userdata: pointer): void
+  {.cdecl, importc.}
+
+proc toSlice(tree: HtmlCompactTree, s: pointer, l: csize_t): HtmlSlice =
+  result = HtmlSlice(offset: int32(tree.arena.len()), len: int32(l))
+
+  if l != 0:
+    tree.arena.setLen(tree.arena.len() + int(l))
+    copyMem(addr tree.arena[result.offset], s, int(l))
+
+proc compact_enter(tree: HtmlCompactTree, kind: HtmlNodeType, s: pointer,
+                   l: csize_t) {.exportc, cdecl.} =
+  let ix = int32(tree.nodes.len())
+
+  tree.nodes.add(HtmlCompactNode(kind: kind, parent: tree.cur, firstKid: -1,
+                                 lastKid: -1, next: -1,
+                                 contents: tree.toSlice(s, l),
+                                 attrStart: int32(tree.attrs.len())))
+
+  if tree.cur != -1:
+    let parent = addr tree.nodes[tree.cur]
+    if parent.lastKid == -1:
+      parent.firstKid = ix
+    else:
+      tree.nodes[parent.lastKid].next = ix
+    parent.lastKid = ix
+
+  case kind
+  of HtmlDocument, HtmlTemplate, HtmlElement:
+    tree.cur = ix
+  else:
+    discard
+
+proc compact_leave(tree: HtmlCompactTree) {.exportc, cdecl.} =
+  tree.cur = tree.nodes[tree.cur].parent
+
+proc compact_attribute(tree: HtmlCompactTree, n: pointer, nl: csize_t,
+                       v: pointer, vl: csize_t) {.exportc, cdecl.} =
+  tree.attrs.add(HtmlCompactAttr(name: tree.toSlice(n, nl),
+                                 value: tree.toSlice(v, vl)))
+  tree.nodes[tree.cur].attrCount += 1
+
+proc parseDocumentCompact*(html: string): HtmlCompactTree =
+  ## Like `parseDocument()`, but builds an `HtmlCompactTree`, which
+  ## is much easier on the allocator for big documents.
+  result = HtmlCompactTree(cur: -1)
+  result.arena = newStringOfCap(html.len())
+
+  make_gumbo_compact(cstring(html), cast[pointer](result))
+
+proc root*(tree: HtmlCompactTree): HtmlNodeView =
+  return HtmlNodeView(tree: tree, ix: 0)
+
+proc kind*(n: HtmlNodeView): HtmlNodeType =
+  return n.tree.nodes[n.ix].kind
+
+proc slice(n: HtmlNodeView, s: HtmlSlice): string =
+  return n.tree.arena[s.offset ..< s.offset + s.len]
+
+proc contents*(n: HtmlNodeView): string =
+  return n.slice(n.tree.nodes[n.ix].contents)
+
+proc tagName*(n: HtmlNodeView): string =
+  let s = n.tree.nodes[n.ix].contents
+
+  if s.len >= 2 and n.tree.arena[s.offset] == '<' and
+     n.tree.arena[s.offset + s.len - 1] == '>':
+    return n.tree.arena[s.offset + 1 ..< s.offset + s.len - 1]
+  return n.contents()
+
+iterator children*(n: HtmlNodeView): HtmlNodeView =
+  var ix = n.tree.nodes[n.ix].firstKid
+
+  while ix != -1:
+    yield HtmlNodeView(tree: n.tree, ix: ix)
+    ix = n.tree.nodes[ix].next
+
+proc findAttr(n: HtmlNodeView, name: string): int =
+  let node = n.tree.nodes[n.ix]
+
+  for i in node.attrStart ..< node.attrStart + node.attrCount:
+    let s = n.tree.attrs[i].name
+    if s.len == name.len and (name.len == 0 or
+       equalMem(addr n.tree.arena[s.offset], unsafeAddr name[0], name.len)):
+      return i
+
+  return -1
+
+proc hasAttr*(n: HtmlNodeView, name: string): bool =
+  return n.findAttr(name) != -1
+
+proc getAttr*(n: HtmlNodeView, name: string): string =
+  let i = n.findAttr(name)
+
+  if i != -1:
+    return n.slice(n.tree.attrs[i].value)
+
 
 include "headers/gumbo.nim"
 
@@ -162,6 +309,71 @@ tree_traverse(GumboNode *node, void *userdata)
     return;
 }
 
+// The compact walk hands over pointers and lengths instead of
+// copies, since the Nim side copies everything into its arena anyway.
+static void
+tree_traverse_compact(GumboNode *node, void *userdata)
+{
+    GumboVector *children = NULL;
+    const char  *contents;
+    size_t       len;
+
+    switch (node->type) {
+      case GUMBO_NODE_DOCUMENT:
+        contents = "";
+        len      = 0;
+        break;
+      case GUMBO_NODE_ELEMENT:
+      case GUMBO_NODE_TEMPLATE:
+        if (node->v.element.tag != GUMBO_TAG_UNKNOWN) {
+            contents = gumbo_normalized_tagname(node->v.element.tag);
+            len      = strlen(contents);
+        }
+        else {
+            contents = node->v.element.original_tag.data;
+            len      = node->v.element.original_tag.length;
+        }
+        break;
+      default:
+        contents = node->v.text.text;
+        len      = strlen(contents);
+    }
+
+    compact_enter(userdata, node->type, contents, len);
+
+    switch (node->type) {
+    case GUMBO_NODE_ELEMENT:
+    case GUMBO_NODE_TEMPLATE:
+      for (int i = 0; i < node->v.element.attributes.length; i++) {
+          GumboAttribute *x = node->v.element.attributes.data[i];
+
+          compact_attribute(userdata, x->name, strlen(x->name),
+                            x->value, strlen(x->value));
+      }
+      children = &node->v.element.children;
+      recurse:
+        for (int i = 0; i < children->length; i++) {
+            tree_traverse_compact(children->data[i], userdata);
+        }
+        compact_leave(userdata);
+        break;
+    case GUMBO_NODE_DOCUMENT:
+      children = &node->v.document.children;
+      goto recurse;
+    default:
+        return;
+    }
+    return;
+}
+
+void
+make_gumbo_compact(char *html, void *userdata)
+{
+  GumboOutput *res = gumbo_parse(html);
+  tree_traverse_compact(res->root, userdata);
+  gumbo_destroy_output(res);
+}
+
 void
 make_gumbo(char *html, void *userdata)
 {
@@ -0,0 +1,379 @@
+## Line breaking per Unicode Standard Annex #14, using the pair table
+## approach the annex describes.
+##
+## The line break class for every codepoint lives in a two-stage table
+## that is built at compile time. The unicodedb version we pin doesn't
+## carry the Line_Break property, so we derive classes from the general
+## category and East Asian width, plus the explicit lists in UAX #14.
+## That gets the common cases right, but it isn't a byte-for-byte copy
+## of LineBreak.txt.
+##
+## The pair table itself is also computed at compile time, from rules
+## LB7 - LB30b.
+##
+## :Author: John Viega (john@crashoverride.com)
+## :Copyright: 2023, Crash Override, Inc.
+
+import unicode, tables, unicodedb/properties, unicodedb/widths
+
+type
+  LineBreakClass* = enum
+    # The classes the pair table handles come first.
+    LbOP, LbCL, LbCP, LbQU, LbGL, LbNS, LbEX, LbSY, LbIS, LbPR, LbPO,
+    LbNU, LbAL, LbHL, LbID, LbIN, LbHY, LbBA, LbBB, LbB2, LbZW, LbCM,
+    LbWJ, LbH2, LbH3, LbJL, LbJV, LbJT, LbRI, LbEB, LbEM,
+    # These get handled before we get to the table.
+    LbBK, LbCR, LbLF, LbNL, LbSP
+
+  LbAction = enum
+    LbDirect,     # Break, even with no space in between.
+    LbIndirect,   # Break only if there were spaces in between.
+    LbProhibited  # Never break, even across spaces.
+
+const
+  lbHardBreaks = {LbBK, LbCR, LbLF, LbNL}
+
+  # Overrides for codepoints where the category and width don't tell
+  # us enough. These win over everything else.
+  lbExplicit = [
+    (0x0009, 0x0009, LbBA), (0x000a, 0x000a, LbLF), (0x000b, 0x000c, LbBK),
+    (0x000d, 0x000d, LbCR), (0x0020, 0x0020, LbSP), (0x0021, 0x0021, LbEX),
+    (0x0022, 0x0022, LbQU), (0x0024, 0x0024, LbPR), (0x0025, 0x0025, LbPO),
+    (0x0027, 0x0027, LbQU), (0x0028, 0x0028, LbOP), (0x0029, 0x0029, LbCP),
+    (0x002b, 0x002b, LbPR), (0x002c, 0x002c, LbIS), (0x002d, 0x002d, LbHY),
+    (0x002e, 0x002e, LbIS), (0x002f, 0x002f, LbSY), (0x003a, 0x003b, LbIS),
+    (0x003f, 0x003f, LbEX), (0x005b, 0x005b, LbOP), (0x005c, 0x005c, LbPR),
+    (0x005d, 0x005d, LbCP), (0x007b, 0x007b, LbOP), (0x007c, 0x007c, LbBA),
+    (0x007d, 0x007d, LbCL), (0x0085, 0x0085, LbNL), (0x00a0, 0x00a0, LbGL),
+    (0x00a1, 0x00a1, LbOP), (0x00a2, 0x00a2, LbPO), (0x00a3, 0x00a5, LbPR),
+    (0x00ab, 0x00ab, LbQU), (0x00ad, 0x00ad, LbBA), (0x00b0, 0x00b0, LbPO),
+    (0x00b1, 0x00b1, LbPR), (0x00b4, 0x00b4, LbBB), (0x00bb, 0x00bb, LbQU),
+    (0x00bf, 0x00bf, LbOP), (0x02c8, 0x02c8, LbBB), (0x02cc, 0x02cc, LbBB),
+    (0x02df, 0x02df, LbBB), (0x034f, 0x034f, LbGL), (0x037e, 0x037e, LbIS),
+    (0x0589, 0x0589, LbIS), (0x058a, 0x058a, LbBA), (0x058f, 0x058f, LbPR),
+    (0x05be, 0x05be, LbBA), (0x05c6, 0x05c6, LbEX), (0x05d0, 0x05ea, LbHL),
+    (0x05ef, 0x05f2, LbHL), (0x0609, 0x060b, LbPO), (0x060c, 0x060d, LbIS),
+    (0x061b, 0x061b, LbEX), (0x061e, 0x061f, LbEX), (0x066a, 0x066a, LbPO),
+    (0x06d4, 0x06d4, LbEX), (0x07f8, 0x07f8, LbIS), (0x07f9, 0x07f9, LbEX),
+    (0x0964, 0x0965, LbBA), (0x0e3f, 0x0e3f, LbPR), (0x0e5a, 0x0e5b, LbBA),
+    (0x0f01, 0x0f04, LbBB), (0x0f06, 0x0f07, LbBB), (0x0f08, 0x0f08, LbGL),
+    (0x0f09, 0x0f0a, LbBB), (0x0f0b, 0x0f0b, LbBA), (0x0f0c, 0x0f0c, LbGL),
+    (0x0f0d, 0x0f11, LbEX), (0x0f12, 0x0f12, LbGL), (0x0f14, 0x0f14, LbEX),
+    (0x1100, 0x115f, LbJL), (0x1160, 0x11a7, LbJV), (0x11a8, 0x11ff, LbJT),
+    (0x1361, 0x1361, LbBA), (0x1680, 0x1680, LbBA), (0x17d4, 0x17d5, LbBA),
+    (0x17d6, 0x17d6, LbNS), (0x17db, 0x17db, LbPR), (0x1800, 0x1801, LbAL),
+    (0x1802, 0x1803, LbEX), (0x1804, 0x1805, LbBA), (0x1806, 0x1806, LbBB),
+    (0x1808, 0x1809, LbEX), (0x180e, 0x180e, LbGL), (0x1944, 0x1945, LbEX),
+    (0x2007, 0x2007, LbGL), (0x200b, 0x200b, LbZW), (0x200d, 0x200d, LbCM),
+    (0x2010, 0x2010, LbBA), (0x2011, 0x2011, LbGL), (0x2012, 0x2013, LbBA),
+    (0x2014, 0x2014, LbB2), (0x2024, 0x2026, LbIN), (0x2027, 0x2027, LbBA),
+    (0x2028, 0x2029, LbBK), (0x202f, 0x202f, LbGL), (0x2030, 0x2037, LbPO),
+    (0x203c, 0x203d, LbNS), (0x2044, 0x2044, LbIS), (0x2047, 0x2049, LbNS),
+    (0x2056, 0x2056, LbBA), (0x2058, 0x205b, LbBA), (0x205d, 0x205e, LbBA),
+    (0x205f, 0x205f, LbBA), (0x2060, 0x2060, LbWJ), (0x20a7, 0x20a7, LbPO),
+    (0x20b6, 0x20b6, LbPO), (0x20bb, 0x20bb, LbPO), (0x20be, 0x20be, LbPO),
+    (0x2103, 0x2103, LbPO), (0x2109, 0x2109, LbPO), (0x2116, 0x2116, LbPR),
+    (0x2212, 0x2213, LbPR), (0x22ef, 0x22ef, LbIN), (0x261d, 0x261d, LbEB),
+    (0x26f9, 0x26f9, LbEB), (0x270a, 0x270d, LbEB), (0x275b, 0x2760, LbQU),
+    (0x2762, 0x2763, LbEX), (0x2cf9, 0x2cf9, LbEX), (0x2cfa, 0x2cfc, LbBA),
+    (0x2cfe, 0x2cfe, LbEX), (0x2cff, 0x2cff, LbBA), (0x2e00, 0x2e0d, LbQU),
+    (0x2e0e, 0x2e15, LbBA), (0x2e17, 0x2e17, LbBA), (0x2e18, 0x2e18, LbOP),
+    (0x2e19, 0x2e19, LbBA), (0x2e1c, 0x2e1d, LbQU), (0x2e20, 0x2e21, LbQU),
+    (0x2e2a, 0x2e2d, LbBA), (0x2e2e, 0x2e2e, LbEX), (0x2e30, 0x2e31, LbBA),
+    (0x2e3a, 0x2e3b, LbB2), (0x3000, 0x3000, LbBA), (0x3001, 0x3002, LbCL),
+    (0x3005, 0x3005, LbNS), (0x301c, 0x301c, LbNS), (0x303b, 0x303c, LbNS),
+    # Small kana are CJ, which we treat as NS (the strict rule set).
+    (0x3041, 0x3041, LbNS), (0x3043, 0x3043, LbNS), (0x3045, 0x3045, LbNS),
+    (0x3047, 0x3047, LbNS), (0x3049, 0x3049, LbNS), (0x3063, 0x3063, LbNS),
+    (0x3083, 0x3083, LbNS), (0x3085, 0x3085, LbNS), (0x3087, 0x3087, LbNS),
+    (0x308e, 0x308e, LbNS), (0x3095, 0x3096, LbNS), (0x309b, 0x309e, LbNS),
+    (0x30a0, 0x30a1, LbNS), (0x30a3, 0x30a3, LbNS), (0x30a5, 0x30a5, LbNS),
+    (0x30a7, 0x30a7, LbNS), (0x30a9, 0x30a9, LbNS), (0x30c3, 0x30c3, LbNS),
+    (0x30e3, 0x30e3, LbNS), (0x30e5, 0x30e5, LbNS), (0x30e7, 0x30e7, LbNS),
+    (0x30ee, 0x30ee, LbNS), (0x30f5, 0x30f6, LbNS), (0x30fb, 0x30fc, LbNS),
+    (0x30fd, 0x30fe, LbNS), (0x31f0, 0x31ff, LbNS), (0xa015, 0xa015, LbNS),
+    (0xa4fe, 0xa4ff, LbBA), (0xa60d, 0xa60d, LbBA), (0xa60e, 0xa60e, LbEX),
+    (0xa60f, 0xa60f, LbBA), (0xa874, 0xa875, LbBB), (0xa876, 0xa877, LbEX),
+    (0xa960, 0xa97c, LbJL), (0xd7b0, 0xd7c6, LbJV), (0xd7cb, 0xd7fb, LbJT),
+    (0xfb1d, 0xfb1d, LbHL), (0xfb1f, 0xfb28, LbHL), (0xfb2a, 0xfb4f, LbHL),
+    (0xfe10, 0xfe10, LbIS), (0xfe11, 0xfe12, LbCL), (0xfe13, 0xfe14, LbIS),
+    (0xfe15, 0xfe16, LbEX), (0xfe19, 0xfe19, LbIN), (0xfe50, 0xfe50, LbCL),
+    (0xfe52, 0xfe52, LbCL), (0xfe54, 0xfe55, LbNS), (0xfe56, 0xfe57, LbEX),
+    (0xfe69, 0xfe69, LbPR), (0xfe6a, 0xfe6a, LbPO), (0xfeff, 0xfeff, LbWJ),
+    (0xff01, 0xff01, LbEX), (0xff04, 0xff04, LbPR), (0xff05, 0xff05, LbPO),
+    (0xff0c, 0xff0c, LbCL), (0xff0e, 0xff0e, LbCL), (0xff1a, 0xff1b, LbNS),
+    (0xff1f, 0xff1f, LbEX), (0xff61, 0xff61, LbCL), (0xff64, 0xff64, LbCL),
+    (0xff65, 0xff65, LbNS), (0xff67, 0xff70, LbNS), (0xff9e, 0xff9f, LbNS),
+    (0xffe0, 0xffe0, LbPO), (0xffe1, 0xffe1, LbPR), (0xffe5, 0xffe6, LbPR),
+    (0x1f1e6, 0x1f1ff, LbRI), (0x1f385, 0x1f385, LbEB),
+    (0x1f3c2, 0x1f3c4, LbEB), (0x1f3c7, 0x1f3c7, LbEB),
+    (0x1f3ca, 0x1f3cc, LbEB), (0x1f3fb, 0x1f3ff, LbEM),
+    (0x1f442, 0x1f443, LbEB), (0x1f446, 0x1f450, LbEB),
+    (0x1f466, 0x1f478, LbEB), (0x1f47c, 0x1f47c, LbEB),
+    (0x1f481, 0x1f483, LbEB), (0x1f485, 0x1f487, LbEB),
+    (0x1f4aa, 0x1f4aa, LbEB), (0x1f574, 0x1f575, LbEB),
+    (0x1f57a, 0x1f57a, LbEB), (0x1f590, 0x1f590, LbEB),
+    (0x1f595, 0x1f596, LbEB), (0x1f645, 0x1f647, LbEB),
+    (0x1f64b, 0x1f64f, LbEB), (0x1f6a3, 0x1f6a3, LbEB),
+    (0x1f6b4, 0x1f6b6, LbEB), (0x1f6c0, 0x1f6c0, LbEB),
+    (0x1f6cc, 0x1f6cc, LbEB), (0x1f90c, 0x1f90c, LbEB),
+    (0x1f90f, 0x1f90f, LbEB), (0x1f918, 0x1f91f, LbEB),
+    (0x1f926, 0x1f926, LbEB), (0x1f930, 0x1f939, LbEB),
+    (0x1f93c, 0x1f93e, LbEB), (0x1f977, 0x1f977, LbEB),
+    (0x1f9b5, 0x1f9b6, LbEB), (0x1f9b8, 0x1f9b9, LbEB),
+    (0x1f9bb, 0x1f9bb, LbEB), (0x1f9cd, 0x1f9cf, LbEB),
+    (0x1f9d1, 0x1f9dd, LbEB)
+  ]
+
+proc categoryLineBreakClass(cp: int): LineBreakClass =
+  # The fallback, for when a codepoint isn't in one of the lists.
+  let
+    r   = Rune(cp)
+    cat = r.unicodeCategory()
+
+  if cat in ctgMn + ctgMc + ctgMe + ctgCc + ctgCf:
+    return LbCM
+  if cat in ctgNd:
+    return LbNU
+  if cat in ctgPs:
+    return LbOP
+  if cat in ctgPe:
+    return LbCL
+  if cat in ctgPi + ctgPf:
+    return LbQU
+  if cat in ctgSc:
+    return LbPR
+  if cat in ctgPd + ctgZs:
+    return LbBA
+
+  case r.unicodeWidth()
+  of uwdtFull, uwdtWide:
+    return LbID
+  else:
+    return LbAL
+
+proc pairAction(a, b: LineBreakClass): LbAction =
+  # `a` is the class before the (possible) break and `b` after, with
+  # any spaces in between already set aside. Rules are in the order
+  # UAX #14 applies them; LB18 (break after spaces) is what makes the
+  # rest "indirect".
+  if b == LbZW:                                                 # LB7
+    return LbProhibited
+  if a == LbZW:                                                 # LB8
+    return LbDirect
+  if b == LbCM:                                                 # LB9
+    return LbProhibited
+  if b == LbWJ:                                                 # LB11
+    return LbProhibited
+  if a == LbWJ or a == LbGL:                                    # LB11, LB12
+    return LbIndirect
+  if b == LbGL:                                                 # LB12a
+    return if a in {LbBA, LbHY}: LbDirect else: LbIndirect
+  if b in {LbCL, LbCP, LbEX, LbIS, LbSY}:                       # LB13
+    return LbProhibited
+  if a == LbOP:                                                 # LB14
+    return LbProhibited
+  if a == LbQU and b == LbOP:                                   # LB15
+    return LbProhibited
+  if a in {LbCL, LbCP} and b == LbNS:                           # LB16
+    return LbProhibited
+  if a == LbB2 and b == LbB2:                                   # LB17
+    return LbProhibited
+  if a == LbQU or b == LbQU:                                    # LB19
+    return LbIndirect
+  if b in {LbBA, LbHY, LbNS} or a == LbBB:                      # LB21
+    return LbIndirect
+  if a == LbSY and b == LbHL:                                   # LB21b
+    return LbIndirect
+  if b == LbIN:                                                 # LB22
+    return LbIndirect
+  if (a in {LbAL, LbHL} and b == LbNU) or
+     (a == LbNU and b in {LbAL, LbHL}):                         # LB23
+    return LbIndirect
+  if (a == LbPR and b in {LbID, LbEB, LbEM}) or
+     (a in {LbID, LbEB, LbEM} and b == LbPO):                   # LB23a
+    return LbIndirect
+  if (a in {LbPR, LbPO} and b in {LbAL, LbHL}) or
+     (a in {LbAL, LbHL} and b in {LbPR, LbPO}):                 # LB24
+    return LbIndirect
+  if (a in {LbCL, LbCP, LbNU} and b in {LbPO, LbPR}) or
+     (a in {LbPO, LbPR} and b in {LbOP, LbNU}) or
+     (a in {LbHY, LbIS, LbNU, LbSY} and b == LbNU):             # LB25
+    return LbIndirect
+  if (a == LbJL and b in {LbJL, LbJV, LbH2, LbH3}) or
+     (a in {LbJV, LbH2} and b in {LbJV, LbJT}) or
+     (a in {LbJT, LbH3} and b == LbJT):                         # LB26
+    return LbIndirect
+  if (a in {LbJL, LbJV, LbJT, LbH2, LbH3} and b == LbPO) or
+     (a == LbPR and b in {LbJL, LbJV, LbJT, LbH2, LbH3}):       # LB27
+    return LbIndirect
+  if a in {LbAL, LbHL} and b in {LbAL, LbHL}:                   # LB28
+    return LbIndirect
+  if a == LbIS and b in {LbAL, LbHL}:                           # LB29
+    return LbIndirect
+  if (a in {LbAL, LbHL, LbNU} and b == LbOP) or
+     (a == LbCP and b in {LbAL, LbHL, LbNU}):                   # LB30
+    return LbIndirect
+  if a == LbRI and b == LbRI:                                   # LB30a
+    return LbIndirect
+  if a == LbEB and b == LbEM:                                   # LB30b
+    return LbIndirect
+
+  return LbDirect                                               # LB31
+
+proc buildPairTable(): array[LbOP .. LbEM, array[LbOP .. LbEM, LbAction]] =
+  for a in LbOP .. LbEM:
+    for b in LbOP .. LbEM:
+      result[a][b] = pairAction(a, b)
+
+const
+  lbBlockBits = 8
+  lbBlockSize = 1 shl lbBlockBits
+  lbNumBlocks = 0x110000 shr lbBlockBits
+
+proc classAt(derived: seq[uint8], cp: int): uint8 =
+  # We only derive classes for planes 0 and 1, and for the tags and
+  # variation selectors in plane 14. Planes 2 and 3 are all
+  # ideographs, and everything else is AL.
+  if cp < 0x20000:
+    return derived[cp]
+  elif cp >= 0xe0000 and cp < 0xe1000:
+    return derived[cp - 0xe0000 + 0x20000]
+  elif cp < 0x40000:
+    return uint8(LbID)
+  else:
+    return uint8(LbAL)
+
+proc buildClassTables(): (seq[uint16], seq[uint8]) =
+  # Stage one maps each 256-codepoint block to a block in stage two;
+  # identical blocks are shared. This all runs in the VM, so we fill
+  # the derived ranges in one pass and apply the lists on top, rather
+  # than searching the lists per codepoint.
+  var
+    derived = newSeq[uint8](0x21000)
+    stage1  = newSeq[uint16](lbNumBlocks)
+    stage2: seq[uint8]
+    seen    = initTable[seq[uint8], int]()
+    blk     = newSeq[uint8](lbBlockSize)
+
+  for cp in 0 ..< 0x20000:
+    derived[cp] = uint8(categoryLineBreakClass(cp))
+  for cp in 0xe0000 ..< 0xe1000:
+    derived[cp - 0xe0000 + 0x20000] = uint8(categoryLineBreakClass(cp))
+
+  # Hangul syllables are LV (H2) every 28 codepoints, else LVT (H3).
+  for cp in 0xac00 .. 0xd7a3:
+    derived[cp] = uint8(if (cp - 0xac00) mod 28 == 0: LbH2 else: LbH3)
+
+  for (lo, hi, cls) in lbExplicit:
+    for cp in lo .. hi:
+      derived[cp] = uint8(cls)
+
+  for b in 0 ..< lbNumBlocks:
+    for i in 0 ..< lbBlockSize:
+      blk[i] = derived.classAt((b shl lbBlockBits) + i)
+
+    if blk notin seen:
+      seen[blk] = len(stage2) div lbBlockSize
+      stage2 &= blk
+
+    stage1[b] = uint16(seen[blk])
+
+  return (stage1, stage2)
+
+proc toArray[N: static int, T](s: seq[T]): array[N, T] =
+  for i in 0 ..< N:
+    result[i] = s[i]
+
+const
+  lbPairTable = buildPairTable()
+  lbTables    = buildClassTables()
+  lbStage1    = toArray[lbNumBlocks, uint16](lbTables[0])
+  lbStage2    = toArray[lbTables[1].len(), uint8](lbTables[1])
+
+proc buildAsciiTable(): array[128, LineBreakClass] =
+  for i in 0 ..< 128:
+    result[i] = LineBreakClass(lbStage2[int(lbStage1[0]) * lbBlockSize + i])
+
+const lbAscii = buildAsciiTable()
+
+proc lineBreakClass*(cp: uint32): LineBreakClass {.inline.} =
+  ## Returns the UAX #14 line break class for a codepoint. Ambiguous,
+  ## unknown and surrogate classes come back as AL, conditional
+  ## Japanese starters as NS, and complex-context (SA) letters as AL.
+  if cp < 128:
+    return lbAscii[cp]
+  if cp > 0x10ffff:
+    return LbAL
+
+  let blk = int(lbStage1[cp shr lbBlockBits])
+  return LineBreakClass(lbStage2[blk * lbBlockSize +
+                                 int(cp and (lbBlockSize - 1))])
+
+proc lineBreakOpps*(s: openArray[uint32]): seq[int] =
+  ## Returns the indices `i` where a line may break before `s[i]`. For
+  ## a break after spaces, we give the index of the first space, since
+  ## wrapping drops them anyway. Values above U+10FFFF (our style
+  ## markers) are skipped over, and there's never a break before the
+  ## first non-space.
+  var
+    prev       = LbAL
+    started    = false
+    spaceStart = -1
+    riCount    = 0
+
+  for i, cp in s:
+    if cp > 0x10ffff:
+      continue
+
+    var cls = cp.lineBreakClass()
+
+    if not started:
+      if cls == LbSP or cls in lbHardBreaks:
+        continue
+      prev    = if cls == LbCM: LbAL else: cls           # LB10
+      riCount = if cls == LbRI: 1 else: 0
+      started = true
+      continue
+
+    case cls
+    of LbSP:
+      if spaceStart == -1:
+        spaceStart = i
+      continue
+    of LbCM:
+      if spaceStart == -1 and prev notin lbHardBreaks + {LbZW}:
+        continue                                           # LB9
+      cls = LbAL                                           # LB10
+    else:
+      discard
+
+    var canBreak: bool
+
+    if cls in lbHardBreaks:
+      canBreak = false                                     # LB6
+    elif prev in lbHardBreaks:
+      canBreak = true                                      # LB4, LB5
+    else:
+      case lbPairTable[prev][cls]
+      of LbDirect:
+        canBreak = true
+      of LbIndirect:
+        canBreak = spaceStart != -1
+      of LbProhibited:
+        canBreak = false
+
+      # LB30a: regional indicators only pair up.
+      if cls == LbRI and prev == LbRI and spaceStart == -1:
+        canBreak = riCount mod 2 == 0
+
+    if canBreak:
+      result.add(if spaceStart != -1: spaceStart else: i)
+
+    if cls == LbRI:
+      riCount = if prev == LbRI and spaceStart == -1: riCount + 1 else: 1
+    else:
+      riCount = 0
+
+    prev       = cls
+    spaceStart = -1
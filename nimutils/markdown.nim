@@ -4,7 +4,7 @@
 ## :Copyright: 2022 - 2023, Crash Override, Inc.
 
 include "headers/md4c.nim"
-import random
+import random, unicode
 
 type MdOpts* = enum
   MdCommonMark              = 0x00000000,
@@ -33,31 +33,235 @@ type MdOpts* = enum
   MdHtmlXhtml               = 0x80000000
 
 
-type HtmlOutputContainer = ref object
-    s: string
+type HtmlOutput = object
+  # Where markdownToHtml() is putting its output. `buf[0 ..< used]` is
+  # what's been written and not yet flushed. When writing to a
+  # string, that's the caller's string, and it never gets flushed.
+  buf:       string
+  used:      int
+  streaming: bool
+  file:      File
+  callback:  proc (chunk: openarray[char])
+  error:     ref CatchableError # Raised once we're back out of md4c.
+
+proc flush(o: var HtmlOutput) =
+  if o.used == 0:
+    return
+  if o.file != nil:
+    if o.file.writeBuffer(addr o.buf[0], o.used) != o.used:
+      raise newException(IOError, "Couldn't write HTML output")
+  else:
+    o.callback(o.buf.toOpenArray(0, o.used - 1))
+  o.used = 0
 
 proc nimu_process_markdown(s: ptr UncheckedArray[char], n: cuint, p: pointer) {.cdecl,exportc.} =
+  # We're called from inside md4c, so nothing can be raised through
+  # here. If a flush fails, we drop the rest of the output, and
+  # runMarkdownToHtml() raises the error when md4c is done.
+  let
+    o = cast[ptr HtmlOutput](p)
+    l = int(n)
+
+  if o.error != nil:
+    return
+
+  if o.used + l > o.buf.len():
+    if o.streaming:
+      try:
+        o[].flush()
+      except CatchableError as e:
+        o.error = e
+        return
+    if o.used + l > o.buf.len():
+      o.buf.setLen(max(o.buf.len() * 2, o.used + l))
 
-  var x: HtmlOutputContainer = (cast[ptr HtmlOutputContainer](p))[]
-  x.s.add(bytesToString(s, int(n)))
+  if l != 0:
+    copyMem(addr o.buf[o.used], s, l)
+    o.used += l
 
 proc c_markdown_to_html(s: cstring, l: cuint, o: pointer,
                         f: cint): cint {.importc, cdecl,nodecl.}
 
-proc markdownToHtml*(s: string, opts: openarray[MdOpts] = [MdGithub]): string =
-  var
-    container = HtmlOutputContainer()
-    res:       cint
-    flags:     cint
+proc estimateHtmlLen(s: string): int =
+  # Tags usually add a bit under half again to the input.
+  return s.len() + s.len() div 2 + 64
+
+proc runMarkdownToHtml(s: string, o: var HtmlOutput, opts: openarray[MdOpts]) =
+  var flags: cint
 
   for item in opts:
     flags  = flags or cast[cint](item)
 
-  res = c_markdown_to_html(cstring(s), cuint(s.len()), addr container, flags)
+  discard c_markdown_to_html(cstring(s), cuint(s.len()), addr o, flags)
+
+  if o.error != nil:
+    raise o.error
+
+proc markdownToHtml*(s: string, output: var string,
+                     opts: openarray[MdOpts] = [MdGithub]) =
+  ## Appends the HTML for `s` to `output`. The space is reserved up
+  ## front from the length of `s`, so there's normally just the one
+  ## allocation, or none if `output` is reused.
+  var o = HtmlOutput(used: output.len())
+
+  o.buf = move(output)
+  o.buf.setLen(o.used + s.estimateHtmlLen())
+  runMarkdownToHtml(s, o, opts)
+  o.buf.setLen(o.used)
+  output = move(o.buf)
+
+proc markdownToHtml*(s: string, output: File,
+                     opts: openarray[MdOpts] = [MdGithub],
+                     chunkSize = 16384) =
+  ## Streams the HTML for `s` to `output`, through a buffer of
+  ## `chunkSize` bytes, so memory use doesn't grow with the document.
+  ## Raises an IOError if a write comes up short.
+  var o = HtmlOutput(streaming: true, file: output)
+
+  o.buf = newString(chunkSize)
+  runMarkdownToHtml(s, o, opts)
+  o.flush()
+
+proc markdownToHtml*(s: string, output: proc (chunk: openarray[char]),
+                     opts: openarray[MdOpts] = [MdGithub],
+                     chunkSize = 16384) =
+  ## Streams the HTML for `s` to a callback, a chunk of up to
+  ## `chunkSize` bytes at a time (bigger only if MD4C hands us a bigger
+  ## piece at once). The chunk is only good for the duration of the
+  ## call. Good for publishing to a pubsub topic as it goes.
+  ##
+  ## If the callback raises, nothing more gets sent to it, and the
+  ## exception is re-raised from here once MD4C is done.
+  var o = HtmlOutput(streaming: true, callback: output)
+
+  o.buf = newString(chunkSize)
+  runMarkdownToHtml(s, o, opts)
+  o.flush()
+
+proc markdownToHtml*(s: string, opts: openarray[MdOpts] = [MdGithub]): string =
+  s.markdownToHtml(result, opts)
+
+type
+  MdBlockKind* {.size: sizeof(cint).} = enum
+    MdBlockDoc, MdBlockQuote, MdBlockUl, MdBlockOl, MdBlockLi, MdBlockHr,
+    MdBlockH, MdBlockCode, MdBlockHtml, MdBlockP, MdBlockTable, MdBlockThead,
+    MdBlockTbody, MdBlockTr, MdBlockTh, MdBlockTd
+
+  MdSpanKind* {.size: sizeof(cint).} = enum
+    MdSpanEm, MdSpanStrong, MdSpanA, MdSpanASelf, MdSpanACodeLink, MdSpanImg,
+    MdSpanCode, MdSpanDel, MdSpanLatexMath, MdSpanLatexMathDisplay,
+    MdSpanWikiLink, MdSpanU
+
+  MdTextKind* {.size: sizeof(cint).} = enum
+    MdTextNormal, MdTextNullChar, MdTextBr, MdTextSoftBr, MdTextEntity,
+    MdTextCode, MdTextHtml, MdTextLatexMath
+
+  MdAttribute* = object
+    ## A string attribute from the parser, which can have entities in
+    ## it; see `$`.
+    text*:          ptr UncheckedArray[char]
+    size*:          cuint
+    substrTypes*:   ptr UncheckedArray[MdTextKind]
+    substrOffsets*: ptr UncheckedArray[cuint]
+
+  # The `detail` argument to the callbacks points to one of these,
+  # depending on the kind of block or span. The ones we don't use
+  # aren't here.
+  MdBlockLiDetail* = object
+    isTask*:         cint
+    taskMark*:       char
+    taskMarkOffset*: cuint
+
+  MdBlockHDetail* = object
+    level*: cuint
+
+  MdBlockCodeDetail* = object
+    info*:      MdAttribute
+    lang*:      MdAttribute
+    fenceChar*: char
+
+  MdSpanADetail* = object
+    href*:  MdAttribute
+    title*: MdAttribute
+
+  MdSpanWikiLinkDetail* = object
+    target*: MdAttribute
+
+  MdBlockCallback* = proc (kind: MdBlockKind, detail: pointer,
+                           userdata: pointer): cint {.cdecl.}
+  MdSpanCallback*  = proc (kind: MdSpanKind, detail: pointer,
+                           userdata: pointer): cint {.cdecl.}
+  MdTextCallback*  = proc (kind: MdTextKind, text: ptr UncheckedArray[char],
+                           size: cuint, userdata: pointer): cint {.cdecl.}
+
+  MdCallbacks* = object
+    ## What `markdownParse()` calls as it goes. Returning non-zero from
+    ## any of them stops the parse, and that value gets returned.
+    enterBlock*: MdBlockCallback
+    leaveBlock*: MdBlockCallback
+    enterSpan*:  MdSpanCallback
+    leaveSpan*:  MdSpanCallback
+    text*:       MdTextCallback
+
+proc c_markdown_parse(s: cstring, l: csize_t, f: csize_t,
+                      enterBlock, leaveBlock, enterSpan, leaveSpan,
+                      text: pointer, userdata: pointer): cint
+  {.importc, cdecl, nodecl.}
+
+proc c_md_decode_entity(s: pointer, l: csize_t, o: ptr cuint): cint
+  {.importc, cdecl, nodecl.}
+
+proc markdownParse*(s: string, callbacks: MdCallbacks, userdata: pointer,
+                    opts: openarray[MdOpts] = [MdGithub]): int =
+  ## Runs MD4C's parser without the HTML renderer, calling
+  ## `callbacks` for each block, span and run of text. Returns 0 on
+  ## success, -1 if the parser failed, or whatever a callback
+  ## returned to stop it.
+  var flags: csize_t
+
+  for item in opts:
+    flags = flags or csize_t(cast[cuint](item))
+
+  return int(c_markdown_parse(cstring(s), csize_t(s.len()), flags,
+                              cast[pointer](callbacks.enterBlock),
+                              cast[pointer](callbacks.leaveBlock),
+                              cast[pointer](callbacks.enterSpan),
+                              cast[pointer](callbacks.leaveSpan),
+                              cast[pointer](callbacks.text), userdata))
+
+proc decodeMdEntity*(text: ptr UncheckedArray[char], size: int): string =
+  ## Decodes an entity the parser passed us as MdTextEntity, as the
+  ## HTML renderer would. Entities we don't know come back as-is.
+  var
+    codepoints: array[2, cuint]
+    n = c_md_decode_entity(text, csize_t(size), addr codepoints[0])
+
+  if n == 0:
+    return bytesToString(text, size)
+
+  for i in 0 ..< n:
+    result.add($(Rune(codepoints[i])))
+
+proc `$`*(attr: MdAttribute): string =
+  ## The attribute's text, with entities decoded.
+  if attr.text == nil:
+    return ""
 
-  # First removing the good stuff makes it easier to replace reliably.
+  var i = 0
+  while attr.substrOffsets[i] < attr.size:
+    let
+      off  = int(attr.substrOffsets[i])
+      size = int(attr.substrOffsets[i + 1]) - off
+      text = cast[ptr UncheckedArray[char]](addr attr.text[off])
 
-  result = container.s
+    case attr.substrTypes[i]
+    of MdTextNullChar:
+      result.add("\ufffd")
+    of MdTextEntity:
+      result.add(decodeMdEntity(text, size))
+    else:
+      result.add(bytesToString(text, size))
+    i += 1
 
 when isMainModule:
   echo markdownToHtml("""
@@ -1,21 +1,41 @@
 ## :Author: John Viega (john@crashoverride.com)
 ## :Copyright: 2023, Crash Override, Inc.
 
-import options, unicode, misc, colortable, rope_construct, rope_base,
-       rope_prerender, rope_styles
+import options, unicode, tables, misc, colortable, rope_construct, rope_base,
+       rope_prerender, rope_styles, subproc
 
 from strutils import join, endswith
+from unicodeid import runeWidth, u32LineLength
+from posix import pipe, fork, dup2, execv, exitnow, waitpid, signal, isatty,
+                  SIGPIPE, SIG_IGN
 
 template ansiReset(): string = "\e[0m"
 
-type AnsiStyleInfo = object
-  ansiStart: string
-  casing:    TextCasing
+type
+  AnsiAttr = enum
+    AaUnderline = "4", AaDoubleUnderline = "21", AaBold = "1",
+    AaItalic = "3", AaInverse = "7", AaStrikethrough = "9"
 
-proc ansiStyleInfo(b: TextPlane, ch: uint32): AnsiStyleInfo =
+  AnsiStyleInfo = ref object
+    ansiStart: string
+    casing:    TextCasing
+    attrs:     set[AnsiAttr]
+    fg:        string # SGR parameters, or "" for none.
+    bg:        string
+
+# Style ids are handed out sequentially, so the escape cache is just a
+# seq indexed from the first id. Both caches are thrown out whenever
+# the render generation changes (color settings, style maps).
+var
+  ansiCache:      seq[AnsiStyleInfo]
+  ansiDeltaCache: Table[(uint32, uint32), string]
+  ansiCacheGen    = -1
+
+proc computeAnsiStyleInfo(ch: uint32): AnsiStyleInfo =
   var codes: seq[string]
   let style = ch.idToStyle()
 
+  result        = AnsiStyleInfo()
   result.casing = style.casing.getOrElse(CasingIgnore)
 
   if not getShowColor():
@@ -23,23 +43,23 @@ proc ansiStyleInfo(b: TextPlane, ch: uint32): AnsiStyleInfo =
 
   case style.underlineStyle.getOrElse(UnderlineNone)
   of UnderlineSingle:
-    codes.add("4")
+    result.attrs.incl(AaUnderline)
   of UnderlineDouble:
-    codes.add("21")
+    result.attrs.incl(AaDoubleUnderline)
   else:
     discard
 
   if style.bold.getOrElse(false):
-    codes.add("1")
+    result.attrs.incl(AaBold)
 
   if style.italic.getOrElse(false):
-    codes.add("3")
+    result.attrs.incl(AaItalic)
 
   if style.inverse.getOrElse(false):
-    codes.add("7")
+    result.attrs.incl(AaInverse)
 
   if style.strikethrough.getOrElse(false):
-    codes.add("9")
+    result.attrs.incl(AaStrikethrough)
 
   let
     fgOpt = style.textColor
@@ -49,93 +69,275 @@ proc ansiStyleInfo(b: TextPlane, ch: uint32): AnsiStyleInfo =
     if fgOpt.isSome() and fgOpt.get() != "":
       let fgCode = fgOpt.get().colorNameToHex()
       if fgCode[0] != -1:
-        codes.add("38;2;" & $(fgCode[0]) & ";" & $(fgCode[1]) & ";" &
-                  $(fgCode[2]))
+        result.fg = "38;2;" & $(fgCode[0]) & ";" & $(fgCode[1]) & ";" &
+                    $(fgCode[2])
 
     if bgOpt.isSome() and bgOpt.get() != "":
       let bgCode = bgOpt.get().colorNameToHex()
       if bgCode[0] != -1:
-        codes.add("48;2;" & $(bgCode[0]) & ";" & $(bgCode[1]) & ";" &
-                  $(bgCode[2]))
+        result.bg = "48;2;" & $(bgCode[0]) & ";" & $(bgCode[1]) & ";" &
+                    $(bgCode[2])
   else:
     if fgOpt.isSome() and fgOpt.get() != "":
       let fgCode = fgOpt.get().colorNameToVga()
       if fgCode != -1:
-        codes.add("38;5;" & $(fgCode))
+        result.fg = "38;5;" & $(fgCode)
 
     if bgOpt.isSome() and bgOpt.get() != "":
       let bgCode = bgOpt.get().colorNameToVga()
       if bgCode != -1:
-        codes.add("48;5;" & $(bgCode))
+        result.bg = "48;5;" & $(bgCode)
+
+  for attr in result.attrs:
+    codes.add($(attr))
+  if result.fg != "":
+    codes.add(result.fg)
+  if result.bg != "":
+    codes.add(result.bg)
 
   if len(codes) > 0:
     result.ansiStart = "\e[" & codes.join(";") & "m"
 
-proc preRenderBoxToAnsiString*(b: TextPlane, ensureNl = true): string =
-  # TODO: Add back in unicode underline, etc.
-  var
-    styleInfo:  AnsiStyleInfo
-    shouldTitle = false
+proc checkAnsiCacheGeneration() {.inline.} =
+  if ansiCacheGen != getRenderGeneration():
+    ansiCache.setLen(0)
+    ansiDeltaCache.clear()
+    ansiCacheGen = getRenderGeneration()
 
-  for line in b.lines:
-    for ch in line:
-      if ch > 0x10ffff:
-        if ch == StylePop:
-          continue
+proc ansiStyleInfo(ch: uint32): AnsiStyleInfo =
+  checkAnsiCacheGeneration()
+
+  if ch < firstStyleId:
+    return ch.computeAnsiStyleInfo()
+
+  let ix = int(ch - firstStyleId)
+
+  if ix < ansiCache.len() and ansiCache[ix] != nil:
+    return ansiCache[ix]
+
+  result = ch.computeAnsiStyleInfo()
+
+  if ix >= ansiCache.len():
+    ansiCache.setLen(ix + 1)
+  ansiCache[ix] = result
+
+proc computeAnsiStyleDelta(cur, next: uint32): string =
+  let nextInfo = next.ansiStyleInfo()
+
+  if cur == 0:
+    return nextInfo.ansiStart
+
+  let curInfo = cur.ansiStyleInfo()
+
+  if curInfo.attrs - nextInfo.attrs != {} or
+     (curInfo.fg != "" and nextInfo.fg == "") or
+     (curInfo.bg != "" and nextInfo.bg == ""):
+    return ansiReset() & nextInfo.ansiStart
+
+  var codes: seq[string]
+
+  for attr in nextInfo.attrs - curInfo.attrs:
+    codes.add($(attr))
+  if nextInfo.fg != curInfo.fg:
+    codes.add(nextInfo.fg)
+  if nextInfo.bg != curInfo.bg:
+    codes.add(nextInfo.bg)
+  if len(codes) > 0:
+    result = "\e[" & codes.join(";") & "m"
+
+proc addStyleDelta(buf: var string, cur, next: uint32) =
+  # Adds what it takes to get the terminal from style `cur` to `next`.
+  # A `cur` of 0 means the terminal was just reset. Otherwise, we only
+  # reset if `next` drops an attribute or a color that `cur` set.
+  let key = (cur, next)
+
+  checkAnsiCacheGeneration()
+  ansiDeltaCache.withValue(key, cached):
+    buf &= cached[]
+    return
+
+  let delta = computeAnsiStyleDelta(cur, next)
+
+  buf &= delta
+  ansiDeltaCache[key] = delta
+
+proc writeAll(fd: FileHandle, s: string) =
+  var done = 0
+
+  while done < s.len():
+    let n = posix.write(fd, unsafeAddr s[done], s.len() - done)
+    if n < 0:
+      if posix.errno == posix.EINTR:
+        continue
+      raise newException(IOError, "Couldn't write to fd " & $(fd))
+    done += n
+
+type AnsiWriter* = object
+  ## Renders pre-rendered planes as ANSI text into a buffer that gets
+  ## reused, writing it out once it passes `flushAt` bytes. Without a
+  ## file or fd, everything stays in the buffer; see `takeOutput()`.
+  buf:         string
+  flushAt:     int
+  file:        File
+  fd:          FileHandle
+  useFd:       bool
+  casing:      TextCasing
+  termStyle:   uint32 # What the terminal has; 0 after a reset.
+  shouldTitle: bool
+
+const defaultAnsiFlushAt* {.intdefine.} = 65536
+
+proc newAnsiWriter*(file: File = stdout,
+                    flushAt = defaultAnsiFlushAt): AnsiWriter =
+  result = AnsiWriter(file: file, flushAt: flushAt)
+  result.buf = newStringOfCap(flushAt + 256)
+
+proc newAnsiWriter*(fd: FileHandle,
+                    flushAt = defaultAnsiFlushAt): AnsiWriter =
+  ## Writes straight to a file descriptor, with write(). The
+  ## descriptor does not get closed.
+  result     = AnsiWriter(fd: fd, useFd: true, flushAt: flushAt)
+  result.buf = newStringOfCap(flushAt + 256)
+
+proc newAnsiStringWriter*(sizeHint = 0): AnsiWriter =
+  result = AnsiWriter(flushAt: high(int))
+  result.buf = newStringOfCap(sizeHint)
+
+proc flush*(w: var AnsiWriter) =
+  if w.buf.len() == 0:
+    return
+  if w.useFd:
+    w.fd.writeAll(w.buf)
+  elif w.file != nil:
+    w.file.write(w.buf)
+    w.file.flushFile()
+  else:
+    return
+  w.buf.setLen(0)
+
+proc takeOutput*(w: var AnsiWriter): string =
+  ## For writers without a file, returns what's been rendered so far.
+  result = move(w.buf)
+  w.buf  = ""
+
+template maybeFlush(w: var AnsiWriter) =
+  if w.buf.len() >= w.flushAt:
+    w.flush()
+
+proc addRune(buf: var string, ch: uint32) {.inline.} =
+  # UTF-8 encode in place, so we don't build a string per codepoint.
+  if ch < 0x80:
+    buf.add(char(ch))
+  elif ch < 0x800:
+    buf.add(char(0xc0 or (ch shr 6)))
+    buf.add(char(0x80 or (ch and 0x3f)))
+  elif ch < 0x10000:
+    buf.add(char(0xe0 or (ch shr 12)))
+    buf.add(char(0x80 or ((ch shr 6) and 0x3f)))
+    buf.add(char(0x80 or (ch and 0x3f)))
+  else:
+    buf.add(char(0xf0 or (ch shr 18)))
+    buf.add(char(0x80 or ((ch shr 12) and 0x3f)))
+    buf.add(char(0x80 or ((ch shr 6) and 0x3f)))
+    buf.add(char(0x80 or (ch and 0x3f)))
+
+proc write*(w: var AnsiWriter, s: string) =
+  ## Adds raw text, which is not interpreted.
+  w.buf &= s
+  w.maybeFlush()
+
+proc addRunes(w: var AnsiWriter, line: openArray[uint32],
+              emit: static[bool]) =
+  # Without `emit`, nothing gets added to the buffer, but the style
+  # and casing state moves along as if it had been.
+  for ch in line:
+    if ch > 0x10ffff:
+      if ch == StylePop:
+        continue
+
+      let styleInfo = ch.ansiStyleInfo()
+
+      w.casing = styleInfo.casing
+      # A style with no codes of its own leaves the previous one on.
+      if styleInfo.ansiStart.len() > 0 and getShowColor():
+        when emit:
+          w.buf.addStyleDelta(w.termStyle, ch)
+        w.termStyle = ch
+      if w.casing == CasingTitle:
+        w.shouldTitle = true
+    elif w.casing == CasingTitle:
+      let alpha = Rune(ch).isAlpha()
+
+      when emit:
+        if alpha and w.shouldTitle:
+          w.buf.addRune(uint32(Rune(ch).toUpper()))
         else:
-          styleInfo = b.ansiStyleInfo(ch)
-        if styleInfo.ansiStart.len() > 0 and getShowColor():
-          result &= ansiReset()
-          result &= styleInfo.ansiStart
-        if styleInfo.casing == CasingTitle:
-          shouldTitle = true
-      else:
-        case styleInfo.casing
-        of CasingTitle:
-          if Rune(ch).isAlpha():
-            if shouldTitle:
-              result &= $(Rune(ch).toUpper())
-              shouldTitle = false
-            else:
-              result &= $(Rune(ch))
-              shouldTitle = false
-          else:
-            shouldTitle = true
-            result &= $(Rune(ch))
+          w.buf.addRune(ch)
+      w.shouldTitle = not alpha
+    else:
+      when emit:
+        case w.casing
         of CasingUpper:
-          result &= $(Rune(ch).toUpper())
+          w.buf.addRune(uint32(Rune(ch).toUpper()))
         of CasingLower:
-          result &= $(Rune(ch).toLower())
+          w.buf.addRune(uint32(Rune(ch).toLower()))
         else:
-          result &= $(Rune(ch))
-    if not b.softBreak:
-      result &= "\n"
-    if getShowColor():
-      result &= ansiReset()
-
-  # if ensureNl and not result.endswith("\n"):
-  #   if styleInfo.ansiStart.len() > 0 and getShowColor():
-  #     result &= ansiReset() & styleInfo.ansiStart & "\n" & ansiReset()
-  #   else:
-  #     result = "\n"
+          w.buf.addRune(ch)
+
+proc writeLine*(w: var AnsiWriter, line: openArray[uint32],
+                newline = true) =
+  ## Renders one line of a plane. The style in effect carries over
+  ## from the previous line written.
+  w.addRunes(line, true)
+
+  if newline:
+    w.buf.add('\n')
+  if getShowColor():
+    w.buf &= ansiReset()
+    w.termStyle = 0
+  w.maybeFlush()
+
+proc render*(w: var AnsiWriter, b: FlatTextPlane) =
+  for i in 0 ..< b.lineCount():
+    w.writeLine(b.lineRunes(i), not b.softBreak)
+
+proc render*(w: var AnsiWriter, b: TextPlane) =
+  for line in b.lines:
+    w.writeLine(line, not b.softBreak)
+
+proc preRenderBoxToAnsiString*(b: TextPlane, ensureNl = true): string =
+  ## `ensureNl` is ignored; no newline gets added to the end of a
+  ## plane that doesn't have one, so the result can be spliced into
+  ## other text.
+  # TODO: Add back in unicode underline, etc.
+  var w = newAnsiStringWriter()
+
+  w.render(b)
+  result = w.takeOutput()
+
+proc preRenderBoxToAnsiString*(b: FlatTextPlane): string =
+  var w = newAnsiStringWriter(b.buf.len() + b.buf.len() div 4)
+
+  w.render(b)
+  result = w.takeOutput()
 
 template stylizeMd*(s: string, width = -1, showLinks = false,
                     ensureNl = true, style = defaultStyle): string =
   s.htmlStringToRope().
-    preRender(width, showLinks, style).
-    preRenderBoxToAnsiString(ensureNl)
+    preRenderFlat(width, showLinks, style).
+    preRenderBoxToAnsiString()
 
 template stylizeHtml*(s: string, width = -1, showLinks = false,
                       ensureNl = true, style = defaultStyle): string =
   s.htmlStringToRope(false).
-    preRender(width, showLinks, style).
-    preRenderBoxToAnsiString(ensureNl)
+    preRenderFlat(width, showLinks, style).
+    preRenderBoxToAnsiString()
 
 proc stylize*(s: string, width = -1, showLinks = false,
               ensureNl = true, style = defaultStyle): string =
   let r = Rope(kind: RopeAtom, text: s.toRunes())
-  return r.preRender(width, showLinks, style).
-           preRenderBoxToAnsiString(ensureNl)
+  return r.preRenderFlat(width, showLinks, style).
+           preRenderBoxToAnsiString()
 
 proc stylize*(s: string, tag: string, width = -1, showLinks = false,
               ensureNl = true, style = defaultStyle): string =
@@ -147,8 +349,8 @@ proc stylize*(s: string, tag: string, width = -1, showLinks = false,
   else:
     r = Rope(kind: RopeAtom, text: s.toRunes())
 
-  return r.preRender(width, showLinks, style).
-           preRenderBoxToAnsiString(ensureNl)
+  return r.preRenderFlat(width, showLinks, style).
+           preRenderBoxToAnsiString()
 
 proc withColor*(s: string, fg: string, bg = ""): string =
   if fg == "" and bg == "":
@@ -161,10 +363,256 @@ proc withColor*(s: string, fg: string, bg = ""): string =
 
 proc print*(s: string, file = stdout, md = true, width = -1, ensureNl = true,
            showLinks = false, style = defaultStyle) =
-  var toWrite: string
-  if md:
-    toWrite = s.stylizeMd(width, showLinks, ensureNl, style)
+  ## Output goes straight to `file` as it's rendered, a buffer at a
+  ## time, instead of being built up into one string first. With
+  ## `ensureNl`, text that doesn't end in a newline (a single run with
+  ## no boxes, say) gets one.
+  var w = newAnsiWriter(file)
+
+  let plane = s.htmlStringToRope(md).preRenderFlat(width, showLinks, style)
+
+  w.render(plane)
+  if ensureNl and plane.softBreak and plane.lineCount() != 0:
+    w.buf.add('\n')
+  w.flush()
+
+proc print*(r: Rope, file = stdout, width = -1, showLinks = false,
+            style = defaultStyle) =
+  ## Renders a rope to `file` a top-level block at a time (see
+  ## `preRenderBlocks()`), so output starts before the whole thing
+  ## has been laid out.
+  var
+    w     = newAnsiWriter(file)
+    first = true
+
+  for plane in r.preRenderBlocks(width, showLinks, style):
+    w.render(plane)
+    if first:
+      w.flush()
+      first = false
+
+  w.flush()
+
+type
+  LineState = tuple[casing: TextCasing, shouldTitle: bool]
+
+  ScreenDiffer* = object
+    ## Keeps a live view (a progress display, say) up to date in
+    ## place. Each frame is compared against the one on the screen,
+    ## and only what changed gets redrawn: unchanged lines are
+    ## skipped, and in changed lines, only the part between the
+    ## common prefix and (when it lines up) the common suffix. The
+    ## frame is drawn from the cursor's line down, and the cursor is
+    ## left at the start of the line below it.
+    ##
+    ## Lines must fit the terminal; a line that wraps throws off the
+    ## cursor movement. After anything else writes to the screen, or
+    ## the terminal gets resized, call `forgetFrame()`.
+    w:      AnsiWriter
+    file:   File
+    lines:  seq[seq[uint32]] # What's on the screen now.
+    states: seq[LineState]   # The casing state each line started in.
+
+proc newScreenDiffer*(file: File = stdout): ScreenDiffer =
+  result = ScreenDiffer(w: newAnsiStringWriter(4096), file: file)
+
+proc forgetFrame*(d: var ScreenDiffer) =
+  ## Forgets the frame on the screen; the next one gets drawn in full,
+  ## starting at the cursor.
+  d.lines.setLen(0)
+  d.states.setLen(0)
+
+proc moveRows(buf: var string, cur: var int, target: int) =
+  if target < cur:
+    buf &= "\e[" & $(cur - target) & "A"
+  elif target > cur:
+    buf &= "\e[" & $(target - cur) & "B"
+  cur = target
+
+proc zeroWidthAt(line: openArray[uint32], i: int): bool {.inline.} =
+  return i < len(line) and line[i] <= 0x10ffff and line[i].runeWidth() == 0
+
+proc plainRunes(line: openArray[uint32]): bool =
+  for ch in line:
+    if ch > 0x10ffff:
+      return false
+  return true
+
+proc diffLine(d: var ScreenDiffer, old, line: openArray[uint32],
+              sameStart: bool) =
+  # Redraws the part of the current row that changed. The cursor is
+  # already on the row; the writer's state is what the line starts in.
+  var
+    prefix = 0
+    suffix = 0
+
+  if sameStart:
+    let most = min(len(old), len(line))
+    while prefix < most and old[prefix] == line[prefix]:
+      prefix += 1
+    # Don't split a combining mark from what it combines with.
+    while prefix > 0 and (old.zeroWidthAt(prefix) or
+                          line.zeroWidthAt(prefix)):
+      prefix -= 1
+
+  d.w.addRunes(line.toOpenArray(0, prefix - 1), false)
+
+  # If what changed in the middle is the same width, and it can't
+  # change how the rest renders, the rest can stay.
+  if d.w.casing != CasingTitle:
+    let most = min(len(old), len(line)) - prefix
+    while suffix < most and old[^(suffix + 1)] == line[^(suffix + 1)]:
+      suffix += 1
+    while suffix > 0 and line.zeroWidthAt(len(line) - suffix):
+      suffix -= 1
+
+    if suffix > 0:
+      let
+        oldMid = old.toOpenArray(prefix, len(old) - suffix - 1)
+        newMid = line.toOpenArray(prefix, len(line) - suffix - 1)
+
+      if not oldMid.plainRunes() or not newMid.plainRunes() or
+         oldMid.u32LineLength() != newMid.u32LineLength():
+        suffix = 0
+
+  let col = line.toOpenArray(0, prefix - 1).u32LineLength()
+
+  d.w.buf &= "\r"
+  if col > 0:
+    d.w.buf &= "\e[" & $(col) & "C"
+  if d.w.termStyle != 0:
+    d.w.buf.addStyleDelta(0, d.w.termStyle)
+
+  d.w.addRunes(line.toOpenArray(prefix, len(line) - suffix - 1), true)
+
+  if d.w.termStyle != 0:
+    d.w.buf &= ansiReset()
+    d.w.termStyle = 0
+  if suffix == 0 and old.u32LineLength() > line.u32LineLength():
+    d.w.buf &= "\e[K"
+
+  d.w.addRunes(line.toOpenArray(len(line) - suffix, len(line) - 1), false)
+
+proc update*(d: var ScreenDiffer, frame: TextPlane): string =
+  ## Records `frame` as what's on the screen, and returns what it
+  ## takes to get it there from the last frame; "" if nothing
+  ## changed. `render()` writes this out for you.
+  var
+    row   = len(d.lines) # Where the cursor is, relative to the frame.
+    col0  = true
+    state: LineState
+    states: seq[LineState]
+
+  d.w.buf.setLen(0)
+  d.w.buf &= "\e[?25l" # Hide the cursor while it jumps around.
+
+  for i, line in frame.lines:
+    d.w.casing      = state.casing
+    d.w.shouldTitle = state.shouldTitle
+    d.w.termStyle = 0
+    states.add(state)
+
+    if i < len(d.lines):
+      let sameStart = d.states[i] == state
+
+      if sameStart and d.lines[i] == line:
+        d.w.addRunes(line, false)
+      else:
+        d.w.buf.moveRows(row, i)
+        d.diffLine(d.lines[i], line, sameStart)
+        col0 = false
+    else:
+      d.w.buf.moveRows(row, i)
+      if not col0:
+        d.w.buf &= "\r"
+      d.w.addRunes(line, true)
+      if d.w.termStyle != 0:
+        d.w.buf &= ansiReset()
+      d.w.buf &= "\n"
+      row  = i + 1
+      col0 = true
+
+    state = (d.w.casing, d.w.shouldTitle)
+
+  if len(frame.lines) < len(d.lines):
+    d.w.buf.moveRows(row, len(frame.lines))
+    d.w.buf &= "\r\e[J"
+    col0 = true
+
+  d.w.buf.moveRows(row, len(frame.lines))
+  if not col0:
+    d.w.buf &= "\r"
+
+  d.lines  = frame.lines
+  d.states = states
+
+  if d.w.buf.len() == len("\e[?25l"):
+    return ""
+
+  d.w.buf &= "\e[?25h"
+  result = d.w.buf
+
+proc render*(d: var ScreenDiffer, frame: TextPlane) =
+  ## Brings the screen up to date with `frame`, in a single write().
+  let s = d.update(frame)
+
+  if s.len() == 0:
+    return
+
+  # Anything still sitting in the File's buffer goes first.
+  d.file.flushFile()
+  d.file.getFileHandle().writeAll(s)
+
+proc render*(d: var ScreenDiffer, r: Rope, width = -1, showLinks = false,
+             style = defaultStyle) =
+  d.render(r.preRender(width, showLinks, style))
+
+proc runPager*(r: Rope, width = -1, showLinks = false, style = defaultStyle) =
+  ## Pages a rope, feeding the pager as we render. The pager stops
+  ## reading once its screen is full, and we block until it wants
+  ## more, so a long document shows up right away and we never have
+  ## much more than a screenful laid out ahead of the reader.
+  if r == nil:
+    return
+
+  if isatty(1) == 0:
+    r.print(stdout, width, showLinks, style)
+    return
+
+  let (exe, flags) = findPager()
+  var fds: array[0 .. 1, cint]
+
+  if pipe(fds) != 0:
+    raise newException(IOError, "Couldn't create a pipe for the pager")
+
+  let pid = fork()
+  if pid < 0:
+    discard posix.close(fds[0])
+    discard posix.close(fds[1])
+    raise newException(IOError, "Couldn't start the pager")
+  if pid == 0:
+    discard dup2(fds[0], 0)
+    discard posix.close(fds[0])
+    discard posix.close(fds[1])
+    let argv = allocCStringArray(@[exe] & flags)
+    discard execv(cstring(exe), argv)
+    exitnow(1)
+
+  discard posix.close(fds[0])
+
+  var
+    f:       File
+    status:  cint
+    oldPipe = signal(SIGPIPE, SIG_IGN)
+
+  if not f.open(fds[1], fmWrite):
+    discard posix.close(fds[1])
   else:
-    toWrite = s.stylizeHtml(width, showLinks, ensureNl, style)
+    try:
+      r.print(f, width, showLinks, style)
+    except IOError:
+      discard # The pager got closed before we were done.
+    f.close()
 
-  file.write(toWrite)
+  discard signal(SIGPIPE, oldPipe)
+  discard waitpid(pid, status, 0)
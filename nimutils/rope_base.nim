@@ -1,4 +1,4 @@
-import unicode, tables, options, unicodeid, unicodedb/properties, misc
+import unicode, tables, options, unicodeid, linebreak, misc
 const
  defaultTextWidth* {.intdefine.}    = 80
  bareMinimumColWidth* {.intdefine.} = 2
@@ -79,6 +79,7 @@ type
     useHorizontalSeparator*: Option[bool]
     boxStyle*:               Option[BoxStyle]
     alignStyle*:             Option[AlignStyle]
+    registeredId*:           uint32 # Set by getStyleId(); don't copy.
 
   BoxStyle* = ref object
     horizontal*: Rune
@@ -111,7 +112,6 @@ type
 
   Rope* = ref object
     next*:       Rope
-    cycle*:      bool
     tag*:        string
     id*:         string
     class*:      string
@@ -148,6 +148,22 @@ type
     width*:     int # Advisory.
     softBreak*: bool
 
+  FlatTextPlane* = ref object
+    ## The same thing as a TextPlane, but all the lines live in one
+    ## buffer. Line `i` is `buf[offsets[i] ..< offsets[i + 1]]`, so
+    ## there is always one more offset than there are lines.
+    buf*:       seq[uint32]
+    offsets*:   seq[int]
+    width*:     int # Advisory.
+    softBreak*: bool
+
+  FlatPlaneSlice* = object
+    ## A run of lines in a FlatTextPlane. Nothing gets copied, so this
+    ## is only good until the plane is next modified.
+    plane*:     FlatTextPlane
+    firstLine*: int
+    lastLine*:  int # Exclusive.
+
 let
   BoxStylePlain* =     BoxStyle(horizontal: Rune(0x2500),
                                 vertical:   Rune(0x2502),
@@ -277,72 +293,210 @@ proc mergeTextPlanes*(planes: seq[TextPlane]): TextPlane =
   for plane in planes:
     result.mergeTextPlanes(plane)
 
-proc getBreakOpps(s: seq[uint32]): seq[int] =
-  # Should eventually upgrade this to full Annex 14 at some point.
-  # This is just basic acceptability. If the algorithm finds no
-  # breakpoints, then the soft wrap can decide what to do (we hard
-  # wrap only for now).
-
-  # Basically, we should only generate one opp for a group of spaces,
-  # and we should generally be willing to wrap at a dash, but then we
-  # will be conservative on the rest for now. Note that for us, the
-  # 'break' point is always the first character that would NOT appear
-  # on a given line, but if it's spaces, it'll end up getting stripped
-  # as part of the wrap (currently, we're not supporting a hanging
-  # indent).
-
-  # We don't want to break at the front of a line, and once we see a
-  # breakpoint, we want to not generate another one until we've seen
-  # at least ONE character that has width.
-  var
-    canGenerateBreakpoint  = false
-    breakThereIfNotNumeric = false
-
-  for i, rune in s[0 ..< ^1]:
-    if rune > 0x10ffff:
-      continue
-    if not canGenerateBreakpoint:
-      if Rune(rune).isWhiteSpace():
-        continue
-      if Rune(rune).isPostBreakingChar():
-        result.add(i + 1)
-      else:
-        canGenerateBreakpoint = true
-      continue
-
-    if not rune.isPossibleBreakingChar():
-      if breakThereIfNotNumeric:
-        if Rune(rune).unicodeCategory() in ctgN:
-          result.add(i)
-          # Can generate a breakpoint at the next char too.
-        breakThereIfNotNumeric = false
-      continue
-
-    if breakThereIfNotNumeric:
-      result.add(i)
-      continue
-
-    if Rune(rune).isPostBreakingChar():
-      if Rune(rune).isPreBreakingChar():
-        result.add(i)
-
-      result.add(i + 1)
-      canGenerateBreakpoint = false
-      continue
-
-    elif Rune(rune) == Rune('-'):
-      breakThereIfNotNumeric = true
-      continue
-
-    else: # is pre-breaking char.
-      result.add(i)
-      canGenerateBreakpoint = false
-      continue
+proc newFlatTextPlane*(width = 0, sizeHint = 0): FlatTextPlane =
+  ## Returns a plane with no lines. `sizeHint` is the number of
+  ## codepoints (and style markers) to reserve room for.
+  result = FlatTextPlane(offsets: @[0], width: width)
+  if sizeHint > 0:
+    result.buf = newSeqOfCap[uint32](sizeHint)
+
+template lineCount*(plane: FlatTextPlane): int =
+  plane.offsets.len() - 1
+
+template lineRange*(plane: FlatTextPlane, i: int): HSlice[int, int] =
+  ## The indices into `plane.buf` for line `i`.
+  plane.offsets[i] ..< plane.offsets[i + 1]
+
+template lineRunes*(plane: FlatTextPlane, i: int): untyped =
+  ## Line `i` as an openArray, without copying it.
+  plane.buf.toOpenArray(plane.offsets[i], plane.offsets[i + 1] - 1)
+
+proc newLine*(plane: FlatTextPlane) =
+  ## Starts a new, empty line at the end of the plane.
+  plane.offsets.add(plane.buf.len())
+
+proc add*(plane: FlatTextPlane, ch: uint32) =
+  ## Appends to the last line, starting one if there isn't one yet.
+  if plane.offsets.len() == 1:
+    plane.newLine()
+  plane.buf.add(ch)
+  plane.offsets[^1] = plane.buf.len()
+
+proc add*(plane: FlatTextPlane, runes: openArray[uint32]) =
+  if plane.offsets.len() == 1:
+    plane.newLine()
+  let start = plane.buf.len()
+  plane.buf.setLen(start + runes.len())
+  for i, ch in runes:
+    plane.buf[start + i] = ch
+  plane.offsets[^1] = plane.buf.len()
+
+proc addLine*(plane: FlatTextPlane, runes: openArray[uint32]) =
+  plane.newLine()
+  plane.add(runes)
+
+proc slice*(plane: FlatTextPlane, first, last: int): FlatPlaneSlice =
+  ## Lines `first ..< last`, by reference.
+  assert first >= 0 and first <= last and last <= plane.lineCount()
+  result = FlatPlaneSlice(plane: plane, firstLine: first, lastLine: last)
+
+template `[]`*(plane: FlatTextPlane, r: HSlice[int, int]): FlatPlaneSlice =
+  plane.slice(r.a, r.b + 1)
+
+template toSlice*(plane: FlatTextPlane): FlatPlaneSlice =
+  plane.slice(0, plane.lineCount())
+
+template lineCount*(s: FlatPlaneSlice): int =
+  s.lastLine - s.firstLine
+
+template lineRunes*(s: FlatPlaneSlice, i: int): untyped =
+  s.plane.lineRunes(s.firstLine + i)
+
+proc copy*(src: FlatPlaneSlice): FlatTextPlane =
+  let
+    start = src.plane.offsets[src.firstLine]
+    stop  = src.plane.offsets[src.lastLine]
+
+  result         = FlatTextPlane(width: src.plane.width)
+  result.buf     = src.plane.buf[start ..< stop]
+  result.offsets = newSeq[int](src.lineCount() + 1)
+  for i in 0 .. src.lineCount():
+    result.offsets[i] = src.plane.offsets[src.firstLine + i] - start
+
+proc append*(dst: FlatTextPlane, src: FlatPlaneSlice) =
+  ## Like `mergeTextPlanes()`, the first line of `src` continues the
+  ## last line of `dst`. The runes are copied in one go.
+  if src.lineCount() == 0:
+    return
+  if src.plane == dst:
+    dst.append(src.copy().toSlice())
+    return
+  if dst.offsets.len() == 1:
+    dst.newLine()
+
+  let
+    srcStart = src.plane.offsets[src.firstLine]
+    srcLen   = src.plane.offsets[src.lastLine] - srcStart
+    dstStart = dst.buf.len()
+    base     = dstStart - srcStart
+
+  dst.buf.setLen(dstStart + srcLen)
+  for i in 0 ..< srcLen:
+    dst.buf[dstStart + i] = src.plane.buf[srcStart + i]
+
+  let n = src.lineCount()
+  dst.offsets[^1] = base + src.plane.offsets[src.firstLine + 1]
+  for i in src.firstLine + 1 ..< src.firstLine + n:
+    dst.offsets.add(base + src.plane.offsets[i + 1])
+
+proc append*(dst: FlatTextPlane, src: FlatTextPlane) =
+  dst.append(src.toSlice())
+
+proc appendLines*(dst: FlatTextPlane, src: FlatPlaneSlice) =
+  ## Adds the lines in `src` as new lines at the end of `dst`.
+  if src.lineCount() == 0:
+    return
+  dst.newLine()
+  dst.append(src)
+
+proc spliceRunes(plane: FlatTextPlane, first, last: int,
+                 buf: openArray[uint32], offsets: openArray[int]) =
+  # Replaces lines `first ..< last` with the lines in `buf` delimited
+  # by `offsets`. The tail of the plane gets moved once; nothing is
+  # allocated per-line. `buf` must not alias `plane.buf`.
+  let
+    nLines    = offsets.len() - 1
+    srcStart  = offsets[0]
+    srcLen    = offsets[^1] - srcStart
+    startIx   = plane.offsets[first]
+    endIx     = plane.offsets[last]
+    oldLen    = plane.buf.len()
+    delta     = srcLen - (endIx - startIx)
+    oldCount  = plane.offsets.len()
+    lineDelta = nLines - (last - first)
+
+  if delta > 0:
+    plane.buf.setLen(oldLen + delta)
+  if delta != 0 and oldLen > endIx:
+    moveMem(addr plane.buf[endIx + delta], addr plane.buf[endIx],
+            (oldLen - endIx) * sizeof(uint32))
+  if delta < 0:
+    plane.buf.setLen(oldLen + delta)
+  for i in 0 ..< srcLen:
+    plane.buf[startIx + i] = buf[srcStart + i]
+
+  if lineDelta > 0:
+    plane.offsets.setLen(oldCount + lineDelta)
+  if lineDelta != 0 and oldCount > last + 1:
+    moveMem(addr plane.offsets[last + 1 + lineDelta],
+            addr plane.offsets[last + 1], (oldCount - last - 1) * sizeof(int))
+  if lineDelta < 0:
+    plane.offsets.setLen(oldCount + lineDelta)
+  for i in 0 ..< nLines:
+    plane.offsets[first + 1 + i] = startIx + offsets[i + 1] - srcStart
+  for i in first + 1 + nLines ..< plane.offsets.len():
+    plane.offsets[i] += delta
+
+proc splice*(plane: FlatTextPlane, first, last: int, src: FlatPlaneSlice) =
+  ## Replaces lines `first ..< last` of `plane` with the lines in
+  ## `src`. Either range may be empty, so this also handles inserting
+  ## and deleting lines.
+  if src.plane == plane:
+    plane.splice(first, last, src.copy().toSlice())
+    return
+  plane.spliceRunes(first, last, src.plane.buf,
+                    src.plane.offsets.toOpenArray(src.firstLine,
+                                                  src.lastLine))
+
+proc splice*(plane: FlatTextPlane, first, last: int,
+             line: openArray[uint32]) =
+  ## Replaces lines `first ..< last` with a single line.
+  plane.spliceRunes(first, last, line, [0, line.len()])
+
+proc deleteLines*(plane: FlatTextPlane, first, last: int) =
+  var noRunes: seq[uint32]
+  plane.spliceRunes(first, last, noRunes, [0])
+
+proc toFlatTextPlane*(planes: openArray[TextPlane]): FlatTextPlane =
+  ## Merges the planes the same way `mergeTextPlanes()` does.
+  var size = 0
+  for plane in planes:
+    for line in plane.lines:
+      size += line.len()
+
+  result = newFlatTextPlane(sizeHint = size)
+  for plane in planes:
+    for i, line in plane.lines:
+      if i != 0 or result.lineCount() == 0:
+        result.newLine()
+      result.add(line)
+
+proc toFlatTextPlane*(plane: TextPlane): FlatTextPlane =
+  result           = [plane].toFlatTextPlane()
+  result.width     = plane.width
+  result.softBreak = plane.softBreak
+
+proc toTextPlane*(plane: FlatTextPlane): TextPlane =
+  result = TextPlane(width: plane.width, softBreak: plane.softBreak)
+  result.lines = newSeq[seq[uint32]](plane.lineCount())
+  for i in 0 ..< plane.lineCount():
+    result.lines[i] = @(plane.lineRunes(i))
+
+proc `$`*(plane: FlatTextPlane): string =
+  result = $(plane.toTextPlane())
+
+proc getBreakOpps(s: openArray[uint32]): seq[int] =
+  # The 'break' point is always the first character that would NOT
+  # appear on a given line. For a break after spaces, that's the
+  # first space, which ends up getting stripped as part of the wrap.
+  # If there are no opportunities, the soft wrap decides what to do
+  # (we hard wrap only for now).
+  result = s.lineBreakOpps()
 
   # Finally, the last character should never be a breakpoint, nor
   # should the index one past the end of the input.
   while len(result) != 0 and result[^1] >= s.len() - 1:
-    result = result[0 ..< ^1]
+    result.setLen(len(result) - 1)
 
 proc stripSpacesButNotFormatters*(input: seq[uint32]): seq[uint32] =
   for i, ch in input:
@@ -359,61 +513,105 @@ proc stripSpacesButNotFormattersFromEnd*(input: seq[uint32]): seq[uint32] =
     if input[n] > 0x10ffff or not Rune(input[n]).isWhiteSpace():
       break
 
-  while n > 0:
-    n -= 1
-    let ch = input[n]
-    if ch > 0x10ffff:
-      result = @[ch] & result
-    else:
-      return input[0 ..< n] & result
+  # Keep the formatters that come right before `n`, and drop the
+  # codepoint in front of them.
+  var k = n
+  while k > 0:
+    k -= 1
+    if input[k] <= 0x10ffff:
+      return input[0 ..< k] & input[k + 1 ..< n]
+
+  return input[0 ..< n]
+
+type WrapPiece = object
+  # One output line from wrapRanges(): `indent` spaces, then any
+  # formatters in `input[fmtStart ..< fmtEnd]`, then
+  # `input[start ..< stop]`.
+  indent:   int
+  fmtStart: int
+  fmtEnd:   int
+  start:    int
+  stop:     int
+
+iterator wrapRanges(input: openArray[uint32], maxWidth, hang: int): WrapPiece =
+  # A single forward pass over the line. Break opportunities get
+  # computed once, up front, and a pointer into them only moves
+  # forward. After a break, we skip the spaces at the break point
+  # (keeping any formatters in them) and indent by `hang`.
+  let
+    width    = if maxWidth < 1: 1 else: maxWidth
+    indent   = if hang < width: hang else: 0
+    breakOps = input.getBreakOpps()
+    n        = input.len()
 
-proc softWrapLine(input: seq[uint32], maxWidth, hang: int): seq[seq[uint32]] =
-  # After any line wrap, we will want to just drop trailing spaces,
-  # but keep in formatting.
   var
-    line       = input
-    lineWidth  = line.u32LineLength()
-    width      = if maxWidth < 1: 1 else: maxWidth
-
-  while true:
-    if len(line) == 0:
-      break
+    piece = WrapPiece()
+    bpIx  = 0
 
+  while piece.start < n:
     var
-      breakOps      = line.getBreakOpps()
-      curBpIx       = 0
-      curWidth      = 0
-      bestBp        = -1
-
-    for i, ch in line:
-      if (curWidth + ch.runeWidth()) > width:
-        if bestBp == -1:
-          # Hard break here, sorry.
-          bestBp = i
-          break
-        else:
-          break
+      curWidth = piece.indent
+      bestBp   = -1
+      i        = piece.start
 
-      curWidth += ch.runeWidth()
+    while bpIx < len(breakOps) and breakOps[bpIx] <= piece.start:
+      bpIx += 1
 
-      if curBpIx < len(breakOps) and breakOps[curBpIx] == i:
-        bestBp   = i
-        curBpIx += 1
+    while i < n:
+      let w = input[i].runeWidth()
 
-    if len(line) == 0:
-      break
-    if bestBp == -1 or curWidth < width:
-      result.add(line)
+      if curWidth + w > width:
+        break
+
+      curWidth += w
+      if bpIx < len(breakOps) and breakOps[bpIx] == i:
+        bestBp = i
+        bpIx  += 1
+      i += 1
+
+    if i == n:
+      piece.stop = n
+      yield piece
       break
 
-    lineWidth -= curWidth
+    # No opportunity, so hard wrap; we always take at least one
+    # codepoint, so a too-wide character can't stall us.
+    if bestBp == -1:
+      bestBp = i
+    if bestBp <= piece.start:
+      bestBp = piece.start + 1
+
+    piece.stop = bestBp
+    yield piece
+
+    var j = bestBp
+    while j < n and (input[j] > 0x10ffff or Rune(input[j]).isWhiteSpace()):
+      j += 1
+
+    piece = WrapPiece(indent: indent, fmtStart: bestBp, fmtEnd: j, start: j)
+
+    # The line ended in spaces; we only need another line if they hid
+    # formatters.
+    if j == n:
+      for k in bestBp ..< j:
+        if input[k] > 0x10ffff:
+          piece.stop = n
+          yield piece
+          break
 
-    result.add(line[0 ..< bestBp])
-    line = line[bestBp .. ^1].stripSpacesButNotFormatters()
-    if hang < width:
-      line = uint32(Rune(' ')).repeat(hang) & line
+proc softWrapLine(input: seq[uint32], maxWidth, hang: int): seq[seq[uint32]] =
+  # After any line wrap, we will want to just drop trailing spaces,
+  # but keep in formatting.
+  for piece in input.wrapRanges(maxWidth, hang):
+    var line = uint32(Rune(' ')).repeat(piece.indent)
 
-proc findTruncationIndex(s: seq[uint32], width: int): int =
+    for k in piece.fmtStart ..< piece.fmtEnd:
+      if input[k] > 0x10ffff:
+        line.add(input[k])
+    line.add(input.toOpenArray(piece.start, piece.stop - 1))
+    result.add(line)
+
+proc findTruncationIndex(s: openArray[uint32], width: int): int =
   var remaining = width
 
   for i, ch in s:
@@ -473,17 +671,17 @@ proc wrapToWidth*(plane: var TextPlane, style: FmtStyle, w: int) =
             if ch > 0x10ffff:
               plane.lines[i].add(ch)
     of OHardWrap:
-      var newLines: seq[seq[uint32]]
-      for i in 0 ..< plane.lines.len():
-        var line = plane.lines[i]
+      for line in plane.lines:
+        var start = 0
         while true:
-          let ix = line.findTruncationIndex(w)
+          var ix = start + line.toOpenArray(start, line.len() - 1).
+                           findTruncationIndex(w)
+          if ix == start and ix < line.len():
+            ix += 1 # Always make progress, even if w is too small.
+          newLines.add(line[start ..< ix])
           if ix == line.len():
-            newLines.add(line)
             break
-          else:
-            newlines.add(line[0 ..< ix])
-            line = line[ix .. ^1]
+          start = ix
       plane.lines = newLines
     of OWrap:
       for line in plane.lines:
@@ -496,3 +694,33 @@ proc wrapToWidth*(plane: var TextPlane, style: FmtStyle, w: int) =
       plane.lines = newLines
 
   plane.ensureFormattingIsPerLine()
+
+proc countWrapped(input: openArray[uint32], maxWidth, hang: int): int =
+  for piece in input.wrapRanges(maxWidth, hang):
+    result += 1
+
+proc wrappedLineCount*(plane: FlatTextPlane, style: FmtStyle, w: int): int =
+  ## How many lines `wrapToWidth()` would leave `plane` with, without
+  ## building any of them.
+  case style.overFlow.getOrElse(OIgnore):
+    of OverFlow, OIgnore, OTruncate, ODots:
+      result = plane.lineCount()
+    of OHardWrap:
+      for i in 0 ..< plane.lineCount():
+        var start = plane.offsets[i]
+        let stop  = plane.offsets[i + 1]
+        while true:
+          var ix = start +
+                   plane.buf.toOpenArray(start, stop - 1).findTruncationIndex(w)
+          if ix == start and ix < stop:
+            ix += 1
+          result += 1
+          if ix == stop:
+            break
+          start = ix
+    of OWrap, OIndentWrap:
+      let hang = if style.overFlow.get() == OWrap: 0
+                 else: style.hang.getOrElse(2)
+
+      for i in 0 ..< plane.lineCount():
+        result += plane.lineRunes(i).countWrapped(w, hang)
@@ -3,42 +3,46 @@
 
 import  unicode, markdown, htmlparse, tables, parseutils, colortable, rope_base
 
+from unicodeid import decodeUtf8
+
 from strutils import startswith, replace
 
 
-proc rawStrToRope*(s: string, pre: bool): Rope =
+proc rawStrToRope*(s: openArray[char], pre: bool): Rope =
+  # The whole string gets decoded in one go, then split into lines.
+  let cps = s.decodeUtf8()
   var
-    curStr = ""
-    lines: seq[string]
+    curStr: seq[uint32]
+    lines:  seq[seq[uint32]]
 
   if pre:
-    for c in s:
-      if c == '\n':
-        lines.add(curStr)
-        curStr = ""
-      elif c == '\t':
-        curStr.add("    ")
+    for c in cps:
+      if c == uint32('\n'):
+        lines.add(move(curStr))
+        curStr = @[]
+      elif c == uint32('\t'):
+        curStr.add([uint32(' '), uint32(' '), uint32(' '), uint32(' ')])
       else:
         curStr.add(c)
   else:
     var skipNewline = false
 
-    for i, c in s:
-      if c == '\t':
+    for i, c in cps:
+      if c == uint32('\t'):
         curStr.add(c)
-      elif c == '\n':
+      elif c == uint32('\n'):
         if skipNewline:
           skipNewLine = false
-        elif i + 1 != s.len() and s[i + 1] == '\n':
-          lines.add(curStr)
-          curStr = ""
+        elif i + 1 != cps.len() and cps[i + 1] == uint32('\n'):
+          lines.add(move(curStr))
+          curStr = @[]
           skipNewLine = true
         else:
-          curStr.add(' ')
+          curStr.add(uint32(' '))
       else:
         curStr.add(c)
 
-  lines.add(curStr)
+  lines.add(move(curStr))
 
   var
     prev: Rope
@@ -47,7 +51,7 @@ proc rawStrToRope*(s: string, pre: bool): Rope =
 
   for line in lines:
     prev = cur
-    cur  = Rope(kind: RopeAtom, text: line.toRunes())
+    cur  = Rope(kind: RopeAtom, text: cast[seq[Rune]](line))
 
     if prev == nil:
       result = cur
@@ -122,113 +126,165 @@ proc refCopy*(dst: var Rope, src: Rope) =
     refCopy(f, src.next)
     dst.next = f
 
-proc `&`*(r1: Rope, r2: Rope): Rope =
+proc copySpine(r: Rope): (Rope, Rope) =
+  # Copies the nodes along `next`, sharing everything they hold.
+  # Returns the head and tail of the copy.
   var
-    dupe1: Rope = Rope()
-    dupe2: Rope = Rope()
-    probe: Rope
+    probe = r
+    last:   Rope
 
+  while probe != nil:
+    var dupe = Rope()
+    dupe[]   = probe[]
+
+    if last == nil:
+      result[0] = dupe
+    else:
+      last.next = dupe
+    last  = dupe
+    probe = probe.next
+
+  result[1] = last
+
+proc `&`*(r1: Rope, r2: Rope): Rope =
+  ## Concatenates without touching either operand. Only the top-level
+  ## nodes get copied; what they contain (text, cells, nested ropes)
+  ## is shared, so treat the operands as read-only afterward if you
+  ## need them to stay independent.
   if r1 == nil and r2 == nil:
     return nil
-  elif r1 == nil:
-    refCopy(dupe1, r2)
-    return dupe1
-  elif r2 == nil:
-    refCopy(dupe1, r1)
-    return dupe1
-
-  refCopy(dupe1, r1)
-  refCopy(dupe2, r2)
-  probe = dupe1
-  while probe.next != nil:
-    probe = probe.next
 
-  probe.next = dupe2
+  let
+    (head1, tail1) = r1.copySpine()
+    (head2, _)     = r2.copySpine()
+
+  if head1 == nil:
+    return head2
+
+  tail1.next = head2
 
-  return dupe1
+  return head1
+
+proc ropeTail(r: Rope): Rope {.inline.} =
+  result = r
+  while result.next != nil:
+    result = result.next
 
 proc `+`*(r1: Rope, r2: Rope): Rope =
+  ## Appends `r2` to `r1` in place, and returns `r1`. This walks both
+  ## operands; to append a lot of pieces, use a RopeBuilder.
   if r1 == nil:
     return r2
   if r2 == nil:
     return r1
 
+  let last = r1.ropeTail()
+
+  # If r2 shares any node with r1, it runs into r1's last node.
+  if r2.ropeTail() == last:
+    raise newException(ValueError, "Addition would cause a cycle")
+
+  last.next = r2
+
+  return r1
+
+type RopeBuilder* = object
+  ## Builds up a chain of ropes. Appending only walks the piece being
+  ## added, since the builder remembers where the chain ends, so
+  ## building from n pieces is O(n) instead of O(n^2) with `+`.
+  head: Rope
+  tail: Rope
+  count: int # Top-level nodes.
+
+proc add*(b: var RopeBuilder, r: Rope) =
+  if r == nil:
+    return
+
   var
-    probe: Rope = r1
-    last:  Rope
+    last = r
+    n    = 1
 
-  while true:
-    probe.cycle = true
-    if probe.next == nil:
-      break
-    probe = probe.next
+  while last.next != nil:
+    last = last.next
+    n   += 1
 
-  last  = probe
-  probe = r2
+  # The chain so far ends at `tail`, so anything already in it would
+  # lead us there.
+  if last == b.tail:
+    raise newException(ValueError, "Addition would cause a cycle")
 
-  while probe != nil:
-    if probe.cycle:
-       raise newException(ValueError, "Addition would cause a cycle")
-    else:
-      probe = probe.next
+  if b.head == nil:
+    b.head = r
+  else:
+    b.tail.next = r
 
-  probe = r1
-  while probe != nil:
-    probe.cycle = false
-    probe = probe.next
+  b.tail   = last
+  b.count += n
 
-  last.next = r2
+template len*(b: RopeBuilder): int =
+  b.count
 
-  return r1
+template toRope*(b: RopeBuilder): Rope =
+  ## The rope built so far. Adding more extends it in place.
+  b.head
 
-proc htmlTreeToRope(n: HtmlNode, pre: var seq[bool]): Rope
+# The conversion works on either kind of tree parseDocument*() gives us;
+# both node types have the same accessors.
+type AnyHtmlNode = HtmlNode | HtmlNodeView
 
-proc doDescend(n: HtmlNode, pre: var seq[bool]): Rope =
-  for item in n.children:
-    result = result + item.htmlTreeToRope(pre)
+proc textToRope(n: HtmlNode, pre: bool): Rope =
+  n.contents.rawStrToRope(pre)
+
+proc textToRope(n: HtmlNodeView, pre: bool): Rope =
+  let s = n.tree.nodes[n.ix].contents
 
-template descend(n: HtmlNode): Rope =
-  n.doDescend(pre)
+  n.tree.arena.toOpenArray(s.offset, s.offset + s.len - 1).rawStrToRope(pre)
+
+template descend(n: untyped): Rope =
+  var res: RopeBuilder
+  for item in n.children:
+    res.add(item.htmlTreeToRope(pre))
+  res.toRope()
 
-proc extractColumnInfo(n: HtmlNode): seq[ColInfo] =
+proc extractColumnInfo(n: AnyHtmlNode): seq[ColInfo] =
   for item in n.children:
     var
       span: int
       pct:  int
 
-    if "span" in item.attrs:
-      discard parseInt(item.attrs["span"], span)
+    if item.hasAttr("span"):
+      discard parseInt(item.getAttr("span"), span)
 
     if span <= 0:
       span = 1
 
-    if "width" in item.attrs:
-      discard parseInt(item.attrs["width"], pct)
+    if item.hasAttr("width"):
+      discard parseInt(item.getAttr("width"), pct)
 
     if pct < 0:
       pct = 0
 
     result.add(ColInfo(span: span, widthPct: pct))
 
-proc htmlTreeToRope(n: HtmlNode, pre: var seq[bool]): Rope =
+proc htmlTreeToRope(n: AnyHtmlNode, pre: var seq[bool]): Rope =
   case n.kind
   of HtmlDocument:
     result = n.descend()
   of HtmlElement, HtmlTemplate:
-    if n.contents.startswith('<') and n.contents[^1] == '>':
-      n.contents = n.contents[1 ..< ^1]
+    let tag = n.tagName()
 
-    case n.contents
+    case tag
     of "html", "body", "head":
       result = n.descend()
     of "br":
       result = Rope(kind: RopeBreak, breakType: BrHardLine, tag: "br")
     of "a":
-      let url = if "href" in n.attrs: n.attrs["href"] else: "https://unknown"
+      let url = if n.hasAttr("href"): n.getAttr("href")
+                else: "https://unknown"
       result = Rope(kind: RopeLink, url: url, toHighlight: n.descend(),
                     tag: "a")
     of "ol", "ul":
-      result = Rope(kind: RopeList, tag: n.contents)
+      result = Rope(kind: RopeList, tag: tag)
       for item in n.children:
         if item.kind == HtmlWhiteSpace:
           continue
@@ -243,13 +299,13 @@ proc htmlTreeToRope(n: HtmlNode, pre: var seq[bool]): Rope =
       result = Rope(kind: RopeAlignedContainer, tag: "lalign",
                     contained: n.descend())
     of "thead", "tbody", "tfoot":
-      result = Rope(kind:  RopeTableRows, tag: n.contents)
+      result = Rope(kind:  RopeTableRows, tag: tag)
       for item in n.children:
         if item.kind == HtmlWhiteSpace:
           continue
         result.cells.add(item.htmlTreeToRope(pre))
     of "tr":
-      result = Rope(kind: RopeTableRow, tag: n.contents)
+      result = Rope(kind: RopeTableRow, tag: tag)
       for item in n.children:
         if item.kind == HtmlWhiteSpace:
           continue
@@ -259,7 +315,7 @@ proc htmlTreeToRope(n: HtmlNode, pre: var seq[bool]): Rope =
       for item in n.children:
         if item.kind == HtmlWhiteSpace:
           continue
-        if item.contents == "colgroup":
+        if item.tagName() == "colgroup":
           result.colInfo = item.extractColumnInfo()
           continue
         let asRope = item.htmlTreeToRope(pre)
@@ -270,9 +326,9 @@ proc htmlTreeToRope(n: HtmlNode, pre: var seq[bool]): Rope =
           else:
             discard
         of RopeTableRows:
-          if item.contents == "thead":
+          if asRope.tag == "thead":
             result.thead = asRope
-          elif item.contents == "tfoot":
+          elif asRope.tag == "tfoot":
             result.tfoot = asRope
           else:
             result.tbody = asRope
@@ -289,67 +345,573 @@ proc htmlTreeToRope(n: HtmlNode, pre: var seq[bool]): Rope =
       # Since we know about this list, short-circuit the color checking code,
       # even though if no color matches, the same thing happens as happens
       # in this branch...
-      result = Rope(kind: RopeTaggedContainer, tag: n.contents,
+      result = Rope(kind: RopeTaggedContainer, tag: tag,
                     contained: n.descend())
     of "pre":
       pre.add(true)
-      result = Rope(kind: RopeTaggedContainer, tag: n.contents,
+      result = Rope(kind: RopeTaggedContainer, tag: tag,
                     contained: n.descend())
       discard pre.pop()
     of "td", "th":
-      result = Rope(kind: RopeTaggedContainer, tag: n.contents,
+      result = Rope(kind: RopeTaggedContainer, tag: tag,
                          contained: n.descend())
     else:
       let colorTable = getColorTable()
       let below      = n.descend()
-      if n.contents in colorTable:
-        result = Rope(kind: RopeFgColor, color: n.contents, toColor: below)
-      elif n.contents.startsWith("bg-") and n.contents[3 .. ^1] in colorTable:
-        result = Rope(kind: RopeBgColor, color: n.contents[3 .. ^1],
+      if tag in colorTable:
+        result = Rope(kind: RopeFgColor, color: tag, toColor: below)
+      elif tag.startsWith("bg-") and tag[3 .. ^1] in colorTable:
+        result = Rope(kind: RopeBgColor, color: tag[3 .. ^1],
                       toColor: below)
-      elif n.contents.startsWith("#") and len(n.contents) == 7:
-        result = Rope(kind: RopeFgColor, color: n.contents[1 .. ^1],
+      elif tag.startsWith("#") and len(tag) == 7:
+        result = Rope(kind: RopeFgColor, color: tag[1 .. ^1],
                       toColor: below)
-      elif n.contents.startsWith("bg#") and len(n.contents) == 10:
-        result = Rope(kind: RopeBgColor, color: n.contents[3 .. ^1],
+      elif tag.startsWith("bg#") and len(tag) == 10:
+        result = Rope(kind: RopeBgColor, color: tag[3 .. ^1],
                       toColor: below)
-      elif n.contents in ["default", "none", "off", "nocolor"]:
+      elif tag in ["default", "none", "off", "nocolor"]:
         result = Rope(kind: RopeFgColor, color: "", toColor: below)
-      elif n.contents in ["bg-default", "bg-none", "bg-off", "bg-nocolor"]:
+      elif tag in ["bg-default", "bg-none", "bg-off", "bg-nocolor"]:
         result = Rope(kind: RopeBgColor, color: "", toColor: below)
       else:
         result = Rope(kind: RopeTaggedContainer, contained: below)
-      result.tag = n.contents
+      result.tag = tag
 
     # No branches should have returned, but some might not have set a result.
     if result != Rope(nil):
-      if "id" in n.attrs:
-        result.id = n.attrs["id"]
-      if "class" in n.attrs:
-        result.class = n.attrs["class"]
-      if "width" in n.attrs:
+      if n.hasAttr("id"):
+        result.id = n.getAttr("id")
+      if n.hasAttr("class"):
+        result.class = n.getAttr("class")
+      if n.hasAttr("width"):
         var width: int
-        discard parseInt(n.attrs["width"], width)
+        discard parseInt(n.getAttr("width"), width)
         result.width = width
   of HtmlText, HtmlCData:
-    result = n.contents.rawStrToRope(pre[^1])
+    result = n.textToRope(pre[^1])
   else:
     discard
 
-proc htmlTreeToRope(n: HtmlNode): Rope =
+proc htmlTreeToRope(n: AnyHtmlNode): Rope =
   var pre = @[false]
 
   n.htmlTreeToRope(pre)
 
-proc htmlStringToRope*(s: string, markdown = true): Rope =
-  let html = if markdown: markdownToHtml(s) else: s
-  let tree = parseDocument(html).children[1]
+proc kids(n: HtmlNodeView): seq[HtmlNodeView] =
+  for item in n.children:
+    result.add(item)
+
+proc htmlToRope(html: string, unwrap = true): Rope =
+  var body: HtmlNodeView
+
+  for item in parseDocumentCompact(html).root.children:
+    body = item # The <body>; the <head> comes first.
 
-  if len(tree.children) == 2 and
-     tree.children[1].kind == HtmlWhiteSpace and
-     tree.children[0].contents == "p" and
-     tree.children[1].contents == "\n" and
-     tree.children[0].children.len() == 1:
-    return tree.children[0].children[0].htmlTreeToRope()
+  let kids = body.kids()
+
+  if unwrap and len(kids) == 2 and
+     kids[1].kind == HtmlWhiteSpace and
+     kids[0].contents == "p" and
+     kids[1].contents == "\n" and
+     kids[0].kids().len() == 1:
+    return kids[0].kids()[0].htmlTreeToRope()
+  else:
+    return body.htmlTreeToRope()
+
+# Building ropes straight from MD4C's parser callbacks. The goal is
+# to get exactly what rendering to HTML and parsing that with gumbo
+# would give us, just without the two extra passes. That means
+# copying a few of the renderer's and gumbo's habits: the renderer
+# puts a newline after most block tags, which ends up at the start of
+# any text that follows; whitespace-only text between tags becomes a
+# node that `htmlTreeToRope()` drops; and text runs up to the next
+# tag, not the next callback.
+
+type
+  MdFrame = object
+    node:    Rope      # nil for the document itself.
+    kids:    seq[Rope]
+    rawKids: int       # Including whitespace nodes gumbo would make.
+
+  MdRopeBuilder = object
+    frames:     seq[MdFrame]
+    text:       string
+    pre:        int
+    imgDepth:   int
+    topRawKids: int
+
+proc chainRopes(kids: seq[Rope]): Rope =
+  var chain: RopeBuilder
+
+  for kid in kids:
+    chain.add(kid)
+
+  return chain.toRope()
+
+proc urlEscape(s: string): string =
+  # What MD4C's renderer does to URLs; gumbo then turns its &amp;
+  # back into &.
+  const hexChars = "0123456789ABCDEF"
+
+  for c in s:
+    if c in {'a'..'z', 'A'..'Z', '0'..'9'} or c in "~-_.+!*(),%#@?=;:/$&":
+      result.add(c)
+    else:
+      result.add('%')
+      result.add(hexChars[int(c) shr 4])
+      result.add(hexChars[int(c) and 0xf])
+
+proc htmlEscape(s: string): string =
+  for c in s:
+    case c
+    of '&': result.add("&amp;")
+    of '<': result.add("&lt;")
+    of '>': result.add("&gt;")
+    of '"': result.add("&quot;")
+    else:   result.add(c)
+
+proc addKid(b: var MdRopeBuilder, kid: Rope) =
+  b.frames[^1].rawKids += 1
+  if kid != nil:
+    b.frames[^1].kids.add(kid)
+
+proc flushText(b: var MdRopeBuilder) =
+  if b.text.len() == 0:
+    return
+
+  for c in b.text:
+    if c notin {' ', '\t', '\n', '\r', '\f'}:
+      b.addKid(b.text.rawStrToRope(b.pre != 0))
+      b.text.setLen(0)
+      return
+
+  b.addKid(nil)
+  b.text.setLen(0)
+
+proc push(b: var MdRopeBuilder, node: Rope) =
+  b.frames.add(MdFrame(node: node))
+
+proc pop(b: var MdRopeBuilder) =
+  let
+    frame = b.frames.pop()
+    n     = frame.node
+
+  case n.kind
+  of RopeList:
+    n.items = frame.kids
+  of RopeTableRow, RopeTableRows:
+    n.cells = frame.kids
+  of RopeTable:
+    for kid in frame.kids:
+      if kid.tag == "thead":
+        n.thead = kid
+      else:
+        n.tbody = kid
+  of RopeLink:
+    n.toHighlight = frame.kids.chainRopes()
+  of RopeTaggedContainer:
+    n.contained = frame.kids.chainRopes()
+  else:
+    discard
+
+  b.addKid(n)
+  if b.frames.len() == 1:
+    b.topRawKids = frame.rawKids
+
+template tagged(t: string): Rope =
+  Rope(kind: RopeTaggedContainer, tag: t)
+
+proc mdEnterBlock(kind: MdBlockKind, detail: pointer, p: pointer): cint
+    {.cdecl.} =
+  let b = cast[ptr MdRopeBuilder](p)
+
+  b[].flushText()
+
+  case kind
+  of MdBlockDoc:
+    b[].push(nil)
+    return
+  of MdBlockHtml:
+    return 1
+  of MdBlockQuote:
+    b[].push(tagged("blockquote"))
+  of MdBlockUl:
+    b[].push(Rope(kind: RopeList, tag: "ul"))
+  of MdBlockOl:
+    b[].push(Rope(kind: RopeList, tag: "ol"))
+  of MdBlockTable:
+    b[].push(Rope(kind: RopeTable, tag: "table"))
+  of MdBlockThead:
+    b[].push(Rope(kind: RopeTableRows, tag: "thead"))
+  of MdBlockTbody:
+    b[].push(Rope(kind: RopeTableRows, tag: "tbody"))
+  of MdBlockTr:
+    b[].push(Rope(kind: RopeTableRow, tag: "tr"))
+  of MdBlockLi:
+    let li = cast[ptr MdBlockLiDetail](detail)
+    if li.isTask == 0:
+      b[].push(tagged("li"))
+    else:
+      let r = tagged("li")
+      r.class = "task-list-item"
+      b[].push(r)
+      let box = tagged("input")
+      box.class = "task-list-item-checkbox"
+      b[].addKid(box)
+    return
+  of MdBlockHr:
+    # A void element, so the newline lands outside it.
+    b[].addKid(tagged("hr"))
+  of MdBlockH:
+    b[].push(tagged("h" & $(cast[ptr MdBlockHDetail](detail).level)))
+    return
+  of MdBlockCode:
+    let
+      lang = $(cast[ptr MdBlockCodeDetail](detail).lang)
+      code = tagged("code")
+
+    if lang != "":
+      code.class = "language-" & lang
+    b.pre += 1
+    b[].push(tagged("pre"))
+    b[].push(code)
+    return
+  of MdBlockP:
+    b[].push(tagged("p"))
+    return
+  of MdBlockTh:
+    b[].push(tagged("th"))
+    return
+  of MdBlockTd:
+    b[].push(tagged("td"))
+    return
+
+  b.text.add('\n')
+
+proc mdLeaveBlock(kind: MdBlockKind, detail: pointer, p: pointer): cint
+    {.cdecl.} =
+  let b = cast[ptr MdRopeBuilder](p)
+
+  # No closing tag for these, so nothing to end the current text. The
+  # document frame is left for markdownToRope() to pick up.
+  if kind in [MdBlockDoc, MdBlockHr, MdBlockHtml]:
+    return
+
+  b[].flushText()
+
+  case kind
+  of MdBlockCode:
+    b[].pop()
+    b[].pop()
+    b.pre -= 1
   else:
-    return tree.htmlTreeToRope()
+    b[].pop()
+
+  b.text.add('\n')
+
+proc mdEnterSpan(kind: MdSpanKind, detail: pointer, p: pointer): cint
+    {.cdecl.} =
+  let b = cast[ptr MdRopeBuilder](p)
+
+  # Everything inside an image goes into its alt attribute, which
+  # we don't use.
+  if b.imgDepth != 0:
+    if kind == MdSpanImg:
+      b.imgDepth += 1
+    return
+
+  b[].flushText()
+
+  case kind
+  of MdSpanEm:
+    b[].push(tagged("em"))
+  of MdSpanStrong:
+    b[].push(tagged("strong"))
+  of MdSpanA, MdSpanACodeLink:
+    let href = $(cast[ptr MdSpanADetail](detail).href)
+    b[].push(Rope(kind: RopeLink, tag: "a", url: href.urlEscape()))
+  of MdSpanASelf:
+    let href = $(cast[ptr MdSpanADetail](detail).href)
+    b[].push(Rope(kind: RopeLink, tag: "a", url: "#" & href.urlEscape()))
+  of MdSpanImg:
+    b[].addKid(tagged("img"))
+    b.imgDepth = 1
+  of MdSpanCode:
+    b[].push(tagged("code"))
+  of MdSpanDel:
+    b[].push(tagged("del"))
+  of MdSpanLatexMath:
+    b[].push(tagged("x-equation"))
+  of MdSpanLatexMathDisplay:
+    # Gumbo doesn't know these tags, so htmlparse names them by the
+    # whole tag, attributes and all.
+    b[].push(tagged("x-equation type=\"display\""))
+  of MdSpanWikiLink:
+    let target = $(cast[ptr MdSpanWikiLinkDetail](detail).target)
+    b[].push(tagged("x-wikilink data-target=\"" & target.htmlEscape() &
+                    "\""))
+  of MdSpanU:
+    b[].push(tagged("u"))
+
+proc mdLeaveSpan(kind: MdSpanKind, detail: pointer, p: pointer): cint
+    {.cdecl.} =
+  let b = cast[ptr MdRopeBuilder](p)
+
+  if b.imgDepth != 0:
+    if kind == MdSpanImg:
+      b.imgDepth -= 1
+    return
+
+  b[].flushText()
+  b[].pop()
+
+proc mdText(kind: MdTextKind, text: ptr UncheckedArray[char], size: cuint,
+            p: pointer): cint {.cdecl.} =
+  let b = cast[ptr MdRopeBuilder](p)
+
+  if b.imgDepth != 0:
+    return
+
+  case kind
+  of MdTextHtml:
+    return 1
+  of MdTextNullChar:
+    b.text.add("\ufffd")
+  of MdTextBr:
+    b[].flushText()
+    b[].addKid(Rope(kind: RopeBreak, breakType: BrHardLine, tag: "br"))
+    b.text.add('\n')
+  of MdTextSoftBr:
+    b.text.add('\n')
+  of MdTextEntity:
+    b.text.add(decodeMdEntity(text, int(size)))
+  else:
+    if size != 0:
+      let start = b.text.len()
+      b.text.setLen(start + int(size))
+      copyMem(addr b.text[start], text, int(size))
+
+let mdRopeCallbacks = MdCallbacks(enterBlock: mdEnterBlock,
+                                  leaveBlock: mdLeaveBlock,
+                                  enterSpan:  mdEnterSpan,
+                                  leaveSpan:  mdLeaveSpan,
+                                  text:       mdText)
+
+proc markdownToRope*(s: string, opts: openarray[MdOpts] = [MdGithub],
+                     unwrap = true): Rope =
+  ## Converts markdown to a rope without going through HTML. The
+  ## result is the same as `htmlStringToRope(markdownToHtml(s),
+  ## false)`. Raw HTML in the markdown needs a real HTML parser, so
+  ## documents that have any still take that route.
+  ##
+  ## If `unwrap` is false, a document that's a single paragraph stays
+  ## a paragraph, which is what you get when the HTML ends up inside
+  ## some other element (a table cell, say).
+  var b: MdRopeBuilder
+
+  if markdownParse(s, mdRopeCallbacks, addr b, opts) != 0 or
+     b.frames.len() != 1:
+    return markdownToHtml(s, opts).htmlToRope(unwrap)
+
+  b.flushText()
+
+  let kids = b.frames[0].kids
+
+  # Same special case as htmlToRope(): a lone paragraph with one
+  # thing in it is just that thing.
+  if unwrap and b.frames[0].rawKids == 2 and kids.len() == 1 and
+     kids[0].kind == RopeTaggedContainer and kids[0].tag == "p" and
+     b.topRawKids == 1:
+    return kids[0].contained
+
+  return kids.chainRopes()
+
+proc htmlStringToRope*(s: string, markdown = true, unwrap = true): Rope =
+  ## When `unwrap` is true, a document that's just one paragraph
+  ## comes back as the paragraph's contents.
+  if markdown:
+    return s.markdownToRope(unwrap = unwrap)
+  else:
+    return s.htmlToRope(unwrap)
+
+# A compact binary form for ropes, so that documents can be converted
+# once (say, at build time) and then loaded without any parsing. Ints
+# are zigzagged LEB128 varints, strings are a length then the bytes,
+# and each chain of ropes is a run of nodes, each starting with its
+# kind plus one, ended by a zero byte.
+
+const ropeBlobMagic = "ROPE\x01"
+
+proc putInt(s: var string, n: int) =
+  var v = (cast[uint64](n) shl 1) xor cast[uint64](ashr(n, 63))
+
+  while v >= 0x80:
+    s.add(char((v and 0x7f) or 0x80))
+    v = v shr 7
+  s.add(char(v))
+
+proc putStr(s: var string, v: string) =
+  s.putInt(v.len())
+  s.add(v)
+
+proc putRope(s: var string, r: Rope) =
+  var cur = r
+
+  while cur != nil:
+    s.add(char(ord(cur.kind) + 1))
+    s.putStr(cur.tag)
+    s.putStr(cur.id)
+    s.putStr(cur.class)
+    s.putInt(cur.width)
+
+    case cur.kind
+    of RopeAtom:
+      s.putInt(cur.length)
+      s.putInt(cur.text.len())
+      for ch in cur.text:
+        s.putInt(int(ch))
+    of RopeBreak:
+      s.putInt(ord(cur.breakType))
+      s.putRope(cur.guts)
+    of RopeLink:
+      s.putStr(cur.url)
+      s.putRope(cur.toHighlight)
+    of RopeList:
+      s.putInt(cur.items.len())
+      for item in cur.items:
+        s.putRope(item)
+    of RopeTaggedContainer, RopeAlignedContainer:
+      s.putRope(cur.contained)
+    of RopeTable:
+      s.putInt(cur.colInfo.len())
+      for info in cur.colInfo:
+        s.putInt(info.span)
+        s.putInt(info.widthPct)
+      s.putRope(cur.thead)
+      s.putRope(cur.tbody)
+      s.putRope(cur.tfoot)
+      s.putRope(cur.caption)
+    of RopeTableRow, RopeTableRows:
+      s.putInt(cur.cells.len())
+      for cell in cur.cells:
+        s.putRope(cell)
+    of RopeFgColor, RopeBgColor:
+      s.putStr(cur.color)
+      s.putRope(cur.toColor)
+
+    cur = cur.next
+
+  s.add('\x00')
+
+proc serializeRope*(r: Rope): string =
+  ## Returns a binary form of `r` that `deserializeRope()` turns back
+  ## into an identical rope. Shared sub-ropes get written out once per
+  ## reference.
+  result = ropeBlobMagic
+  result.putRope(r)
+
+template badBlob() =
+  raise newException(ValueError, "Invalid serialized rope")
+
+proc getInt(s: string, i: var int): int =
+  var
+    v:     uint64
+    shift: int
+
+  while true:
+    if i >= s.len() or shift > 63:
+      badBlob()
+    let b = uint64(s[i])
+    i += 1
+    v = v or ((b and 0x7f) shl shift)
+    if b < 0x80:
+      break
+    shift += 7
+
+  return int(v shr 1) xor -int(v and 1)
+
+proc getCount(s: string, i: var int): int =
+  # Every item takes at least a byte, which bounds any sane count.
+  result = s.getInt(i)
+  if result < 0 or result > s.len() - i:
+    badBlob()
+
+proc getStr(s: string, i: var int): string =
+  let l = s.getCount(i)
+
+  result = s[i ..< i + l]
+  i += l
+
+proc getRope(s: string, i: var int): Rope =
+  var tail: Rope
+
+  while true:
+    if i >= s.len():
+      badBlob()
+    let k = int(s[i])
+    i += 1
+    if k == 0:
+      return
+    if k > ord(RopeKind.high) + 1:
+      badBlob()
+
+    let
+      tag   = s.getStr(i)
+      id    = s.getStr(i)
+      class = s.getStr(i)
+      width = s.getInt(i)
+      r     = Rope(kind: RopeKind(k - 1), tag: tag, id: id, class: class,
+                   width: width)
+
+    case r.kind
+    of RopeAtom:
+      r.length = s.getInt(i)
+      r.text   = newSeq[Rune](s.getCount(i))
+      for j in 0 ..< r.text.len():
+        r.text[j] = Rune(s.getInt(i))
+    of RopeBreak:
+      let bt = s.getInt(i)
+      if bt < 0 or bt > ord(BreakKind.high):
+        badBlob()
+      r.breakType = BreakKind(bt)
+      r.guts      = s.getRope(i)
+    of RopeLink:
+      r.url         = s.getStr(i)
+      r.toHighlight = s.getRope(i)
+    of RopeList:
+      for j in 0 ..< s.getCount(i):
+        r.items.add(s.getRope(i))
+    of RopeTaggedContainer, RopeAlignedContainer:
+      r.contained = s.getRope(i)
+    of RopeTable:
+      for j in 0 ..< s.getCount(i):
+        let span = s.getInt(i)
+        r.colInfo.add(ColInfo(span: span, widthPct: s.getInt(i)))
+      r.thead   = s.getRope(i)
+      r.tbody   = s.getRope(i)
+      r.tfoot   = s.getRope(i)
+      r.caption = s.getRope(i)
+    of RopeTableRow, RopeTableRows:
+      for j in 0 ..< s.getCount(i):
+        r.cells.add(s.getRope(i))
+    of RopeFgColor, RopeBgColor:
+      r.color   = s.getStr(i)
+      r.toColor = s.getRope(i)
+
+    if tail == nil:
+      result = r
+    else:
+      tail.next = r
+    tail = r
+
+proc deserializeRope*(s: string): Rope =
+  ## Rebuilds a rope from `serializeRope()`'s output. Raises a
+  ## ValueError if `s` isn't a serialized rope.
+  if not s.startsWith(ropeBlobMagic):
+    badBlob()
+
+  var i = ropeBlobMagic.len()
+
+  result = s.getRope(i)
+  if i != s.len():
+    badBlob()
@@ -27,7 +27,7 @@
 # tables.
 
 import tables, options, unicodedb/properties, std/terminal, rope_base,
-       rope_styles, unicodeid, unicode, misc
+       rope_styles, unicodeid, unicode, misc, hashes, colortable
 
 type
   RenderBoxKind* = enum RbText, RbBoxes
@@ -38,6 +38,13 @@ type
     bmargin*:    int
     width*:      int
 
+  MeasureBox = object
+    # A RenderBox without the contents, for measure().
+    lines:   int
+    width:   int
+    tmargin: int
+    bmargin: int
+
   FmtState = object
     totalWidth:   int
     showLinkTarg: bool
@@ -48,6 +55,55 @@ type
     savedRopes:   seq[Rope]
     processed:    seq[Rope] # For text items b/c I have a bug :/
     tableEven:    seq[bool]
+    hashes:       Table[Rope, Hash]
+    chunkTable:   Rope # See preRenderTableChunk().
+    chunkFirst:   bool
+    chunkLast:    bool
+    bigTable:     bool # Lay its cells out in parallel; see renderCells().
+
+  RenderCacheKey = tuple[rope: Hash, width: int, style: uint32, links: bool,
+                         cols: Hash, even: int, topLevel: bool]
+
+  RenderCacheEntry = ref object
+    key:       RenderCacheKey
+    rope:      Rope # Checked on a hit, in case the hashes collided.
+    boxes:     seq[RenderBox]
+    plane:     FlatTextPlane
+    processed: seq[Rope]  # What rendering the subtree added to the state.
+    cols:      seq[int]
+    prev:      RenderCacheEntry
+    next:      RenderCacheEntry
+
+  RenderCacheStats* = object
+    hits*:      int
+    misses*:    int
+    evictions*: int
+    entries*:   int
+    capacity*:  int
+
+const defaultRenderCacheEntries* {.intdefine.} = 256
+
+# Each thread gets its own render cache, so nothing here needs a
+# lock. The capacity is the one setting that's shared. The threads
+# doing cell layout for renderCells() have `inCellWorker` set (as
+# does the calling thread while it helps with a batch), and skip the
+# cache entirely, since their entries would be stranded once the
+# batch is done.
+#
+# A lookup isn't free: the key includes a hash of the whole subtree
+# (the whole chain, for the top-level entry), computed once per node
+# per render. And a hit then walks both ropes with sameRope() /
+# sameChain() to rule out a collision. That's still far cheaper than
+# layout, but it's proportional to the size of the rope, not O(1).
+var
+  renderCache       {.threadvar.}: Table[RenderCacheKey, RenderCacheEntry]
+  renderCacheHead   {.threadvar.}: RenderCacheEntry # Most recently used.
+  renderCacheTail   {.threadvar.}: RenderCacheEntry
+  renderCacheGen    {.threadvar.}: int
+  renderCacheStats  {.threadvar.}: RenderCacheStats
+  renderCacheCap    = defaultRenderCacheEntries
+  parallelLayout    = true
+  inCellWorker {.threadvar.}: bool
 
 proc `$`*(box: RenderBox): string =
     result &= $(box.contents)
@@ -199,6 +255,27 @@ proc collapseColumn(state: FmtState, boxes: seq[RenderBox]): RenderBox =
 
   result = RenderBox(contents: plane, tmargin: tmargin, bmargin: bmargin)
 
+proc collapseBox(state: FmtState, boxes: seq[RenderBox]): RenderBox =
+  # What boxContent() and taggedBox() finish up with.
+  result = state.collapseColumn(boxes)
+  state.alignAndPad(result)
+
+proc collapseBox(state: FmtState, boxes: seq[MeasureBox]): MeasureBox =
+  # collapseColumn() and then alignAndPad(), which pads every line out
+  # to the full width.
+  for i, box in boxes:
+    if i != 0:
+      result.lines += box.tmargin
+    result.lines += box.lines
+    if i != len(boxes) - 1:
+      result.lines += box.bmargin
+
+  if boxes.len() != 0:
+    result.tmargin = boxes[0].tmargin
+    result.bmargin = boxes[0].bmargin
+  if result.lines != 0:
+    result.width = state.totalWidth
+
 proc collapsedBoxToTextPlane(state: FmtState, box: RenderBox): TextPlane =
   result       = box.contents
   result.width = box.width
@@ -207,6 +284,45 @@ proc collapsedBoxToTextPlane(state: FmtState, box: RenderBox): TextPlane =
   for i in 0 ..< box.bmargin:
     result.lines &= @[state.pad(result.width)]
 
+proc collapseColumnToFlat(state: FmtState,
+                          boxes: seq[RenderBox]): FlatTextPlane =
+  # Does the work of collapseColumn() and collapsedBoxToTextPlane()
+  # for the outermost column, copying each line exactly once into a
+  # single buffer.
+  let
+    style   = state.curStyle
+    lineLen = state.totalWidth - style.lpad.get(0) - style.rpad.get(0)
+    blank   = state.pad(lineLen)
+    margin  = state.pad(0)
+    tmargin = if boxes.len() != 0: boxes[0].tmargin else: 0
+    bmargin = if boxes.len() != 0: boxes[0].bmargin else: 0
+
+  var size = (tmargin + bmargin) * margin.len()
+  for box in boxes:
+    size += (box.tmargin + box.bmargin) * blank.len()
+    for line in box.contents.lines:
+      size += line.len()
+
+  result = newFlatTextPlane(sizeHint = size)
+
+  for i in 0 ..< tmargin:
+    result.addLine(margin)
+
+  for i, box in boxes:
+    if i != 0:
+      for j in 0 ..< box.tmargin:
+        result.addLine(blank)
+
+    for line in box.contents.lines:
+      result.addLine(line)
+
+    if i != len(boxes) - 1:
+      for j in 0 ..< box.bmargin:
+        result.addLine(blank)
+
+  for i in 0 ..< bmargin:
+    result.addLine(margin)
+
 proc pushTableWidths(state: var FmtState, widths: seq[int]) =
   state.colStack.add(widths)
 
@@ -259,6 +375,14 @@ proc getNewStartStyle(state: FmtState, r: Rope,
   if styleChange:
     return some(newStyle)
 
+proc setMargins[T](boxes: var seq[T], style: FmtStyle) =
+  # For RenderBox and MeasureBox alike.
+  for i in 0 ..< len(boxes):
+    if style.tmargin.isSome():
+      boxes[i].tmargin = style.tmargin.get()
+    if style.bmargin.isSome():
+      boxes[i].bmargin = style.bmargin.get()
+
 template boxContent(state: var FmtState, style: FmtStyle, symbol: untyped,
                     code: untyped) =
   state.pushStyle(style)
@@ -271,15 +395,9 @@ template boxContent(state: var FmtState, style: FmtStyle, symbol: untyped,
   state.totalWidth -= p
   code
   state.totalWidth += p
+  symbol.setMargins(style)
 
-  for item in symbol:
-    if style.tmargin.isSome():
-      item.tmargin = style.tmargin.get()
-    if style.bmargin.isSome():
-      item.bmargin = style.bmargin.get()
-
-  let collapsed = state.collapseColumn(symbol)
-  state.alignAndPad(collapsed)
+  let collapsed = state.collapseBox(symbol)
   state.popStyle()
 
   symbol = @[collapsed]
@@ -310,14 +428,9 @@ template taggedBox(tag: string, code: untyped) =
     state.totalWidth -= p
   code
   state.totalWidth = savedWidth
-  for item in result:
-    if style.tmargin.isSome():
-      item.tmargin = style.tmargin.get()
-    if style.bmargin.isSome():
-      item.bmargin = style.bmargin.get()
+  result.setMargins(style)
 
-  let collapsed = state.collapseColumn(result)
-  state.alignAndPad(collapsed)
+  let collapsed = state.collapseBox(result)
   state.popStyle()
 
   result = @[collapsed]
@@ -327,34 +440,62 @@ template standardBox(code: untyped) =
 
 proc preRender*(state: var FmtState, r: Rope): seq[RenderBox]
 
+# The list hangs, shared with the measuring code further down, so
+# that the two always take the same amount off the width.
+
+proc unorderedBullet(style: FmtStyle): Rune =
+  return style.bulletChar.getOrElse(Rune(0x2022))
+
+proc unorderedHangLen(style: FmtStyle): int =
+  return style.unorderedBullet().runeWidth()
+
+proc listDigits(nItems: int): int =
+  # How many digits the last item's number has.
+  var n = nItems
+  while true:
+    result += 1
+    n      = n div 10
+    if n == 0:
+      break
+
+proc orderedHangLen(style: FmtStyle, nItems: int): int =
+  # The length of preRenderOrderedList()'s hang prefix, which is what
+  # it takes off the width. That counts the style markers: two from
+  # styling the prefix, and two more from pad() if there's a bullet
+  # character.
+  result = nItems.listDigits() + 2
+  if style.bulletChar.isSome():
+    result += style.bulletChar.get().runeWidth() + 2
+
+template hangingItems(state: var FmtState, hangLen: int, code: untyped) =
+  # Lays the items out `hangLen` narrower, unless that leaves nothing.
+  let subedWidth = hangLen < state.totalWidth
+
+  if subedWidth:
+    state.totalWidth -= hangLen
+  code
+  if subedWidth:
+    state.totalWidth += hangLen
+
 proc preRenderUnorderedList(state: var FmtState, r: Rope): seq[RenderBox] =
   standardBox:
     let
-      bulletChar = state.curStyle.bulletChar.getOrElse(Rune(0x2022))
-      bullet     = state.styleRunes(@[uint32(bulletChar)])
-      bulletLen  = bullet.u32LineLength()
+      bullet     = state.styleRunes(@[uint32(state.curStyle.unorderedBullet())])
+      bulletLen  = state.curStyle.unorderedHangLen()
       hangPrefix = state.styleRunes(state.pad(bulletLen))
-    var
-      subedWidth = true
 
-    if bullet.u32LineLength() < state.totalWidth:
-      state.totalWidth -= bulletLen
-    else:
-      subedWidth = false
+    state.hangingItems(bulletLen):
+      for n, item in r.items:
+        var oneItem = state.preRender(item)[0]
 
-    for n, item in r.items:
-      var oneItem = state.preRender(item)[0]
-
-      for i in 0 ..< oneItem.contents.lines.len():
-        if i == 0:
-          oneItem.contents.lines[0] = bullet & oneItem.contents.lines[0]
-        else:
-          oneItem.contents.lines[i] = hangPrefix & oneItem.contents.lines[i]
-
-      result.add(oneItem)
+        for i in 0 ..< oneItem.contents.lines.len():
+          if i == 0:
+            oneItem.contents.lines[0] = bullet & oneItem.contents.lines[0]
+          else:
+            oneItem.contents.lines[i] = hangPrefix &
+                                        oneItem.contents.lines[i]
 
-    if subedWidth:
-      state.totalWidth += bulletLen
+        result.add(oneItem)
 
 proc toNumberBullet(state: FmtState, n, maxdigits: int): seq[uint32] =
   # Formats a number n that's meant to be in a bulleted list, where the
@@ -373,58 +514,43 @@ proc toNumberBullet(state: FmtState, n, maxdigits: int): seq[uint32] =
 
 proc preRenderOrderedList(state: var FmtState, r: Rope): seq[RenderBox] =
   standardBox:
-    var
-      hangPrefix:  seq[uint32]
-      maxDigits  = 0
-      n          = len(r.items)
-      subedWidth = true
-
-    while true:
-      maxDigits += 1
-      n          = n div 10
-      hangPrefix.add(uint32(Rune(' ')))
-      if n == 0:
-        break
+    let maxDigits  = len(r.items).listDigits()
+    var hangPrefix = uint32(Rune(' ')).repeat(maxDigits)
 
     if state.curStyle.bulletChar.isSome():
       hangPrefix &= state.pad(state.curStyle.bulletChar.get().runeWidth())
 
-    hangPrefix = state.styleRunes(hangPrefix)
+    let hangLen = state.curStyle.orderedHangLen(len(r.items))
+    hangPrefix  = state.styleRunes(hangPrefix)
+    assert hangPrefix.len() == hangLen
 
-    if hangPrefix.len() < state.totalWidth:
-      state.totalWidth -= hangPrefix.len()
-    else:
-      subedWidth = false
+    state.hangingItems(hangLen):
+      for n, item in r.items:
+        var oneItem = state.preRender(item)[0]
+        let
+          bulletText = state.toNumberBullet(n + 1, maxDigits)
+          styled     = state.styleRunes(bulletText)
 
-    for n, item in r.items:
-      var oneItem = state.preRender(item)[0]
-      let
-        bulletText = state.toNumberBullet(n + 1, maxDigits)
-        styled     = state.styleRunes(bulletText)
-
-      oneItem.contents.lines[0] = styled & oneItem.contents.lines[0]
-      for i in 1 ..< oneItem.contents.lines.len():
-        oneItem.contents.lines[i] = hangPrefix & oneItem.contents.lines[i]
+        oneItem.contents.lines[0] = styled & oneItem.contents.lines[0]
+        for i in 1 ..< oneItem.contents.lines.len():
+          oneItem.contents.lines[i] = hangPrefix & oneItem.contents.lines[i]
 
-      result.add(oneItem)
+        result.add(oneItem)
 
-    if subedWidth:
-      state.totalWidth += hangPrefix.len()
+proc borderOverhead(style: FmtStyle, nCols: int): int =
+  # The columns a table row's borders and separators take up.
+  if style.useLeftBorder.getOrElse(false):
+    result += 1
+  if style.useRightBorder.getOrElse(false):
+    result += 1
+  if style.useVerticalSeparator.getOrElse(false) and nCols > 1:
+    result += nCols - 1
 
 proc percentToActualColumns(state: var FmtState, pcts: seq[int]): seq[int] =
   if len(pcts) == 0: return
 
-  let style    = state.curStyle
-  var overhead = 0
-
-  if style.useLeftBorder.getOrElse(false):
-    overhead += 1
-  if style.useRightBorder.getOrElse(false):
-    overhead += 1
-  if style.useVerticalSeparator.getOrElse(false):
-    overhead += (len(pcts) - 1)
-
-  let availableWidth = state.totalWidth - overhead
+  let availableWidth = state.totalWidth -
+                       state.curStyle.borderOverhead(len(pcts))
 
   for item in pcts:
     var colwidth = (item * availableWidth) div 100
@@ -469,41 +595,49 @@ template getBottomBorder(state: var FmtState, s: BoxStyle): RenderBox =
   state.getGenericBorder(state.colStack[^1], state.curStyle, s.horizontal,
                          s.lowerLeft, s.lowerRight, s.bottomT)
 
-proc preRenderTable(state: var FmtState, r: Rope): seq[RenderBox] =
-  standardBox:
+proc tableColPcts(r: Rope): seq[int] =
+  if r.colInfo.len() != 0:
     var
-      colWidths: seq[int]
-      boxStyle  = state.curStyle.boxStyle.getOrElse(DefaultBoxStyle)
+      sum:              int
+      defaultWidthCols: int
+
+    for item in r.colInfo:
+      for i in 0 ..< item.span:
+        result.add(item.widthPct)
+        if item.widthPct == 0:
+          defaultWidthCols += 1
+        else:
+          sum += item.widthPct
 
-    if r.colInfo.len() != 0:
-      var
-        sum:              int
-        defaultWidthCols: int
-
-      for item in r.colInfo:
-        for i in 0 ..< item.span:
-          colWidths.add(item.widthPct)
-          if item.widthPct == 0:
-            defaultWidthCols += 1
-          else:
-            sum += item.widthPct
+    # If sum < 100 then we divide remaining width equally.
+    if defaultWidthCols != 0 and sum < 100:
+      let defaultWidth = (100 - sum) div defaultWidthCols
+
+      if defaultWidth > 0:
+        for i, width in result:
+          if width == 0:
+            result[i] = defaultWidth
 
-      # If sum < 100 then we divide remaining width equally.
-      if defaultWidthCols != 0 and sum < 100:
-        let defaultWidth = (100 - sum) div defaultWidthCols
+    # For anything still 0 or 1, we set it to a minimum width of 2. It
+    # might result in us getting cropped.
+    for i, width in result:
+      if width < 2:
+        result[i] = 2
 
-        if defaultWidth > 0:
-          for i, width in colWidths:
-            if width == 0:
-              colWidths[i] = defaultWidth
+proc tableCellCount(r: Rope): int =
+  for section in [r.thead, r.tbody, r.tfoot]:
+    if section != nil:
+      for row in section.cells:
+        result += row.cells.len()
 
-      # For anything still 0 or 1, we set it to a minimum width of 2. It
-      # might result in us getting cropped.
-      for i, width in colWidths:
-        if width < 2:
-          colWidths[i] = 2
+proc preRenderTable(state: var FmtState, r: Rope): seq[RenderBox] =
+  standardBox:
+    var boxStyle = state.curStyle.boxStyle.getOrElse(DefaultBoxStyle)
+
+    state.pushTableWidths(state.percentToActualColumns(r.tableColPcts()))
 
-    state.pushTableWidths(state.percentToActualColumns(colWidths))
+    let savedBig   = state.bigTable
+    state.bigTable = r.tableCellCount() >= parallelTableCells
 
     if r.thead != Rope(nil):
       result &= state.preRender(r.thead)
@@ -527,13 +661,22 @@ proc preRenderTable(state: var FmtState, r: Rope): seq[RenderBox] =
 
       result = newBoxes
 
-    if state.curStyle.useTopBorder.getOrElse(false):
+    # A chunk of a bigger table only gets the outer borders at the
+    # ends, and joins onto the previous chunk like rows do.
+    let chunked = r == state.chunkTable
+
+    if chunked and not state.chunkFirst:
+      if state.curStyle.useHorizontalSeparator.getOrElse(false):
+        result = @[midBorder] & result
+    elif state.curStyle.useTopBorder.getOrElse(false):
       result = @[topBorder] & result
 
-    if state.curStyle.useBottomBorder.getOrElse(false):
+    if state.curStyle.useBottomBorder.getOrElse(false) and
+       (not chunked or state.chunkLast):
       result.add(lowBorder)
 
     state.popTableWidths()
+    state.bigTable = savedBig
     if r.caption != Rope(nil):
       result &= state.preRender(r.caption)
 
@@ -608,6 +751,168 @@ proc adjacentCellsToRow(state: var FmtState, cells: seq[TextPlane],
 
   result = cells[0]
 
+const parallelTableCells* {.intdefine.} = 64
+
+proc setParallelLayout*(enabled: bool) =
+  ## When built with threads and atomic reference counting, the cells
+  ## of tables with at least `parallelTableCells` cells in all get laid
+  ## out on a pool of worker threads, started the first time it's
+  ## needed. This turns that on or off; it's on by default. Other
+  ## builds always lay out on the calling thread.
+  parallelLayout = enabled
+
+type CellResult = object
+  boxes:     seq[RenderBox]
+  processed: seq[Rope]
+  error:     ref CatchableError
+
+when compileOption("threads") and defined(gcAtomicArc):
+  import std/[typedthreads, cpuinfo, locks]
+
+  type CellPool = object
+    # One batch (a row's cells) at a time. Whoever takes a cell bumps
+    # `next`; whoever finishes one drops `pending`.
+    lock:    Lock
+    work:    Cond
+    done:    Cond
+    threads: seq[Thread[void]]
+    state:   ptr FmtState
+    cells:   ptr seq[Rope]
+    widths:  ptr seq[int]
+    results: ptr seq[CellResult]
+    n:       int
+    next:    int
+    pending: int
+
+  var cellPool: CellPool
+
+  proc layoutCell(i: int) =
+    # Lays out one cell with its own copy of the parts of the state
+    # that layout reads. The result goes in the cell's own slot, so the
+    # row comes out the same as it would on one thread.
+    {.cast(gcsafe).}:
+      let job = cellPool.state
+      var state = FmtState(totalWidth:   cellPool.widths[i],
+                           showLinkTarg: job.showLinkTarg,
+                           curStyle:     job.curStyle,
+                           styleStack:   job.styleStack,
+                           colStack:     job.colStack,
+                           tableEven:    job.tableEven)
+      try:
+        cellPool.results[i].boxes     = state.preRender(cellPool.cells[i])
+        cellPool.results[i].processed = state.processed
+      except CatchableError as e:
+        cellPool.results[i].error = e
+
+  proc takeCell(): int =
+    # Call with the lock held. Returns -1 if there's nothing left.
+    {.cast(gcsafe).}:
+      if cellPool.next >= cellPool.n:
+        return -1
+      result = cellPool.next
+      cellPool.next += 1
+
+  proc finishCell() =
+    {.cast(gcsafe).}:
+      acquire(cellPool.lock)
+      cellPool.pending -= 1
+      if cellPool.pending == 0:
+        signal(cellPool.done)
+      release(cellPool.lock)
+
+  proc cellWorker() {.thread.} =
+    # The render cache is global and unlocked, so workers skip it.
+    inCellWorker = true
+    {.cast(gcsafe).}:
+      while true:
+        acquire(cellPool.lock)
+        var i = takeCell()
+        while i < 0:
+          wait(cellPool.work, cellPool.lock)
+          i = takeCell()
+        release(cellPool.lock)
+
+        layoutCell(i)
+        finishCell()
+
+  proc runCellBatch(state: var FmtState, cells: seq[Rope], widths: seq[int],
+                    results: var seq[CellResult]) =
+    if cellPool.threads.len() == 0:
+      initLock(cellPool.lock)
+      initCond(cellPool.work)
+      initCond(cellPool.done)
+      # The calling thread works on the batch too.
+      cellPool.threads = newSeq[Thread[void]](max(countProcessors() - 1, 1))
+      for i in 0 ..< cellPool.threads.len():
+        createThread(cellPool.threads[i], cellWorker)
+
+    acquire(cellPool.lock)
+    cellPool.state   = addr state
+    cellPool.cells   = unsafeAddr cells
+    cellPool.widths  = unsafeAddr widths
+    cellPool.results = addr results
+    cellPool.n       = results.len()
+    cellPool.next    = 0
+    cellPool.pending = results.len()
+    broadcast(cellPool.work)
+
+    # Help out, then wait for whatever the workers are still on.
+    inCellWorker = true
+    var i = takeCell()
+    while i >= 0:
+      release(cellPool.lock)
+      layoutCell(i)
+      finishCell()
+      acquire(cellPool.lock)
+      i = takeCell()
+    inCellWorker = false
+
+    while cellPool.pending != 0:
+      wait(cellPool.done, cellPool.lock)
+    cellPool.n = 0
+    release(cellPool.lock)
+
+proc renderCells(state: var FmtState, r: Rope,
+                 widths: seq[int]): seq[CellResult] =
+  # Lays out the row's cells, in parallel if we can and the table is
+  # big enough to be worth it (see preRenderTable()).
+  let n = min(r.cells.len(), widths.len())
+
+  result = newSeq[CellResult](n)
+
+  when compileOption("threads") and defined(gcAtomicArc):
+    if parallelLayout and state.bigTable and not inCellWorker and
+       n > 1 and state.nextRope == nil:
+      state.runCellBatch(r.cells, widths, result)
+
+      for item in result:
+        if item.error != nil:
+          raise item.error
+        state.processed &= item.processed
+      return
+
+  let savedWidth = state.totalWidth
+
+  for i in 0 ..< n:
+    state.totalWidth = widths[i]
+    result[i].boxes  = state.preRender(r.cells[i])
+
+  state.totalWidth = savedWidth
+
+proc rowWidths(state: var FmtState, r: Rope): seq[int] =
+  # The column widths for row `r`. If the table didn't give any, the
+  # row's cells split the width evenly, and the rest of the table
+  # goes by that too.
+  result = state.colStack[^1]
+
+  if result.len() == 0:
+    state.popTableWidths()
+    let pct = 100 div len(r.cells)
+    for i in 0 ..< len(r.cells):
+      result.add(pct)
+    result = state.percentToActualColumns(result)
+    state.pushTableWidths(result)
+
 proc preRenderRow(state: var FmtState, r: Rope): seq[RenderBox] =
   # This is the meat of the table implementation.
   # 1) If the table colWidths array is 0, then we need to
@@ -622,31 +927,23 @@ proc preRenderRow(state: var FmtState, r: Rope): seq[RenderBox] =
   var tag = if state.tableEven[^1]: "tr.even" else: "tr.odd"
 
   taggedBox(tag):
-    var
-      widths = state.colStack[^1]
-
     # Step 1, make sure col widths are right
-    if widths.len() == 0:
-      state.popTableWidths()
-      let pct = 100 div len(r.cells)
-      for i in 0 ..< len(r.cells):
-        widths.add(pct)
-      widths = state.percentToActualColumns(widths)
-      state.pushTableWidths(widths)
+    let widths = state.rowWidths(r)
 
     var
       cellBoxes: seq[RenderBox]
       rowPlanes: seq[TextPlane]
       savedWidth = state.totalWidth
+      rendered   = state.renderCells(r, widths)
 
     # This loop does steps 2-3
     for i, width in widths:
-      # Step 2, pre-render the cell.
+      # Step 2, pre-render the cell (done above, possibly in parallel).
       if i >= len(r.cells):
         cellBoxes = state.emptyTableCell()
       else:
         state.totalWidth = width
-        cellBoxes = state.preRender(r.cells[i])
+        cellBoxes = move(rendered[i].boxes)
 
       for cell in cellBoxes:
         cell.tmargin = 0
@@ -694,12 +991,24 @@ template addStyledText(code: untyped) =
   code
   extract.addRunesToExtraction(@[StylePop])
 
+proc textContinues(state: var FmtState, r, cur: Rope): bool =
+  # Checked before each step of extractText() and measureText(), so
+  # they stop in the same places. A rope that needs a box gets handed
+  # back, via `nextRope`, for the column to lay out next.
+  if r in state.processed:
+    return false
+  state.processed.add(r)
+  if not cur.noBoxRequired():
+    state.savedRopes.add(state.nextRope)
+    state.nextRope = cur
+    return false
+  return true
+
 proc extractText(state: var FmtState, r: Rope, extract: TextPlane) =
   var cur: Rope = r
   while cur != nil:
-    if r in state.processed:
+    if not state.textContinues(r, cur):
       return
-    state.processed.add(r)
     case cur.kind
     of RopeAtom:
       let styleOpt = state.getNewStartStyle(cur)
@@ -714,33 +1023,27 @@ proc extractText(state: var FmtState, r: Rope, extract: TextPlane) =
 
       subextract(cur.toHighlight)
       addStyledText(extract.addRunestoExtraction(urlRunes))
+    of RopeFgColor:
+      let tweak = FmtStyle(textColor: some(cur.color))
+      let style = state.curStyle.mergeStyles(tweak)
+      state.pushStyle(style)
+      subextract(r.toColor)
+      state.popStyle()
+    of RopeBgColor:
+      let tweak = FmtStyle(bgColor: some(cur.color))
+      state.pushStyle(state.curStyle.mergeStyles(tweak))
+      addStyledText(subextract(cur.toColor))
+      state.popStyle()
+    of RopeBreak:
+      # For now, we don't care about kind of break.
+      extract.lines.add(@[])
+    of RopeTaggedContainer:
+      let styleOpt = state.getNewStartStyle(cur)
+      state.pushStyle(styleOpt.getOrElse(state.curStyle))
+      subextract(cur.contained)
+      state.popStyle()
     else:
-      if not cur.noBoxRequired():
-        state.savedRopes.add(state.nextRope)
-        state.nextRope = cur
-        return
-      case cur.kind
-      of RopeFgColor:
-        let tweak = FmtStyle(textColor: some(cur.color))
-        let style = state.curStyle.mergeStyles(tweak)
-        state.pushStyle(style)
-        subextract(r.toColor)
-        state.popStyle()
-      of RopeBgColor:
-        let tweak = FmtStyle(bgColor: some(cur.color))
-        state.pushStyle(state.curStyle.mergeStyles(tweak))
-        addStyledText(subextract(cur.toColor))
-        state.popStyle()
-      of RopeBreak:
-        # For now, we don't care about kind of break.
-        extract.lines.add(@[])
-      of RopeTaggedContainer:
-        let styleOpt = state.getNewStartStyle(cur)
-        state.pushStyle(styleOpt.getOrElse(state.curStyle))
-        subextract(cur.contained)
-        state.popStyle()
-      else:
-        assert false
+      assert false
 
     cur = cur.next
 
@@ -750,33 +1053,34 @@ proc extractText(state: var FmtState, r: Rope): TextPlane =
 
 proc preRenderTextBox(state: var FmtState, p: seq[TextPlane]): seq[RenderBox] =
   state.boxContent(state.curStyle, result):
+    # Boxes hold TextPlanes, so wrap per line here; going through a
+    # FlatTextPlane would copy everything twice more.
     var merged = p.mergeTextPlanes()
     merged.wrapToWidth(state.curStyle, state.totalWidth)
     result = @[RenderBox(contents: merged, width: state.totalWidth)]
 
 template planesToBox() =
   if len(consecutivePlanes) != 0:
-    result &= state.preRenderTextBox(consecutivePlanes)
+    yield state.preRenderTextBox(consecutivePlanes)
     consecutivePlanes = @[]
 
-proc preRenderAligned(state: var FmtState, r: Rope): seq[RenderBox] =
-  var tweak: Option[FmtStyle]
-
+proc alignmentTweak(r: Rope): Option[FmtStyle] =
   case r.tag[0]
   of 'l':
-    tweak = some(FmtStyle(alignStyle: some(AlignL)))
+    result = some(FmtStyle(alignStyle: some(AlignL)))
   of 'c':
-    tweak = some(FmtStyle(alignStyle: some(AlignC)))
+    result = some(FmtStyle(alignStyle: some(AlignC)))
   of 'r':
-    tweak = some(FmtStyle(alignStyle: some(AlignR)))
+    result = some(FmtStyle(alignStyle: some(AlignR)))
   of 'j':
-    tweak = some(FmtStyle(alignStyle: some(AlignJ)))
+    result = some(FmtStyle(alignStyle: some(AlignJ)))
   of 'f':
-    tweak = some(FmtStyle(alignStyle: some(AlignF)))
+    result = some(FmtStyle(alignStyle: some(AlignF)))
   else:
     discard
 
-  fmtBox(tweak):
+proc preRenderAligned(state: var FmtState, r: Rope): seq[RenderBox] =
+  fmtBox(r.alignmentTweak()):
     result = state.preRender(r.contained)
 
 proc preRenderBreak(state: var FmtState, r: Rope): seq[RenderBox] =
@@ -791,14 +1095,300 @@ proc preRenderColor(state:  var FmtState, r: Rope): seq[RenderBox] =
   standardBox:
     result = state.preRender(r.toColor)
 
-proc preRender(state: var FmtState, r: Rope): seq[RenderBox] =
-  ## This version of prerender returns a COLUMN of boxes of one single
-  ## width.  But generally, there should only be one item in the
-  ## column when possible, which itself should consist of one
-  ## TextPlane item.
-  ##
-  ## The exception to that is RopeTableRows, which leaves it to
-  ## RopeTable to do the combination.
+proc ropeHash(state: var FmtState, r: Rope): Hash
+
+proc chainHash(state: var FmtState, r: Rope): Hash =
+  var cur = r
+  while cur != nil:
+    result = result !& state.ropeHash(cur)
+    cur    = cur.next
+  result = !$result
+
+proc ropeHash(state: var FmtState, r: Rope): Hash =
+  # A hash of one node and everything it contains, but not of what
+  # comes after it. Ropes are mutable, so this is what we key the
+  # render cache on, not identity; `+`, `&` and direct edits all
+  # change it. We remember it per node for the length of one render,
+  # so nested lookups don't rehash.
+  if r == nil:
+    return 0
+  if r in state.hashes:
+    return state.hashes[r]
+
+  var h = hash(ord(r.kind)) !& hash(r.tag) !& hash(r.id) !& hash(r.class) !&
+          hash(r.width)
+
+  case r.kind
+  of RopeAtom:
+    h = h !& hash(cast[seq[uint32]](r.text))
+  of RopeBreak:
+    h = h !& hash(ord(r.breakType)) !& state.chainHash(r.guts)
+  of RopeLink:
+    h = h !& hash(r.url) !& state.chainHash(r.toHighlight)
+  of RopeList:
+    for item in r.items:
+      h = h !& state.chainHash(item)
+  of RopeTaggedContainer, RopeAlignedContainer:
+    h = h !& state.chainHash(r.contained)
+  of RopeTable:
+    for info in r.colInfo:
+      h = h !& hash(info.span) !& hash(info.widthPct)
+    h = h !& state.chainHash(r.thead) !& state.chainHash(r.tbody) !&
+         state.chainHash(r.tfoot) !& state.chainHash(r.caption)
+  of RopeTableRow, RopeTableRows:
+    for cell in r.cells:
+      h = h !& state.chainHash(cell)
+  of RopeFgColor, RopeBgColor:
+    h = h !& hash(r.color) !& state.chainHash(r.toColor)
+
+  result           = !$h
+  state.hashes[r] = result
+
+proc sameRope(a, b: Rope): bool
+
+proc sameChain(a, b: Rope): bool =
+  var
+    x = a
+    y = b
+
+  while x != nil and y != nil:
+    if not sameRope(x, y):
+      return false
+    x = x.next
+    y = y.next
+
+  return x == y
+
+proc sameRope(a, b: Rope): bool =
+  # Compares everything ropeHash() hashes, for when two ropes have
+  # the same hash.
+  if a == b:
+    return true
+  if a == nil or b == nil or a.kind != b.kind or a.tag != b.tag or
+     a.id != b.id or a.class != b.class or a.width != b.width:
+    return false
+
+  case a.kind
+  of RopeAtom:
+    return a.text == b.text
+  of RopeBreak:
+    return a.breakType == b.breakType and sameChain(a.guts, b.guts)
+  of RopeLink:
+    return a.url == b.url and sameChain(a.toHighlight, b.toHighlight)
+  of RopeList:
+    if a.items.len() != b.items.len():
+      return false
+    for i in 0 ..< a.items.len():
+      if not sameChain(a.items[i], b.items[i]):
+        return false
+    return true
+  of RopeTaggedContainer, RopeAlignedContainer:
+    return sameChain(a.contained, b.contained)
+  of RopeTable:
+    return a.colInfo == b.colInfo and sameChain(a.thead, b.thead) and
+           sameChain(a.tbody, b.tbody) and sameChain(a.tfoot, b.tfoot) and
+           sameChain(a.caption, b.caption)
+  of RopeTableRow, RopeTableRows:
+    if a.cells.len() != b.cells.len():
+      return false
+    for i in 0 ..< a.cells.len():
+      if not sameChain(a.cells[i], b.cells[i]):
+        return false
+    return true
+  of RopeFgColor, RopeBgColor:
+    return a.color == b.color and sameChain(a.toColor, b.toColor)
+
+proc cacheKey(state: FmtState, h: Hash, topLevel: bool): RenderCacheKey =
+  result = (rope:     h,
+            width:    state.totalWidth,
+            style:    state.curStyle.getStyleId(),
+            links:    state.showLinkTarg,
+            cols:     Hash(0),
+            even:     -1,
+            topLevel: topLevel)
+
+  if state.colStack.len() != 0:
+    result.cols = hash(state.colStack[^1])
+  if state.tableEven.len() != 0:
+    result.even = ord(state.tableEven[^1])
+
+proc copyBox(box: RenderBox): RenderBox =
+  # Boxes get their margins and contents changed as they get
+  # collapsed into their parents, so the cache never hands out its
+  # own copy.
+  result = RenderBox(tmargin: box.tmargin, bmargin: box.bmargin,
+                     width: box.width)
+  if box.contents != nil:
+    result.contents = TextPlane(lines:     box.contents.lines,
+                                width:     box.contents.width,
+                                softBreak: box.contents.softBreak)
+
+proc unlinkEntry(entry: RenderCacheEntry) =
+  if entry.prev != nil:
+    entry.prev.next = entry.next
+  else:
+    renderCacheHead = entry.next
+  if entry.next != nil:
+    entry.next.prev = entry.prev
+  else:
+    renderCacheTail = entry.prev
+  entry.prev = nil
+  entry.next = nil
+
+proc pushEntry(entry: RenderCacheEntry) =
+  entry.next = renderCacheHead
+  if renderCacheHead != nil:
+    renderCacheHead.prev = entry
+  renderCacheHead = entry
+  if renderCacheTail == nil:
+    renderCacheTail = entry
+
+proc evictDownTo(n: int) =
+  while renderCache.len() > n:
+    let victim = renderCacheTail
+    victim.unlinkEntry()
+    renderCache.del(victim.key)
+    renderCacheStats.evictions += 1
+
+proc clearRenderCache*() =
+  ## Drops everything in the calling thread's render cache. You
+  ## shouldn't need to; entries are keyed on rope contents, and
+  ## anything that changes styles or color settings empties the cache
+  ## on the next render.
+  renderCache.clear()
+  renderCacheHead = nil
+  renderCacheTail = nil
+
+proc setRenderCacheSize*(entries: int) =
+  ## Sets how many rendered subtrees the cache holds onto before it
+  ## starts evicting the least recently used. 0 turns caching off.
+  ## The limit applies to every thread, but only the calling thread's
+  ## cache is trimmed right away; the others shrink on their next store.
+  renderCacheCap = max(entries, 0)
+  evictDownTo(renderCacheCap)
+
+proc getRenderCacheStats*(): RenderCacheStats =
+  ## Hit / miss counts and the size of the calling thread's cache.
+  result          = renderCacheStats
+  result.entries  = renderCache.len()
+  result.capacity = renderCacheCap
+
+proc hitRate*(stats: RenderCacheStats): float =
+  ## The fraction of lookups that were hits, 0 if there were none.
+  let total = stats.hits + stats.misses
+  if total == 0:
+    return 0.0
+  return stats.hits / total
+
+proc cacheLookup(key: RenderCacheKey, r: Rope): RenderCacheEntry =
+  # Top-level entries are for the whole chain starting at `r`; the
+  # rest are for the one node.
+  if renderCacheGen != getRenderGeneration():
+    clearRenderCache()
+    renderCacheGen = getRenderGeneration()
+
+  result = renderCache.getOrDefault(key)
+  if result != nil:
+    let same = if key.topLevel: sameChain(result.rope, r)
+               else:            sameRope(result.rope, r)
+    if not same:
+      result = nil
+
+  if result == nil:
+    renderCacheStats.misses += 1
+  else:
+    renderCacheStats.hits += 1
+    result.unlinkEntry()
+    result.pushEntry()
+
+proc cacheStore(entry: RenderCacheEntry) =
+  # A collision replaces whatever had the key before.
+  let old = renderCache.getOrDefault(entry.key)
+  if old != nil:
+    old.unlinkEntry()
+    renderCache.del(old.key)
+
+  evictDownTo(renderCacheCap - 1)
+  renderCache[entry.key] = entry
+  entry.pushEntry()
+
+proc preRenderUncached(state: var FmtState, r: Rope): seq[RenderBox] =
+  case r.kind
+  of RopeList:
+    if r.tag == "ul":
+      result = state.preRenderUnorderedList(r)
+    else:
+      result = state.preRenderOrderedList(r)
+  of RopeTable:
+    result = state.preRenderTable(r)
+  of RopeTableRow:
+    result = state.preRenderRow(r)
+  of RopeTableRows:
+    result = state.preRenderRows(r)
+  of RopeAlignedContainer:
+    result = state.preRenderAligned(r)
+  of RopeBreak:
+    result = state.preRenderBreak(r)
+  of RopeTaggedContainer:
+    result = state.preRenderTagged(r)
+  of RopeFgColor, RopeBgColor:
+    result = state.preRenderColor(r)
+  else:
+    discard
+
+proc preRenderBoxed(state: var FmtState, r: Rope): seq[RenderBox] =
+  # Anything that needs a box comes through here, so that subtrees we
+  # have already laid out at this width and style get reused. When
+  # the text extraction has left a rope for us to get back to, the
+  # result depends on more than the subtree, so we don't cache.
+  if renderCacheCap == 0 or state.nextRope != nil or inCellWorker or
+     r == state.chunkTable:
+    return state.preRenderUncached(r)
+
+  let key   = state.cacheKey(state.ropeHash(r), false)
+  var entry = key.cacheLookup(r)
+
+  if entry != nil:
+    state.processed &= entry.processed
+    if entry.cols.len() != 0:
+      state.colStack[^1] = entry.cols
+    for box in entry.boxes:
+      result.add(box.copyBox())
+    return
+
+  let nProcessed = state.processed.len()
+
+  result = state.preRenderUncached(r)
+
+  if state.nextRope != nil:
+    return
+
+  entry = RenderCacheEntry(key: key, rope: r,
+                           processed: state.processed[nProcessed .. ^1])
+  if state.colStack.len() != 0:
+    entry.cols = state.colStack[^1]
+  for box in result:
+    entry.boxes.add(box.copyBox())
+  entry.cacheStore()
+
+proc nextInColumn(state: var FmtState, cur: Rope): Rope =
+  # What boxColumn() and measureColumn() go on to after `cur`: a rope
+  # that text extraction handed back, if there is one, otherwise the
+  # next in the chain, skipping whatever's already been extracted.
+  result = cur
+  while result != nil:
+    if state.nextRope != nil:
+      result         = state.nextRope
+      state.nextRope = state.savedRopes.pop()
+    else:
+      result = result.next
+    if result notin state.processed:
+      break
+
+iterator boxColumn(state: var FmtState, r: Rope): seq[RenderBox] =
+  # Yields the boxes for `r` and everything after it, a block at a
+  # time: each run of text that doesn't need a box, and each thing
+  # that does. Nothing gets laid out before it's asked for.
 
   var
     consecutivePlanes: seq[TextPlane]
@@ -810,45 +1400,34 @@ proc preRender(state: var FmtState, r: Rope): seq[RenderBox] =
       consecutivePlanes.add(textBox)
     else:
       planesToBox()
+      yield state.preRenderBoxed(curRope)
 
-      case curRope.kind
-      of RopeList:
-        if curRope.tag == "ul":
-          result &= state.preRenderUnorderedList(curRope)
-        else:
-          result &= state.preRenderOrderedList(curRope)
-      of RopeTable:
-        result &= state.preRenderTable(curRope)
-      of RopeTableRow:
-        result &= state.preRenderRow(curRope)
-      of RopeTableRows:
-        result &= state.preRenderRows(curRope)
-      of RopeAlignedContainer:
-        result &= state.preRenderAligned(curRope)
-      of RopeBreak:
-        result &= state.preRenderBreak(curRope)
-      of RopeTaggedContainer:
-        result &= state.preRenderTagged(curRope)
-      of RopeFgColor, RopeBgColor:
-        result &= state.preRenderColor(curRope)
-      else:
-        discard
-
-    while curRope != nil:
-      if state.nextRope != nil:
-        curRope        = state.nextRope
-        state.nextRope = state.savedRopes.pop()
-      else:
-        curRope = curRope.next
-      if curRope in state.processed:
-        continue
-      else:
-        break
+    curRope = state.nextInColumn(curRope)
 
   planesToBox()
 
-proc preRender*(r: Rope, width = -1, showLinkTargets = false,
-                defaultStyle = defaultStyle): TextPlane =
+proc preRender(state: var FmtState, r: Rope): seq[RenderBox] =
+  ## This version of prerender returns a COLUMN of boxes of one single
+  ## width.  But generally, there should only be one item in the
+  ## column when possible, which itself should consist of one
+  ## TextPlane item.
+  ##
+  ## The exception to that is RopeTableRows, which leaves it to
+  ## RopeTable to do the combination.
+  for boxes in state.boxColumn(r):
+    result &= boxes
+
+proc resolveWidth(width: int): int =
+  if width <= 0:
+    result = terminalWidth()
+  else:
+    result = width
+
+  if result <= 0:
+    result = defaultTextWidth
+
+proc preRenderFlat*(r: Rope, width = -1, showLinkTargets = false,
+                    defaultStyle = defaultStyle): FlatTextPlane =
   ## Denoted in the stream of characters to output, what styles
   ## should be applied, when. We do this by dropping in unique
   ## values into the uint32 stream that cannot be codepoints.  This
@@ -856,6 +1435,17 @@ proc preRender*(r: Rope, width = -1, showLinkTargets = false,
   ##
   ## There's a value for pop as well.
   ##
+  ## The result is a FlatTextPlane, which keeps all the lines in one
+  ## buffer; `preRender()` is the same thing, but returns a TextPlane.
+  ##
+  ## Results are cached, keyed on the rope's contents, the width and
+  ## the style, as are the boxes for any tables, lists and other boxed
+  ## subtrees within. So re-rendering the same (or a mostly unchanged)
+  ## rope is cheap, though a hit still costs a pass over the rope to
+  ## hash and compare it. The cache is per thread. See
+  ## `setRenderCacheSize()` and
+  ## `getRenderCacheStats()`.
+  ##
   ## Note that if you don't pass a width in, we end up calling an
   ## ioctl to query the terminal width. That does seem a bit
   ## excessive, and we could certainly register to handle
@@ -864,21 +1454,73 @@ proc preRender*(r: Rope, width = -1, showLinkTargets = false,
   ## leave it.
 
   var
-    state = FmtState(curStyle: defaultStyle, showLinkTarg: showLinkTargets)
+    state = FmtState(curStyle:     defaultStyle,
+                     showLinkTarg: showLinkTargets,
+                     totalWidth:   width.resolveWidth())
     strip = false
 
-  if width <= 0:
-    state.totalWidth = terminalWidth()
-  else:
-    state.totalWidth = width
+  if r.noBoxRequired():
+    state.totalWidth = r.unboxedRuneLength() + 1
+    strip            = true
+
+  var key: RenderCacheKey
+
+  if renderCacheCap != 0:
+    key = state.cacheKey(state.chainHash(r), true)
+    let entry = key.cacheLookup(r)
+    if entry != nil:
+      result           = entry.plane.toSlice().copy()
+      result.softBreak = entry.plane.softBreak
+      return
+
+  result       = state.collapseColumnToFlat(state.preRender(r))
+  result.width = state.totalWidth
+
+  if strip:
+    # Trailing lines that end up empty get dropped, so the only line
+    # that can change in place is the new last one.
+    var n            = result.lineCount()
+    result.softBreak = true
+
+    while n != 0:
+      n -= 1
+      result.deleteLines(n + 1, result.lineCount())
+      let stripped = @(result.lineRunes(n)).stripSpacesButNotFormattersFromEnd()
+      result.splice(n, n + 1, stripped)
+      if stripped.u32LineLength() != 0:
+        break
+      if n == 0:
+        result.deleteLines(0, 1)
 
-  if state.totalWidth <= 0:
-    state.totalWidth = defaultTextWidth
+  if renderCacheCap != 0:
+    let entry = RenderCacheEntry(key: key, rope: r,
+                                 plane: result.toSlice().copy())
+    entry.plane.softBreak = result.softBreak
+    entry.cacheStore()
+
+proc preRender*(r: Rope, width = -1, showLinkTargets = false,
+                defaultStyle = defaultStyle): TextPlane =
+  ## Like `preRenderFlat()`, but returns a TextPlane, with one seq per
+  ## line. The lines get built directly; nothing goes through a
+  ## FlatTextPlane except what's stored in or taken from the cache.
+  var
+    state = FmtState(curStyle:     defaultStyle,
+                     showLinkTarg: showLinkTargets,
+                     totalWidth:   width.resolveWidth())
+    strip = false
 
   if r.noBoxRequired():
     state.totalWidth = r.unboxedRuneLength() + 1
     strip            = true
 
+  var key: RenderCacheKey
+
+  if renderCacheCap != 0:
+    key = state.cacheKey(state.chainHash(r), true)
+    let entry = key.cacheLookup(r)
+    if entry != nil:
+      return entry.plane.toTextPlane()
+
   let preRender = state.collapseColumn(state.preRender(r))
   result        = state.collapsedBoxToTextPlane(preRender)
   result.width  = state.totalWidth
@@ -897,3 +1539,369 @@ proc preRender*(r: Rope, width = -1, showLinkTargets = false,
         result.lines = result.lines[0 ..< ^1]
       else:
         break
+
+  if renderCacheCap != 0:
+    RenderCacheEntry(key: key, rope: r,
+                     plane: result.toFlatTextPlane()).cacheStore()
+
+proc blockToFlat(state: FmtState, box: RenderBox, first, last: bool,
+                 endMargin: int): FlatTextPlane =
+  # One box's worth of what collapseColumnToFlat() would produce for
+  # the whole column; the margins at the very top and bottom come
+  # from the first box, like they do there.
+  let
+    style   = state.curStyle
+    lineLen = state.totalWidth - style.lpad.get(0) - style.rpad.get(0)
+    blank   = state.pad(lineLen)
+    margin  = state.pad(0)
+
+  result       = newFlatTextPlane()
+  result.width = state.totalWidth
+
+  for i in 0 ..< box.tmargin:
+    result.addLine(if first: margin else: blank)
+
+  for line in box.contents.lines:
+    result.addLine(line)
+
+  if last:
+    for i in 0 ..< endMargin:
+      result.addLine(margin)
+  else:
+    for i in 0 ..< box.bmargin:
+      result.addLine(blank)
+
+iterator preRenderBlocks*(r: Rope, width = -1, showLinkTargets = false,
+                          defaultStyle = defaultStyle): FlatTextPlane =
+  ## A lazy `preRenderFlat()`. Top-level blocks (paragraphs, tables,
+  ## lists and so on) get laid out one at a time, as you ask for
+  ## them, so you can start showing a very long document right away,
+  ## and only hold onto what you haven't output yet.
+  ##
+  ## Putting all the planes together gets you what `preRenderFlat()`
+  ## returns.
+  if r != nil and r.noBoxRequired():
+    # No blocks to speak of; it's a single run of text.
+    yield r.preRenderFlat(width, showLinkTargets, defaultStyle)
+  elif r != nil:
+    var
+      state     = FmtState(curStyle:     defaultStyle,
+                           showLinkTarg: showLinkTargets,
+                           totalWidth:   width.resolveWidth())
+      pending:  RenderBox
+      first     = true
+      endMargin = 0
+
+    # We hang onto one box, since the last one gets different margins.
+    for boxes in state.boxColumn(r):
+      for box in boxes:
+        if pending == nil:
+          endMargin = box.bmargin
+        else:
+          yield state.blockToFlat(pending, first, false, endMargin)
+          first = false
+        pending = box
+
+    if pending != nil:
+      yield state.blockToFlat(pending, first, true, endMargin)
+
+iterator preRenderLines*(r: Rope, width = -1, showLinkTargets = false,
+                         defaultStyle = defaultStyle): seq[uint32] =
+  ## Like `preRenderBlocks()`, but a line at a time.
+  for plane in r.preRenderBlocks(width, showLinkTargets, defaultStyle):
+    for i in 0 ..< plane.lineCount():
+      yield @(plane.lineRunes(i))
+
+proc preRenderTableChunk*(chunk: Rope, first, last: bool, width = -1,
+                          showLinkTargets = false,
+                          defaultStyle = defaultStyle): FlatTextPlane =
+  ## Lays out `chunk`, a RopeTable holding some of a bigger table's
+  ## rows, so that chunks laid out in order and output one after
+  ## another look like the whole table would: only the `first` chunk
+  ## gets the top border, only the `last` gets the bottom one, and
+  ## chunks in between get joined like rows. Give every chunk the same
+  ## colInfo (or none, for even columns) so the columns line up, and
+  ## an even number of rows so the row colors keep alternating.
+  var state = FmtState(curStyle:     defaultStyle,
+                       showLinkTarg: showLinkTargets,
+                       totalWidth:   width.resolveWidth(),
+                       chunkTable:   chunk,
+                       chunkFirst:   first,
+                       chunkLast:    last)
+
+  result       = state.collapseColumnToFlat(state.preRender(chunk))
+  result.width = state.totalWidth
+
+iterator preRenderTableChunks*(r: Rope, chunkRows = 256, width = -1,
+                               showLinkTargets = false,
+                               defaultStyle = defaultStyle): FlatTextPlane =
+  ## Lays out the table `r` `chunkRows` body rows at a time, with
+  ## `preRenderTableChunk()`, so that the first rows of a huge table
+  ## can be shown before the rest are laid out.
+  let
+    rows = if r.tbody != nil: r.tbody.cells else: @[]
+    step = max(2, chunkRows + chunkRows mod 2)
+  var start = 0
+
+  while true:
+    let
+      stop  = min(start + step, rows.len())
+      chunk = Rope(kind: RopeTable, tag: r.tag, id: r.id, class: r.class,
+                   width: r.width, colInfo: r.colInfo)
+
+    if start == 0:
+      chunk.thead = r.thead
+    if r.tbody != nil:
+      chunk.tbody = Rope(kind: RopeTableRows, tag: r.tbody.tag,
+                         id: r.tbody.id, class: r.tbody.class,
+                         cells: rows[start ..< stop])
+    if stop == rows.len():
+      chunk.tfoot   = r.tfoot
+      chunk.caption = r.caption
+
+    yield chunk.preRenderTableChunk(start == 0, stop == rows.len(), width,
+                                    showLinkTargets, defaultStyle)
+
+    if stop == rows.len():
+      break
+    start = stop
+
+# Measurement. This follows the same steps as the layout above, but a
+# box is a MeasureBox, just its line count and width. The box
+# templates, list hangs, column widths and the walk over the rope are
+# all shared with layout. Text still gets extracted and wrapped, since
+# that's the only way to know where lines break, but into one scratch
+# buffer per run of text, with a placeholder in place of each style
+# marker, and the wrapping only counts.
+
+type
+  RopeExtent* = object
+    width*:  int ## Columns in the widest line.
+    height*: int ## Lines.
+
+proc measureColumn(state: var FmtState, r: Rope): seq[MeasureBox]
+
+proc addMeasuredText(text: FlatTextPlane, runes: seq[Rune]) =
+  for rune in runes:
+    if rune == Rune('\n'):
+      text.newLine()
+    else:
+      text.add(uint32(rune))
+
+template addPlaceholderText(code: untyped) =
+  # Where addStyledText() would put style markers. Which style it is
+  # doesn't matter for wrapping, only that there's a marker there.
+  text.add(StylePop)
+  code
+  text.add(StylePop)
+
+proc measureText(state: var FmtState, r: Rope, text: FlatTextPlane) =
+  # extractText(), step for step.
+  var cur: Rope = r
+  while cur != nil:
+    if not state.textContinues(r, cur):
+      return
+    case cur.kind
+    of RopeAtom:
+      addPlaceholderText(text.addMeasuredText(cur.text))
+    of RopeLink:
+      state.measureText(cur.toHighlight, text)
+      addPlaceholderText:
+        if state.showLinkTarg:
+          text.addMeasuredText(@[Rune('(')] & cur.url.toRunes() &
+                               @[Rune(')')])
+    of RopeFgColor:
+      state.measureText(r.toColor, text)
+    of RopeBgColor:
+      addPlaceholderText(state.measureText(cur.toColor, text))
+    of RopeBreak:
+      text.newLine()
+    of RopeTaggedContainer:
+      state.measureText(cur.contained, text)
+    else:
+      assert false
+
+    cur = cur.next
+
+proc measureTextBox(state: var FmtState,
+                    text: FlatTextPlane): seq[MeasureBox] =
+  state.boxContent(state.curStyle, result):
+    result = @[MeasureBox(lines: text.wrappedLineCount(state.curStyle,
+                                                       state.totalWidth))]
+
+proc measureList(state: var FmtState, r: Rope): seq[MeasureBox] =
+  # The bullets don't change the line count, only how wide the items
+  # get laid out.
+  standardBox:
+    let hangLen = if r.tag == "ul": state.curStyle.unorderedHangLen()
+                  else: state.curStyle.orderedHangLen(len(r.items))
+
+    state.hangingItems(hangLen):
+      for item in r.items:
+        result.add(state.measureColumn(item)[0])
+
+proc measureTable(state: var FmtState, r: Rope): seq[MeasureBox] =
+  standardBox:
+    let
+      style  = state.curStyle
+      border = MeasureBox(lines: 1)
+
+    state.pushTableWidths(state.percentToActualColumns(r.tableColPcts()))
+
+    if r.thead != Rope(nil):
+      result &= state.measureColumn(r.thead)
+    if r.tbody != Rope(nil):
+      result &= state.measureColumn(r.tbody)
+    if r.tfoot != Rope(nil):
+      result &= state.measureColumn(r.tfoot)
+
+    if style.useHorizontalSeparator.getOrElse(false):
+      var newBoxes: seq[MeasureBox]
+
+      for i, item in result:
+        newBoxes.add(item)
+        if (i + 1) != len(result):
+          newBoxes.add(border)
+
+      result = newBoxes
+
+    if style.useTopBorder.getOrElse(false):
+      result = @[border] & result
+    if style.useBottomBorder.getOrElse(false):
+      result.add(border)
+
+    state.popTableWidths()
+    if r.caption != Rope(nil):
+      result &= state.measureColumn(r.caption)
+
+proc measureRow(state: var FmtState, r: Rope): seq[MeasureBox] =
+  var
+    tag    = if state.tableEven[^1]: "tr.even" else: "tr.odd"
+    widths: seq[int]
+    height: int
+    inner:  int
+
+  taggedBox(tag):
+    widths = state.rowWidths(r)
+    inner  = state.totalWidth
+
+    for i, width in widths:
+      var cellLines = 1 # What emptyTableCell() gives.
+
+      if i < len(r.cells):
+        state.totalWidth = width
+        cellLines        = 0
+        for box in state.measureColumn(r.cells[i]):
+          cellLines += box.lines
+
+      height = max(height, cellLines)
+
+  # The row isn't padded, so it's as wide as its cells and borders.
+  var width = state.curStyle.borderOverhead(len(widths))
+
+  for w in widths:
+    width += w
+
+  result           = @[MeasureBox(lines: height, width: width)]
+  state.totalWidth = inner # Like preRenderRow() leaves it.
+
+proc measureRows(state: var FmtState, r: Rope): seq[MeasureBox] =
+  state.tableEven.add(false)
+  for item in r.cells:
+    result &= state.measureColumn(item)
+    state.tableEven.add(not state.tableEven.pop())
+  discard state.tableEven.pop()
+
+proc measureBoxed(state: var FmtState, r: Rope): seq[MeasureBox] =
+  case r.kind
+  of RopeList:
+    result = state.measureList(r)
+  of RopeTable:
+    result = state.measureTable(r)
+  of RopeTableRow:
+    result = state.measureRow(r)
+  of RopeTableRows:
+    result = state.measureRows(r)
+  of RopeAlignedContainer:
+    fmtBox(r.alignmentTweak()):
+      result = state.measureColumn(r.contained)
+  of RopeBreak:
+    standardBox:
+      result = state.measureColumn(r.guts)
+  of RopeTaggedContainer:
+    standardBox:
+      result = state.measureColumn(r.contained)
+  of RopeFgColor, RopeBgColor:
+    standardBox:
+      result = state.measureColumn(r.toColor)
+  else:
+    discard
+
+proc measureColumn(state: var FmtState, r: Rope): seq[MeasureBox] =
+  # boxColumn(), collected.
+  var
+    text:    FlatTextPlane
+    curRope = r
+
+  while curRope != nil:
+    if curRope.noBoxRequired():
+      if text == nil:
+        text = newFlatTextPlane()
+        text.newLine()
+      state.measureText(curRope, text)
+    else:
+      if text != nil:
+        result &= state.measureTextBox(text)
+        text = nil
+      result &= state.measureBoxed(curRope)
+
+    curRope = state.nextInColumn(curRope)
+
+  if text != nil:
+    result &= state.measureTextBox(text)
+
+proc measure*(r: Rope, width = -1, showLinkTargets = false,
+              defaultStyle = defaultStyle): RopeExtent =
+  ## Returns how many lines `preRenderFlat()` would give for `r` at
+  ## this width and style, and how wide the widest of them would be,
+  ## without laying it out. Text gets wrapped, but only to count the
+  ## lines; no planes or style markers get built. So it's cheap to
+  ## try a few widths to see what fits.
+  ##
+  ## A rope with nothing that needs a box gets laid out at its own
+  ## length whatever the width, and then trimmed; for that case, we
+  ## render it (the result then sits in the render cache).
+  if r == nil:
+    return
+
+  if r.noBoxRequired():
+    let plane = r.preRenderFlat(width, showLinkTargets, defaultStyle)
+
+    result.height = plane.lineCount()
+    for i in 0 ..< plane.lineCount():
+      result.width = max(result.width, plane.lineRunes(i).u32LineLength())
+    return
+
+  var state = FmtState(curStyle:     defaultStyle,
+                       showLinkTarg: showLinkTargets,
+                       totalWidth:   width.resolveWidth())
+
+  let
+    boxes   = state.measureColumn(r)
+    style   = state.curStyle
+    lineLen = state.totalWidth - style.lpad.get(0) - style.rpad.get(0)
+
+  # As in collapseColumnToFlat(); the outer margins are empty lines.
+  for i, box in boxes:
+    if i != 0 and box.tmargin != 0:
+      result.height += box.tmargin
+      result.width   = max(result.width, lineLen)
+    if box.lines != 0:
+      result.height += box.lines
+      result.width   = max(result.width, box.width)
+    if i != len(boxes) - 1 and box.bmargin != 0:
+      result.height += box.bmargin
+      result.width   = max(result.width, lineLen)
+
+  if boxes.len() != 0:
+    result.height += boxes[0].tmargin + boxes[0].bmargin
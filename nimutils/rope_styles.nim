@@ -2,7 +2,7 @@
 ## :Author: John Viega (john@crashoverride.com)
 ## :Copyright: 2023, Crash Override, Inc.
 
-import unicode, tables, rope_base, options
+import unicode, tables, rope_base, options, colortable
 
 proc newStyle*(fgColor = "", bgColor = "", overflow = OIgnore, hang = -1,
                lpad = -1, rpad = -1, casing = CasingIgnore,
@@ -189,7 +189,9 @@ var
 {.emit: """
 #include <stdatomic.h>
 #include <stdint.h>
+#include <stdlib.h>
 
+// Must match firstStyleId below.
 _Atomic(uint32_t) next_id = ATOMIC_VAR_INIT(0x1ffffff);
 
 uint32_t
@@ -197,38 +199,190 @@ next_style_id() {
   return atomic_fetch_add(&next_id, 1);
 }
 
+// Id -> style lookups index into chunks that never move once they're
+// published, so readers never take a lock or retry.
+#define STYLE_CHUNK_BITS  10
+#define STYLE_CHUNK_SIZE  (1 << STYLE_CHUNK_BITS)
+#define STYLE_MAX_CHUNKS  4096
+
+static _Atomic(_Atomic(void *) *) style_chunks[STYLE_MAX_CHUNKS];
+
+static _Atomic(void *) *
+style_chunk(uint32_t ix, int create) {
+  uint32_t               n = ix >> STYLE_CHUNK_BITS;
+  _Atomic(void *)       *chunk;
+  _Atomic(void *)       *expected = NULL;
+
+  if (n >= STYLE_MAX_CHUNKS) {
+    return NULL;
+  }
+
+  chunk = atomic_load(&style_chunks[n]);
+
+  if (chunk || !create) {
+    return chunk;
+  }
+
+  chunk = calloc(STYLE_CHUNK_SIZE, sizeof(_Atomic(void *)));
+
+  if (!atomic_compare_exchange_strong(&style_chunks[n], &expected, chunk)) {
+    free(chunk);
+    chunk = expected;
+  }
+
+  return chunk;
+}
+
+int
+style_registry_set(uint32_t ix, void *style) {
+  _Atomic(void *) *chunk = style_chunk(ix, 1);
+
+  if (!chunk) {
+    return 0;
+  }
+  atomic_store(&chunk[ix & (STYLE_CHUNK_SIZE - 1)], style);
+  return 1;
+}
+
+void *
+style_registry_get(uint32_t ix) {
+  _Atomic(void *) *chunk = style_chunk(ix, 0);
+
+  if (!chunk) {
+    return NULL;
+  }
+  return atomic_load(&chunk[ix & (STYLE_CHUNK_SIZE - 1)]);
+}
+
+// (base id, change id) -> merged id. Open addressing with a bounded
+// probe; once it's full, merges just don't get memoized. A reader can
+// see a key before its value; that counts as a miss.
+#define STYLE_MEMO_SIZE   8192
+#define STYLE_MEMO_PROBES 16
+
+static _Atomic(uint64_t) style_memo_keys[STYLE_MEMO_SIZE];
+static _Atomic(uint32_t) style_memo_vals[STYLE_MEMO_SIZE];
+
+// The render generation the memo is good for; -1 while it's being
+// emptied.
+static _Atomic(int64_t)  style_memo_gen = ATOMIC_VAR_INIT(0);
+
+// Returns whether the memo can be used in render generation `gen`.
+// The first caller in a new generation empties it; anyone who shows
+// up while that's going on just doesn't get to use it.
+int
+style_memo_ready(int64_t gen) {
+  int64_t seen = atomic_load(&style_memo_gen);
+
+  if (seen == gen) {
+    return 1;
+  }
+  if (seen == -1 ||
+      !atomic_compare_exchange_strong(&style_memo_gen, &seen, -1)) {
+    return 0;
+  }
+
+  for (int i = 0; i < STYLE_MEMO_SIZE; i++) {
+    atomic_store(&style_memo_vals[i], 0);
+    atomic_store(&style_memo_keys[i], 0);
+  }
+
+  atomic_store(&style_memo_gen, gen);
+  return 1;
+}
+
+static inline uint32_t
+style_memo_slot(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return (uint32_t)key & (STYLE_MEMO_SIZE - 1);
+}
+
+uint32_t
+style_memo_get(uint32_t base, uint32_t change) {
+  uint64_t key  = ((uint64_t)base << 32) | change;
+  uint32_t slot = style_memo_slot(key);
+
+  for (int i = 0; i < STYLE_MEMO_PROBES; i++) {
+    uint64_t found = atomic_load(&style_memo_keys[slot]);
+
+    if (found == key) {
+      return atomic_load(&style_memo_vals[slot]);
+    }
+    if (!found) {
+      return 0;
+    }
+    slot = (slot + 1) & (STYLE_MEMO_SIZE - 1);
+  }
+
+  return 0;
+}
+
+void
+style_memo_put(uint32_t base, uint32_t change, uint32_t merged) {
+  uint64_t key  = ((uint64_t)base << 32) | change;
+  uint32_t slot = style_memo_slot(key);
+
+  for (int i = 0; i < STYLE_MEMO_PROBES; i++) {
+    uint64_t found = 0;
+
+    if (atomic_compare_exchange_strong(&style_memo_keys[slot], &found, key) ||
+        found == key) {
+      atomic_store(&style_memo_vals[slot], merged);
+      return;
+    }
+    slot = (slot + 1) & (STYLE_MEMO_SIZE - 1);
+  }
+}
+
 """ .}
 
-# I'd love for each style is going to get one unique ID that we can
-# look up in both directions. Currently this won't work in a
-# multi-threaded world, but I'm going to soon migrate it to my
-# lock-free, wait-free hash tables.
+# Each style gets one unique ID that we can look up in both
+# directions, from any thread. The style remembers its own id, and id
+# to style is an index into the C registry above. Registered styles
+# are kept alive for good, so don't register throwaway styles in a
+# loop; mergeStyles() only memoizes when both inputs already have ids.
 
 proc next_style_id(): cuint {.importc, nodecl.}
+proc style_registry_set(ix: uint32, style: pointer): cint {.importc, nodecl.}
+proc style_registry_get(ix: uint32): pointer {.importc, nodecl.}
+proc style_memo_ready(gen: int64): cint {.importc, nodecl.}
+proc style_memo_get(base, change: uint32): uint32 {.importc, nodecl.}
+proc style_memo_put(base, change, merged: uint32) {.importc, nodecl.}
 
-var
-  idToStyleMap: Table[uint32, FmtStyle]
-  styleToIdMap: Table[FmtStyle, uint32]
+const firstStyleId* = 0x1ffffff'u32
 
 proc getStyleId*(s: FmtStyle): uint32 =
-  if s in styleToIdMap:
-    return styleToIdMap[s]
+  result = atomicLoadN(addr s.registeredId, ATOMIC_ACQUIRE)
+  if result != 0:
+    return
+
+  # Publish the style in the registry before the id is visible on the
+  # style. If another thread beats us, our slot just goes unused.
+  var
+    expected = 0'u32
+    newId    = uint32(next_style_id())
+
+  if style_registry_set(newId - firstStyleId, cast[pointer](s)) == 0:
+    raise newException(ValueError, "Style registry is full")
 
-  result = uint32(next_style_id())
+  if atomicCompareExchangeN(addr s.registeredId, addr expected, newId, false,
+                            ATOMIC_ACQ_REL, ATOMIC_ACQUIRE):
+    GC_ref(s)
+    return newId
 
-  idToStyleMap[result] = s
-  styleToIdMap[s]      = result
+  discard style_registry_set(newId - firstStyleId, nil)
+  return expected
 
 proc idToStyle*(n: uint32): FmtStyle =
-  result = idToStyleMap[n]
+  if n >= firstStyleId:
+    result = cast[FmtStyle](style_registry_get(n - firstStyleId))
 
-  if result == defaultStyle:
-    return
-  for k, v in styleMap:
-    if v == result:
-      return
+  if result == nil:
+    raise newException(KeyError, "Unknown style id: " & $(n))
 
-proc mergeStyles*(base: FmtStyle, changes: FmtStyle): FmtStyle =
+proc mergeStylesNoMemo(base: FmtStyle, changes: FmtStyle): FmtStyle =
   result         = base.copyStyle()
   result.lpad    = changes.lpad
   result.rpad    = changes.rpad
@@ -278,8 +432,34 @@ proc mergeStyles*(base: FmtStyle, changes: FmtStyle): FmtStyle =
   if changes.alignStyle.isSome():
     result.alignStyle = changes.alignStyle
 
+proc mergeStyles*(base: FmtStyle, changes: FmtStyle): FmtStyle =
+  ## Returns a new style with `changes` applied over `base`. If both
+  ## are registered (have ids), the result is memoized, so merging the
+  ## same pair again hands back the same style object. That means the
+  ## result has to be treated as read-only; use `copyStyle()` if you
+  ## want to change it.
+  ##
+  ## If you change either input in place, call
+  ## `invalidateRenderCaches()` afterward, which also empties the
+  ## memo. Don't do that while another thread is rendering.
+  let
+    baseId   = atomicLoadN(addr base.registeredId, ATOMIC_ACQUIRE)
+    changeId = atomicLoadN(addr changes.registeredId, ATOMIC_ACQUIRE)
+
+  if baseId == 0 or changeId == 0 or
+     style_memo_ready(int64(getRenderGeneration())) == 0:
+    return base.mergeStylesNoMemo(changes)
+
+  let merged = style_memo_get(baseId, changeId)
+  if merged != 0:
+    return merged.idToStyle()
+
+  result = base.mergeStylesNoMemo(changes)
+  style_memo_put(baseId, changeId, result.getStyleId())
+
 template setDefaultStyle*(style: FmtStyle) =
   defaultStyle = style
+  invalidateRenderCaches()
 
 type StyleType = enum StyleTypeTag, StyleTypeClass, StyleTypeId
 
@@ -288,3 +468,12 @@ proc setStyle*(reference: string, style: FmtStyle, kind = StyleTypeTag) =
   of StyleTypeTag:   styleMap[reference]       = style
   of StyleTypeClass: perClassStyles[reference] = style
   of StyleTypeId:    perIdStyles[reference]    = style
+
+  discard style.getStyleId()
+  invalidateRenderCaches()
+
+# The built-in styles get merged all the time, so register them up
+# front; that lets those merges be memoized.
+discard defaultStyle.getStyleId()
+for style in styleMap.values():
+  discard style.getStyleId()
@@ -194,6 +194,13 @@ subproc_set_io_callback(subprocess_t *ctx, unsigned char which,
 void
 subproc_set_timeout(subprocess_t *ctx, struct timeval *timeout)
 {
+    if (timeout) {
+	ctx->user_timeout_set = true;
+	memcpy(&ctx->user_timeout, timeout, sizeof(struct timeval));
+    }
+    else {
+	ctx->user_timeout_set = false;
+    }
     sb_set_io_timeout(&ctx->sb, timeout);
 }
 
@@ -203,6 +210,7 @@ subproc_set_timeout(subprocess_t *ctx, struct timeval *timeout)
 void
 subproc_clear_timeout(subprocess_t *ctx)
 {
+    ctx->user_timeout_set = false;
     sb_clear_io_timeout(&ctx->sb);
 }
 
@@ -220,6 +228,268 @@ subproc_use_pty(subprocess_t *ctx)
     return true;
 }
 
+/*
+ * When called before subproc_run(), the child will call setpgid()
+ * before exec, so that it (and anything it spawns that doesn't move
+ * itself) can be signaled as a unit. See `subproc_kill_tree()`.
+ *
+ * Processes on a pty are always session leaders, so this is implied
+ * there.
+ */
+bool
+subproc_set_new_pgroup(subprocess_t *ctx, bool value)
+{
+    if (ctx->run) {
+	return false;
+    }
+    ctx->new_pgroup = value;
+    return true;
+}
+
+/*
+ * Like `subproc_set_new_pgroup()`, but the child calls setsid(),
+ * which also detaches it from our controlling terminal.
+ */
+bool
+subproc_set_new_session(subprocess_t *ctx, bool value)
+{
+    if (ctx->run) {
+	return false;
+    }
+    ctx->new_session = value;
+    return true;
+}
+
+/*
+ * Sets a wall-clock limit for the child, measured from when it's
+ * spawned. When it passes, the child's process tree gets SIGKILL,
+ * and `subproc_timed_out()` will return true.
+ *
+ * Any select() timeout from `subproc_set_timeout()` still applies,
+ * but it gets shortened when the deadline is closer than that.
+ *
+ * Pass NULL to remove a deadline.
+ */
+bool
+subproc_set_deadline(subprocess_t *ctx, struct timeval *len)
+{
+    if (ctx->run) {
+	return false;
+    }
+    if (len) {
+	ctx->deadline_set = true;
+	memcpy(&ctx->deadline_len, len, sizeof(struct timeval));
+    }
+    else {
+	ctx->deadline_set = false;
+    }
+    return true;
+}
+
+/*
+ * The next three calls set resource limits that the child applies to
+ * itself via setrlimit() right before exec. Zero means no limit gets
+ * set. Limits can't be raised above the hard limit the parent is
+ * running under; asking for more silently caps at that limit.
+ *
+ * The CPU limit is in seconds. The child gets SIGXCPU when it hits
+ * the limit, and SIGKILL a second later.
+ */
+bool
+subproc_set_cpu_limit(subprocess_t *ctx, rlim_t seconds)
+{
+    if (ctx->run) {
+	return false;
+    }
+    ctx->cpu_limit = seconds;
+    return true;
+}
+
+/*
+ * Caps the child's address space, in bytes (RLIMIT_AS).
+ */
+bool
+subproc_set_memory_limit(subprocess_t *ctx, rlim_t bytes)
+{
+    if (ctx->run) {
+	return false;
+    }
+    ctx->memory_limit = bytes;
+    return true;
+}
+
+/*
+ * Caps the number of file descriptors the child can have open
+ * (RLIMIT_NOFILE).
+ */
+bool
+subproc_set_fd_limit(subprocess_t *ctx, rlim_t fds)
+{
+    if (ctx->run) {
+	return false;
+    }
+    ctx->fd_limit = fds;
+    return true;
+}
+
+/*
+ * Returns true if the child got killed because its deadline passed.
+ */
+bool
+subproc_timed_out(subprocess_t *ctx)
+{
+    return ctx->timed_out;
+}
+
+static inline bool
+subproc_owns_pgroup(subprocess_t *ctx)
+{
+    return ctx->use_pty || ctx->new_pgroup || ctx->new_session;
+}
+
+/*
+ * Sends a signal to the child. If the child leads its own process
+ * group, the whole group gets it, which includes any grandchildren
+ * that haven't moved themselves elsewhere.
+ */
+void
+subproc_kill_tree(subprocess_t *ctx, int signal)
+{
+    monitor_t *subproc = ctx->sb.pid_watch_list;
+
+    if (!subproc || subproc->pid <= 0) {
+	return;
+    }
+
+    if (subproc_owns_pgroup(ctx)) {
+	// The group can outlive its leader, so this is fine to send even
+	// if we've already reaped the child. If it fails, the child may
+	// not have gotten around to setsid() yet.
+	if (kill(-subproc->pid, signal) == 0) {
+	    return;
+	}
+    }
+
+    if (!subproc->closed) {
+	kill(subproc->pid, signal);
+    }
+}
+
+static void
+subproc_set_one_limit(int resource, rlim_t value, rlim_t extra_hard)
+{
+    struct rlimit cur;
+
+    if (!value || getrlimit(resource, &cur) != 0) {
+	return;
+    }
+
+    if (cur.rlim_max != RLIM_INFINITY && value > cur.rlim_max) {
+	value = cur.rlim_max;
+    }
+
+    cur.rlim_cur = value;
+
+    if (cur.rlim_max == RLIM_INFINITY || value + extra_hard < cur.rlim_max) {
+	cur.rlim_max = value + extra_hard;
+    }
+
+    setrlimit(resource, &cur);
+}
+
+/*
+ * Runs in the child, between fork and exec.
+ */
+static void
+subproc_child_setup(subprocess_t *ctx)
+{
+    if (!ctx->use_pty) {
+	if (ctx->new_session) {
+	    setsid();
+	}
+	else if (ctx->new_pgroup) {
+	    setpgid(0, 0);
+	}
+    }
+
+    subproc_set_one_limit(RLIMIT_CPU,    ctx->cpu_limit,    1);
+    subproc_set_one_limit(RLIMIT_AS,     ctx->memory_limit, 0);
+    subproc_set_one_limit(RLIMIT_NOFILE, ctx->fd_limit,     0);
+}
+
+static void
+subproc_start_deadline(subprocess_t *ctx)
+{
+    if (!ctx->deadline_set) {
+	return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ctx->deadline);
+
+    ctx->deadline.tv_sec  += ctx->deadline_len.tv_sec;
+    ctx->deadline.tv_nsec += ctx->deadline_len.tv_usec * 1000;
+
+    if (ctx->deadline.tv_nsec >= 1000000000) {
+	ctx->deadline.tv_sec  += 1;
+	ctx->deadline.tv_nsec -= 1000000000;
+    }
+}
+
+/*
+ * Called before each trip through the switchboard when there's a
+ * deadline. If it's passed, we kill the process tree, then give the
+ * switchboard a short grace period to drain whatever's left in the
+ * pipes. If the pipes are still open after that (e.g., something
+ * escaped the process group), we tell the switchboard to stop.
+ *
+ * Otherwise, we make sure select() won't sleep past the deadline.
+ */
+static void
+subproc_check_deadline(subprocess_t *ctx)
+{
+    struct timespec now;
+    struct timeval  left;
+    int64_t         usec;
+
+    if (!ctx->deadline_set || ctx->sb.done) {
+	return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    usec = (int64_t)(ctx->deadline.tv_sec - now.tv_sec) * 1000000 +
+	(ctx->deadline.tv_nsec - now.tv_nsec) / 1000;
+
+    if (usec <= 0) {
+	if (ctx->deadline_fired) {
+	    ctx->sb.done = true;
+	    return;
+	}
+
+	ctx->deadline_fired = true;
+	ctx->timed_out      = true;
+	subproc_kill_tree(ctx, SIGKILL);
+
+	ctx->deadline.tv_sec  = now.tv_sec;
+	ctx->deadline.tv_nsec = now.tv_nsec + SP_DEADLINE_GRACE_USEC * 1000;
+	if (ctx->deadline.tv_nsec >= 1000000000) {
+	    ctx->deadline.tv_sec  += 1;
+	    ctx->deadline.tv_nsec -= 1000000000;
+	}
+	usec = SP_DEADLINE_GRACE_USEC;
+    }
+
+    left.tv_sec  = usec / 1000000;
+    left.tv_usec = usec % 1000000;
+
+    if (ctx->user_timeout_set && timercmp(&ctx->user_timeout, &left, <)) {
+	sb_set_io_timeout(&ctx->sb, &ctx->user_timeout);
+    }
+    else {
+	sb_set_io_timeout(&ctx->sb, &left);
+    }
+}
+
 static void
 setup_subscriptions(subprocess_t *ctx, bool pty)
 {
@@ -299,6 +569,8 @@ setup_subscriptions(subprocess_t *ctx, bool pty)
 static void
 subproc_do_exec(subprocess_t *ctx)
 {
+    subproc_child_setup(ctx);
+
     if (ctx->envp) {
 	execve(ctx->cmd, ctx->argv, ctx->envp);
     }
@@ -319,6 +591,340 @@ subproc_new_party_callback(switchboard_t *ctx, switchboard_cb_t cb)
     return result;
 }
 
+static void
+asciicast_flush(asciicast_t *rec)
+{
+    if (rec->len) {
+	write_data(rec->fd, rec->buf, rec->len);
+	rec->len = 0;
+    }
+}
+
+static void
+asciicast_add(asciicast_t *rec, char *s, size_t len)
+{
+    if (rec->len + len > rec->cap) {
+	asciicast_flush(rec);
+
+	if (len > rec->cap) {
+	    write_data(rec->fd, s, len);
+	    return;
+	}
+    }
+    memcpy(rec->buf + rec->len, s, len);
+    rec->len += len;
+}
+
+static inline void
+asciicast_add_str(asciicast_t *rec, char *s)
+{
+    asciicast_add(rec, s, strlen(s));
+}
+
+static void
+asciicast_add_escaped_byte(asciicast_t *rec, unsigned char c)
+{
+    char tmp[8];
+
+    switch (c) {
+    case '"':
+	asciicast_add(rec, "\\\"", 2);
+	return;
+    case '\\':
+	asciicast_add(rec, "\\\\", 2);
+	return;
+    case '\n':
+	asciicast_add(rec, "\\n", 2);
+	return;
+    case '\r':
+	asciicast_add(rec, "\\r", 2);
+	return;
+    case '\t':
+	asciicast_add(rec, "\\t", 2);
+	return;
+    default:
+	if (c < 0x20 || c == 0x7f) {
+	    snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+	    asciicast_add(rec, tmp, 6);
+	}
+	else {
+	    asciicast_add(rec, (char *)&c, 1);
+	}
+    }
+}
+
+/*
+ * Returns how many bytes the UTF-8 sequence starting at `p` takes, 0
+ * if it's invalid, or -1 if it's valid so far but runs past `end`.
+ */
+static int
+asciicast_utf8_len(unsigned char *p, unsigned char *end)
+{
+    unsigned char lo = 0x80, hi = 0xbf;
+    int           n;
+
+    if (*p < 0x80) {
+	return 1;
+    }
+    if (*p < 0xc2 || *p > 0xf4) {
+	return 0;
+    }
+    if (*p < 0xe0) {
+	n = 2;
+    }
+    else if (*p < 0xf0) {
+	n = 3;
+	if (*p == 0xe0) lo = 0xa0;  // Overlong.
+	if (*p == 0xed) hi = 0x9f;  // Surrogates.
+    }
+    else {
+	n = 4;
+	if (*p == 0xf0) lo = 0x90;  // Overlong.
+	if (*p == 0xf4) hi = 0x8f;  // Past U+10FFFF.
+    }
+
+    for (int i = 1; i < n; i++) {
+	if (p + i >= end) {
+	    return -1;
+	}
+	if (p[i] < lo || p[i] > hi) {
+	    return 0;
+	}
+	lo = 0x80;
+	hi = 0xbf;
+    }
+
+    return n;
+}
+
+/*
+ * Writes one JSON string's worth of data. Output can split multi-byte
+ * characters across reads, so an incomplete sequence at the end is
+ * held in `tail` until the next chunk. Bytes that can't be valid
+ * UTF-8 become U+FFFD, since asciicast files have to be valid JSON.
+ */
+static void
+asciicast_add_json_data(asciicast_t *rec, char *tail, int *tail_len,
+			char *data, size_t len)
+{
+    unsigned char  joined[8];
+    unsigned char *p   = (unsigned char *)data;
+    unsigned char *end = p + len;
+    int            n;
+
+    // First, finish off whatever was left over.
+    while (*tail_len && p < end) {
+	int have = *tail_len;
+	int take = (end - p) < (4 - have) ? (end - p) : (4 - have);
+
+	memcpy(joined, tail, have);
+	memcpy(joined + have, p, take);
+
+	n = asciicast_utf8_len(joined, joined + have + take);
+
+	if (n == -1) {
+	    memcpy(tail + have, p, take);
+	    *tail_len += take;
+	    return;
+	}
+	if (n == 0) {
+	    asciicast_add_str(rec, "\xef\xbf\xbd");
+	    memmove(tail, tail + 1, --*tail_len);
+	    continue;
+	}
+	asciicast_add(rec, (char *)joined, n);
+	p         += n - have;
+	*tail_len  = 0;
+    }
+
+    while (p < end) {
+	n = asciicast_utf8_len(p, end);
+
+	switch (n) {
+	case -1:
+	    memcpy(tail, p, end - p);
+	    *tail_len = end - p;
+	    return;
+	case 0:
+	    asciicast_add_str(rec, "\xef\xbf\xbd");
+	    p++;
+	    break;
+	case 1:
+	    asciicast_add_escaped_byte(rec, *p++);
+	    break;
+	default:
+	    asciicast_add(rec, (char *)p, n);
+	    p += n;
+	    break;
+	}
+    }
+}
+
+static void
+asciicast_add_event(asciicast_stream_t *stream, char *data, size_t len)
+{
+    asciicast_t    *rec = stream->rec;
+    struct timespec now;
+    char            prefix[64];
+    double          elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (double)(now.tv_sec - rec->start.tv_sec) +
+	(double)(now.tv_nsec - rec->start.tv_nsec) / 1e9;
+
+    snprintf(prefix, sizeof(prefix), "[%.6f, \"%c\", \"", elapsed,
+	     stream->kind);
+    asciicast_add_str(rec, prefix);
+    asciicast_add_json_data(rec, stream->tail, &stream->tail_len, data, len);
+    asciicast_add(rec, "\"]\n", 3);
+
+    if (rec->len >= ASCIICAST_FLUSH_AT) {
+	asciicast_flush(rec);
+    }
+}
+
+// Callbacks get the switchboard's and the party's `extra` pointers;
+// the stream is the latter.
+static void
+asciicast_cb(void *sb_extra, void *stream, char *data, size_t len)
+{
+    (void)sb_extra;
+
+    asciicast_add_event(stream, data, len);
+}
+
+static void
+asciicast_add_env(asciicast_t *rec, char *name, bool *first)
+{
+    char *val = getenv(name);
+    char  tail[4];
+    int   tail_len = 0;
+
+    if (!val) {
+	return;
+    }
+
+    asciicast_add_str(rec, *first ? "\"" : ", \"");
+    asciicast_add_str(rec, name);
+    asciicast_add_str(rec, "\": \"");
+    asciicast_add_json_data(rec, tail, &tail_len, val, strlen(val));
+    asciicast_add(rec, "\"", 1);
+    *first = false;
+}
+
+static void
+asciicast_init_stream(subprocess_t *ctx, asciicast_stream_t *stream,
+		      char kind, party_t *src)
+{
+    stream->rec  = ctx->recorder;
+    stream->kind = kind;
+
+    sb_init_party_callback(&ctx->sb, &stream->party, asciicast_cb);
+    sb_set_party_extra(&stream->party, stream);
+    sb_route(&ctx->sb, src, &stream->party);
+}
+
+/*
+ * Called once the child is spawned; writes the header, starts the
+ * clock, and routes the child's output (and, if it's being passed
+ * through, the user's input) to the recorder.
+ */
+static void
+asciicast_start(subprocess_t *ctx)
+{
+    asciicast_t   *rec   = ctx->recorder;
+    struct winsize wininfo;
+    char           tmp[128];
+    bool           first = true;
+    int            cols  = 80;
+    int            rows  = 24;
+
+    if (isatty(0) && ioctl(0, TIOCGWINSZ, &wininfo) == 0 && wininfo.ws_col) {
+	cols = wininfo.ws_col;
+	rows = wininfo.ws_row;
+    }
+
+    snprintf(tmp, sizeof(tmp),
+	     "{\"version\": 2, \"width\": %d, \"height\": %d, "
+	     "\"timestamp\": %lld, \"env\": {", cols, rows,
+	     (long long)time(NULL));
+    asciicast_add_str(rec, tmp);
+    asciicast_add_env(rec, "SHELL", &first);
+    asciicast_add_env(rec, "TERM", &first);
+    asciicast_add_str(rec, "}}\n");
+
+    clock_gettime(CLOCK_MONOTONIC, &rec->start);
+
+    asciicast_init_stream(ctx, &rec->out, 'o', &ctx->subproc_stdout);
+
+    if (!ctx->use_pty) {
+	asciicast_init_stream(ctx, &rec->err, 'o', &ctx->subproc_stderr);
+    }
+
+    if (rec->record_input && (ctx->passthrough & SP_IO_STDIN)) {
+	asciicast_init_stream(ctx, &rec->in, 'i', &ctx->parent_stdin);
+    }
+}
+
+static void
+asciicast_finish(subprocess_t *ctx)
+{
+    asciicast_t *rec = ctx->recorder;
+
+    if (!rec || rec->fd == -1) {
+	return;
+    }
+
+    // Anything still held back was a truncated character at the end.
+    asciicast_stream_t *streams[] = { &rec->out, &rec->err, &rec->in };
+
+    for (int i = 0; i < 3; i++) {
+	if (streams[i]->tail_len) {
+	    streams[i]->tail_len = 0;
+	    asciicast_add_event(streams[i], "\xef\xbf\xbd", 3);
+	}
+    }
+    asciicast_flush(rec);
+    close(rec->fd);
+    rec->fd = -1;
+}
+
+/*
+ * Records the session to `path` as an asciicast v2 file, which can be
+ * played back with `asciinema play`, or our own replay code. This is
+ * most useful with a pty, but works either way; without one, stdout
+ * and stderr are both recorded as output.
+ *
+ * If `record_input` is true and stdin is being passed through to the
+ * child, what the user types gets recorded as "i" events.
+ *
+ * The file is opened (and truncated) right away; returns false if
+ * that fails, or if the process has already started.
+ */
+bool
+subproc_record_asciicast(subprocess_t *ctx, char *path, bool record_input)
+{
+    int fd;
+
+    if (ctx->run || ctx->recorder) {
+	return false;
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd == -1) {
+	return false;
+    }
+
+    ctx->recorder               = calloc(sizeof(asciicast_t), 1);
+    ctx->recorder->fd           = fd;
+    ctx->recorder->record_input = record_input;
+    ctx->recorder->cap          = ASCIICAST_FLUSH_AT * 2;
+    ctx->recorder->buf          = malloc(ctx->recorder->cap);
+
+    return true;
+}
+
 
 static void
 subproc_install_callbacks(subprocess_t *ctx)
@@ -338,6 +944,10 @@ subproc_install_callbacks(subprocess_t *ctx)
 	}
 	entry = entry->next;
     }
+
+    if (ctx->recorder) {
+	asciicast_start(ctx);
+    }
 }
 
 static void
@@ -355,6 +965,12 @@ subproc_spawn_fork(subprocess_t *ctx)
     pid = fork();
 
     if (pid != 0) {
+	// Also done in the child; whichever runs first wins, and we
+	// don't want to race a deadline kill.
+	if (ctx->new_pgroup && !ctx->new_session) {
+	    setpgid(pid, pid);
+	}
+
 	close(stdin_pipe[0]);
 	close(stdout_pipe[1]);
 	close(stderr_pipe[1]);
@@ -437,11 +1053,13 @@ subproc_spawn_forkpty(subprocess_t *ctx)
 	subproc_install_callbacks(ctx);
 	setup_subscriptions(ctx, true);
 	
-	tcgetattr(0, &ctx->saved_termcap);
-	termcap.c_lflag &= ~(ECHO|ICANON);
-	termcap.c_cc[VMIN]  = 0;
-	termcap.c_cc[VTIME] = 0;
-	tcsetattr(0, TCSANOW, term_ptr);
+	if (term_ptr) {
+	    tcgetattr(0, &ctx->saved_termcap);
+	    termcap.c_lflag &= ~(ECHO|ICANON);
+	    termcap.c_cc[VMIN]  = 0;
+	    termcap.c_cc[VTIME] = 0;
+	    tcsetattr(0, TCSANOW, term_ptr);
+	}
 	int flags = fcntl(pty_fd, F_GETFL, 0) | O_NONBLOCK;
 	fcntl(pty_fd, F_SETFL, flags);
 	
@@ -451,12 +1069,14 @@ subproc_spawn_forkpty(subprocess_t *ctx)
 	    dup2(stdin_pipe[0], 0);
 	}
 	
-	termcap.c_lflag &= ~(ICANON | ISIG | IEXTEN);
-	termcap.c_oflag &= ~OPOST;
-	termcap.c_cc[VMIN]  = 0;
-	termcap.c_cc[VTIME] = 0;
+	if (term_ptr) {
+	    termcap.c_lflag &= ~(ICANON | ISIG | IEXTEN);
+	    termcap.c_oflag &= ~OPOST;
+	    termcap.c_cc[VMIN]  = 0;
+	    termcap.c_cc[VTIME] = 0;
 
-	tcsetattr(pty_fd, TCSANOW, term_ptr);
+	    tcsetattr(pty_fd, TCSANOW, term_ptr);
+	}
 	subproc_do_exec(ctx);
     }
 }
@@ -501,6 +1121,8 @@ subproc_start(subprocess_t *ctx)
     else {
 	subproc_spawn_fork(ctx);
     }
+
+    subproc_start_deadline(ctx);
 }
 
 /*
@@ -511,9 +1133,40 @@ subproc_start(subprocess_t *ctx)
 bool
 subproc_poll(subprocess_t *ctx)
 {
+    subproc_check_deadline(ctx);
     return sb_operate_switchboard(&ctx->sb, false);
 }
 
+/*
+ * For callers running their own event loop: keeps `poll_fd` (from
+ * `sb_new_poll_fd()`) in sync with what the subprocess is waiting
+ * on. See `sb_sync_poll_fd()` for the return value. Set a zero
+ * timeout, and call `subproc_poll()` each time `poll_fd` is ready;
+ * also call it periodically if you set a deadline.
+ */
+int
+subproc_sync_poll_fd(subprocess_t *ctx, int poll_fd)
+{
+    return sb_sync_poll_fd(&ctx->sb, poll_fd);
+}
+
+/*
+ * Checks whether the child has exited, without blocking. If it has,
+ * it gets reaped, and the subproc_get_*() calls will have its status.
+ */
+bool
+subproc_check_exited(subprocess_t *ctx)
+{
+    monitor_t *subproc = ctx->sb.pid_watch_list;
+
+    if (!subproc) {
+	return true;
+    }
+
+    process_status_check(subproc, false);
+    return subproc->closed;
+}
+
 /*
  * Call this before querying any results.
  */
@@ -521,6 +1174,7 @@ void
 subproc_prepare_results(subprocess_t *ctx)
 {
     sb_prepare_results(&ctx->sb);    
+    asciicast_finish(ctx);
 
     // Post-run cleanup.
     if (ctx->use_pty) {
@@ -539,7 +1193,13 @@ void
 subproc_run(subprocess_t *ctx)
 {
     subproc_start(ctx);
-    sb_operate_switchboard(&ctx->sb, true);
+
+    if (ctx->deadline_set) {
+	while (!subproc_poll(ctx));
+    }
+    else {
+	sb_operate_switchboard(&ctx->sb, true);
+    }
 
     subproc_prepare_results(ctx);
 }
@@ -557,8 +1217,27 @@ subproc_run(subprocess_t *ctx)
 void
 subproc_close(subprocess_t *ctx)
 {
+    // If we put the child in its own group, take down anything it
+    // left running, and make sure the leader doesn't stay a zombie.
+    if (ctx->new_pgroup || ctx->new_session) {
+	monitor_t *subproc = ctx->sb.pid_watch_list;
+
+	subproc_kill_tree(ctx, SIGKILL);
+
+	if (subproc && !subproc->closed) {
+	    process_status_check(subproc, true);
+	}
+    }
+
     sb_destroy(&ctx->sb, false);
 
+    if (ctx->recorder) {
+	asciicast_finish(ctx);
+	free(ctx->recorder->buf);
+	free(ctx->recorder);
+	ctx->recorder = NULL;
+    }
+
     deferred_cb_t *cbs = ctx->deferred_cbs;
     deferred_cb_t *next;
 
@@ -670,6 +1349,405 @@ subproc_get_pty_fd(subprocess_t *ctx)
     return ctx->pty_fd;
 }
 
+/*
+ * Starts a long-lived shell on a pty, for running a series of
+ * commands without paying for a new pty (and terminal mode changes)
+ * each time. `shell` and `argv` work like they do for
+ * `subproc_init()`; if `shell` is NULL, we use /bin/sh. If `envp` is
+ * NULL, the environment is inherited.
+ *
+ * The child turns off echo and output processing on its side of the
+ * pty, so what we read back is only what commands write. The parent's
+ * terminal is left alone unless `raw_parent` is true. In that case
+ * it goes into the usual non-canonical mode once, here, and gets
+ * restored by `pty_session_close()`. You'll want that if commands
+ * need to interact with the user.
+ *
+ * Returns false if the shell couldn't be started.
+ */
+bool
+pty_session_open(pty_session_t *s, char *shell, char *argv[], char *envp[],
+		 bool raw_parent)
+{
+    struct winsize  wininfo;
+    struct winsize *win_ptr = NULL;
+    char           *fallback[2];
+    pid_t           pid;
+    int             pty_fd;
+    char           *init = "PS1=''; PS2=''; PROMPT_COMMAND=''; "
+	                   "stty -echo -onlcr 2>/dev/null; "
+	                   "(set +o emacs +o vi) 2>/dev/null && "
+	                   "set +o emacs +o vi\n";
+
+    memset(s, 0, sizeof(pty_session_t));
+
+    if (!shell) {
+	shell = "/bin/sh";
+    }
+    if (!argv) {
+	fallback[0] = shell;
+	fallback[1] = NULL;
+	argv        = fallback;
+    }
+
+    if (isatty(0)) {
+	ioctl(0, TIOCGWINSZ, &wininfo);
+	win_ptr = &wininfo;
+    }
+
+    pid = forkpty(&pty_fd, NULL, NULL, win_ptr);
+
+    if (pid < 0) {
+	return false;
+    }
+
+    if (pid == 0) {
+	struct termios termcap;
+
+	tcgetattr(0, &termcap);
+	termcap.c_lflag &= ~(ECHO | ECHONL);
+	termcap.c_oflag &= ~OPOST;
+	tcsetattr(0, TCSANOW, &termcap);
+
+	if (envp) {
+	    execve(shell, argv, envp);
+	}
+	else {
+	    execv(shell, argv);
+	}
+	abort();
+    }
+
+    s->pid    = pid;
+    s->pty_fd = pty_fd;
+    s->open   = true;
+
+    fcntl(pty_fd, F_SETFL, fcntl(pty_fd, F_GETFL, 0) | O_NONBLOCK);
+
+    if (raw_parent && isatty(0)) {
+	tcgetattr(0, &s->saved_termcap);
+	termcap_set_typical_parent();
+	s->raw_parent = true;
+    }
+
+    // Get rid of prompts and line editing, so the shell's output is
+    // only what commands write. This goes on a line of its own, not
+    // through pty_session_run(), since bash drops whatever is left of
+    // the line once editing gets turned off. Anything it prints shows
+    // up before the first sentinel, and gets discarded.
+    if (!write_data(pty_fd, init, strlen(init))) {
+	s->open = false;
+	close(pty_fd);
+	waitpid(pid, NULL, 0);
+	return false;
+    }
+
+    return pty_session_run(s, ":", 1, NULL, false);
+}
+
+static void
+pty_session_append(pty_session_t *s, char *data, size_t len)
+{
+    if (s->len + len + 1 > s->cap) {
+	s->cap = (s->len + len + 1) * 2;
+	s->buf = realloc(s->buf, s->cap);
+    }
+    memcpy(s->buf + s->len, data, len);
+    s->len += len;
+    s->buf[s->len] = 0;
+}
+
+/*
+ * Looks for our sentinel in the output we haven't ruled out yet,
+ * starting at `*scanned`. On a match, truncates the output at the
+ * sentinel, records the status, and returns true. Otherwise, advances
+ * `*scanned` past anything that can't be the start of the sentinel.
+ */
+static bool
+pty_session_find_end(pty_session_t *s, char *tag, size_t *scanned)
+{
+    size_t taglen = strlen(tag);
+
+    while (*scanned < s->len) {
+	char   *p     = memchr(s->buf + *scanned, PTY_SENTINEL,
+			       s->len - *scanned);
+	size_t  at;
+	size_t  avail;
+	char   *end;
+
+	if (!p) {
+	    *scanned = s->len;
+	    return false;
+	}
+
+	at    = p - s->buf;
+	avail = s->len - at;
+
+	if (avail < taglen) {
+	    if (!memcmp(p, tag, avail)) {
+		*scanned = at; // Could be ours; wait for more.
+		return false;
+	    }
+	    *scanned = at + 1;
+	    continue;
+	}
+
+	if (memcmp(p, tag, taglen)) {
+	    *scanned = at + 1;
+	    continue;
+	}
+
+	end = memchr(p + taglen, PTY_SENTINEL, avail - taglen);
+
+	if (!end) {
+	    *scanned = at;
+	    return false;
+	}
+
+	s->last_status = atoi(p + taglen);
+	s->len         = at;
+	s->buf[at]     = 0;
+	*scanned       = at;
+
+	return true;
+    }
+
+    return false;
+}
+
+/*
+ * Sends `cmd` to the shell as a single-quoted argument to `command
+ * eval`, followed by `trailer`, all on one line. Since the quoting
+ * always gets closed, the shell can't be left waiting for more input.
+ * If the command doesn't parse, eval fails and the status says so;
+ * `command` keeps the shell from dropping the rest of the line when
+ * that happens. And since the trailer is on the same line, a command
+ * that reads stdin can't read it instead.
+ *
+ * Unless `with_stdin` is true, the command's stdin is /dev/null, so
+ * one that reads input gets EOF instead of waiting for input nobody
+ * is going to send.
+ */
+static bool
+pty_session_send(pty_session_t *s, char *cmd, size_t len, bool with_stdin,
+		 char *trailer)
+{
+    char *p;
+
+    if (!write_data(s->pty_fd, "command eval '", 14)) {
+	return false;
+    }
+
+    while ((p = memchr(cmd, '\'', len)) != NULL) {
+	size_t n = p - cmd;
+
+	if (!write_data(s->pty_fd, cmd, n) ||
+	    !write_data(s->pty_fd, "'\\''", 4)) {
+	    return false;
+	}
+	cmd += n + 1;
+	len -= n + 1;
+    }
+
+    if (!write_data(s->pty_fd, cmd, len) || !write_data(s->pty_fd, "'", 1)) {
+	return false;
+    }
+    if (!with_stdin && !write_data(s->pty_fd, " </dev/null", 11)) {
+	return false;
+    }
+
+    return write_data(s->pty_fd, trailer, strlen(trailer));
+}
+
+static void
+pty_session_died(pty_session_t *s)
+{
+    s->open = false;
+    close(s->pty_fd);
+    waitpid(s->pid, NULL, 0);
+}
+
+/*
+ * Runs `cmd` through the session's shell, and waits for it to
+ * finish. The command gets passed to `eval`, so it can contain
+ * multiple lines, and one that doesn't parse fails with a non-zero
+ * status instead of leaving the shell waiting for the rest of it.
+ * Note though that the pty is in canonical mode, so each line is
+ * limited to the terminal's MAX_CANON.
+ *
+ * If `passthrough` is true, output gets written to our stdout as it
+ * arrives. If the session was opened with `raw_parent`, what the user
+ * types is also proxied to the command. Otherwise, the command's
+ * stdin is /dev/null.
+ *
+ * Returns true when the command completes, at which point the output
+ * and exit status are available via `pty_session_output()` and
+ * `pty_session_status()`.
+ *
+ * Returns false if the shell went away, or if `timeout` passed. With
+ * no timeout, this waits for as long as the command runs, including
+ * forever if it's waiting on input that's proxied from the user. When a timeout
+ * does pass, we send the pty an interrupt character and leave the
+ * session open; anything the interrupted command writes after that
+ * may show up at the start of the next command's output.
+ */
+bool
+pty_session_run(pty_session_t *s, char *cmd, size_t len,
+		struct timeval *timeout, bool passthrough)
+{
+    char            tag[64];
+    char            trailer[128];
+    char            readbuf[PIPE_BUF];
+    struct timespec deadline;
+    struct timespec now;
+    struct timeval  wait;
+    struct timeval *wait_ptr = NULL;
+    fd_set          readset;
+    size_t          scanned  = 0;
+    size_t          written  = 0;
+    bool            proxy_in = passthrough && s->raw_parent;
+    bool            done;
+
+    if (!s->open) {
+	return false;
+    }
+
+    s->len = 0;
+    s->token++;
+
+    snprintf(tag, sizeof(tag), "%c" PTY_SENTINEL_TAG "%lu:", PTY_SENTINEL,
+	     s->token);
+    snprintf(trailer, sizeof(trailer),
+	     "; printf '\\036" PTY_SENTINEL_TAG "%lu:%%d\\036' \"$?\"\n",
+	     s->token);
+
+    if (timeout) {
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec  += timeout->tv_sec;
+	deadline.tv_nsec += timeout->tv_usec * 1000;
+	if (deadline.tv_nsec >= 1000000000) {
+	    deadline.tv_sec  += 1;
+	    deadline.tv_nsec -= 1000000000;
+	}
+	wait_ptr = &wait;
+    }
+
+    if (!pty_session_send(s, cmd, len, proxy_in, trailer)) {
+	pty_session_died(s);
+	return false;
+    }
+
+    while (true) {
+	if (timeout) {
+	    int64_t usec;
+
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    usec = (int64_t)(deadline.tv_sec - now.tv_sec) * 1000000 +
+		(deadline.tv_nsec - now.tv_nsec) / 1000;
+
+	    if (usec <= 0) {
+		char intr = 3;
+		write_data(s->pty_fd, &intr, 1);
+		return false;
+	    }
+	    wait.tv_sec  = usec / 1000000;
+	    wait.tv_usec = usec % 1000000;
+	}
+
+	FD_ZERO(&readset);
+	FD_SET(s->pty_fd, &readset);
+	if (proxy_in) {
+	    FD_SET(0, &readset);
+	}
+
+	if (select(s->pty_fd + 1, &readset, NULL, NULL, wait_ptr) < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    return false;
+	}
+
+	if (proxy_in && FD_ISSET(0, &readset)) {
+	    ssize_t n = read(0, readbuf, sizeof(readbuf));
+	    if (n > 0) {
+		write_data(s->pty_fd, readbuf, n);
+	    }
+	}
+
+	if (!FD_ISSET(s->pty_fd, &readset)) {
+	    continue;
+	}
+
+	ssize_t n = read(s->pty_fd, readbuf, sizeof(readbuf));
+
+	if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+	    continue;
+	}
+	if (n <= 0) {
+	    // On Linux, a pty whose child has exited reads as EIO.
+	    pty_session_died(s);
+	    return false;
+	}
+
+	pty_session_append(s, readbuf, n);
+	done = pty_session_find_end(s, tag, &scanned);
+
+	if (passthrough && scanned > written) {
+	    write_data(1, s->buf + written, scanned - written);
+	    written = scanned;
+	}
+
+	if (done) {
+	    return true;
+	}
+    }
+}
+
+/*
+ * Output from the most recent command. This memory is owned by the
+ * session, and is valid until the next command runs, or the session
+ * is closed.
+ */
+char *
+pty_session_output(pty_session_t *s, size_t *outlen)
+{
+    *outlen = s->len;
+    return s->buf;
+}
+
+/*
+ * Exit status of the most recent command.
+ */
+int
+pty_session_status(pty_session_t *s)
+{
+    return s->last_status;
+}
+
+/*
+ * Shuts down the shell, frees the output buffer, and restores the
+ * parent's terminal if we changed it.
+ */
+void
+pty_session_close(pty_session_t *s)
+{
+    if (s->open) {
+	write_data(s->pty_fd, "exit\n", 5);
+	kill(s->pid, SIGHUP);
+	pty_session_died(s);
+    }
+
+    if (s->raw_parent) {
+	tcsetattr(0, TCSANOW, &s->saved_termcap);
+	s->raw_parent = false;
+    }
+
+    free(s->buf);
+    s->buf = NULL;
+    s->len = 0;
+    s->cap = 0;
+}
+
 #ifdef SB_TEST
 void
 capture_tty_data(switchboard_t *sb, party_t *party, char *data, size_t len)
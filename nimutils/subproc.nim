@@ -1,4 +1,4 @@
-import switchboard, posix, random, os, file
+import switchboard, posix, random, os, file, json, monotimes
 
 {.warning[UnusedImport]: off.}
 {.compile: joinPath(splitPath(currentSourcePath()).head, "subproc.c").}
@@ -15,6 +15,9 @@ type
   SPResultObj* {. importc: "sb_result_t", header: joinPath(splitPath(currentSourcePath()).head, "switchboard.h") .} = object
   SPResult* = ptr SPResultObj
   SubProcess*  {.importc: "subprocess_t", header: joinPath(splitPath(currentSourcePath()).head, "switchboard.h") .} = object
+  PtySession*  {.importc: "pty_session_t", header: joinPath(splitPath(currentSourcePath()).head, "switchboard.h") .} = object
+    pid*:  Pid
+    open*: bool
 
 proc termcap_get*(termcap: var Termcap) {.sproc.}
 proc termcap_set*(termcap: var Termcap) {.sproc.}
@@ -31,6 +34,14 @@ proc subproc_get_capture(ctx: var SubProcess, tag: cstring, ln: ptr cint):
 proc subproc_get_exit(ctx: var SubProcess, wait: bool): cint {.sproc.}
 proc subproc_get_errno(ctx: var SubProcess, wait: bool): cint {.sproc.}
 proc subproc_get_signal(ctx: var SubProcess, wait: bool): cint {.sproc.}
+proc pty_session_open(s: var PtySession, shell: cstring, argv: cStringArray,
+                      envp: cStringArray, rawParent: bool): bool {.sproc.}
+proc pty_session_run(s: var PtySession, cmd: cstring, l: csize_t,
+                     timeout: ptr Timeval, passthrough: bool): bool {.sproc.}
+proc pty_session_output(s: var PtySession, l: ptr csize_t): cstring {.sproc.}
+proc pty_session_status(s: var PtySession): cint {.sproc.}
+proc subproc_record_asciicast(ctx: var SubProcess, path: cstring,
+                              recordInput: bool): bool {.sproc.}
 
 # Functions we can call directly w/o a nim proxy.
 proc setPassthroughRaw*(ctx: var SubProcess, which: SPIoKind, combine: bool)
@@ -48,6 +59,22 @@ proc setTimeout*(ctx: var SubProcess, value: var Timeval)
 proc clearTimeout*(ctx: var SubProcess)
     {.cdecl, importc: "subproc_clear_timeout", nodecl.}
 proc usePty*(ctx: var SubProcess) {.cdecl, importc: "subproc_use_pty", nodecl.}
+proc useProcessGroup*(ctx: var SubProcess, enabled = true): bool
+    {.cdecl, importc: "subproc_set_new_pgroup", nodecl, discardable.}
+proc useSession*(ctx: var SubProcess, enabled = true): bool
+    {.cdecl, importc: "subproc_set_new_session", nodecl, discardable.}
+proc setDeadline*(ctx: var SubProcess, value: var Timeval): bool
+    {.cdecl, importc: "subproc_set_deadline", nodecl, discardable.}
+proc setCpuLimit*(ctx: var SubProcess, seconds: uint64): bool
+    {.cdecl, importc: "subproc_set_cpu_limit", nodecl, discardable.}
+proc setMemoryLimit*(ctx: var SubProcess, bytes: uint64): bool
+    {.cdecl, importc: "subproc_set_memory_limit", nodecl, discardable.}
+proc setFdLimit*(ctx: var SubProcess, fds: uint64): bool
+    {.cdecl, importc: "subproc_set_fd_limit", nodecl, discardable.}
+proc timedOut*(ctx: var SubProcess): bool
+    {.cdecl, importc: "subproc_timed_out", nodecl.}
+proc killTree*(ctx: var SubProcess, signal: cint = SIGKILL)
+    {.cdecl, importc: "subproc_kill_tree", nodecl.}
 proc getPtyFd*(ctx: var SubProcess): cint
     {.cdecl, importc: "subproc_get_pty_fd", nodecl.}
 proc start*(ctx: var SubProcess) {.cdecl, importc: "subproc_start", nodecl.}
@@ -57,6 +84,10 @@ proc run*(ctx: var SubProcess)  {.cdecl, importc: "subproc_run", nodecl.}
 proc close*(ctx: var SubProcess) {.cdecl, importc: "subproc_close", nodecl.}
 proc getPid*(ctx: var SubProcess): Pid
     {.cdecl, importc: "subproc_get_pid", nodecl.}
+proc syncPollFd*(ctx: var SubProcess, pollFd: cint): cint
+    {.cdecl, importc: "subproc_sync_poll_fd", nodecl.}
+proc hasExited*(ctx: var SubProcess): bool
+    {.cdecl, importc: "subproc_check_exited", nodecl.}
 proc setExtra*(ctx: var SubProcess, p: pointer)
     {.cdecl, importc: "subproc_set_extra", nodecl.}
 proc getExtra*(ctx: var SubProcess): pointer
@@ -66,6 +97,7 @@ proc setIoCallback*(ctx: var SubProcess, which: SpIoKind,
     {.cdecl, importc: "subproc_set_io_callback", nodecl, discardable.}
 proc rawFdWrite*(fd: cint, buf: pointer, l: csize_t)
     {.cdecl, importc: "write_data", nodecl.}
+proc close*(s: var PtySession) {.cdecl, importc: "pty_session_close", nodecl.}
 
 
 proc binaryCstringToString*(s: cstring, l: int): string =
@@ -87,6 +119,17 @@ proc setEnv*(ctx: var SubProcess, env: openarray[string]) =
 proc pipeToStdin*(ctx: var SubProcess, s: string, close_fd: bool): bool =
   return ctx.subproc_pass_to_stdin(cstring(s), csize_t(s.len()), close_fd)
 
+proc recordTo*(ctx: var SubProcess, path: string, recordInput = false):
+             bool {.discardable.} =
+  ## Records the session to `path` as an asciicast v2 file, which you
+  ## can play back with `replayAsciicast()` (or asciinema). Events are
+  ## streamed to disk as they happen. If `recordInput` is true and
+  ## stdin is passed through, keystrokes are recorded too.
+  ##
+  ## Returns false if the file can't be opened, or the process has
+  ## already started.
+  return ctx.subproc_record_asciicast(cstring(path), recordInput)
+
 template getTaggedValue*(ctx: var SubProcess, tag: static[cstring]): string =
   var
     outlen: cint
@@ -122,22 +165,30 @@ type ExecOutput* = ref object
     stderr*:   string
     exitCode*: int
     pid*:      Pid
-
-proc runCommand*(exe:  string,
-                 args: seq[string],
-                 newStdin                = "",
-                 closeStdIn              = false,
-                 pty                     = false,
-                 passthrough             = SpIoNone,
-                 passStderrToStdin       = false,
-                 capture                 = SpIoOutErr,
-                 combineCapture          = false,
-                 timeoutUsec             = 1000,
-                 env:  openarray[string] = [],
-                 waitForExit             = true): ExecOutput =
-  ## One-shot interface
+    timedOut*: bool
+
+proc initCommand*(subproc: var SubProcess,
+                  exe:  string,
+                  args: seq[string],
+                  newStdin                = "",
+                  closeStdIn              = false,
+                  pty                     = false,
+                  passthrough             = SpIoNone,
+                  passStderrToStdin       = false,
+                  capture                 = SpIoOutErr,
+                  combineCapture          = false,
+                  timeoutUsec             = 1000,
+                  env:  openarray[string] = [],
+                  newProcessGroup         = false,
+                  deadlineUsec            = 0,
+                  cpuLimitSec             = 0,
+                  memoryLimit             = 0,
+                  fdLimit                 = 0,
+                  recordTo                = "") =
+  ## Sets up a subprocess the way `runCommand()` does, without
+  ## starting it. `newStdin` isn't copied, so it needs to stay alive
+  ## until the process is done.
   var
-    subproc: SubProcess
     timeout: Timeval
     binloc:  string
     binlocs = exe.findAllExePaths()
@@ -147,7 +198,7 @@ proc runCommand*(exe:  string,
   else:
     binloc = binlocs[0]
 
-  timeout.tv_sec  = Time(timeoutUsec / 1000000)
+  timeout.tv_sec  = Time(timeoutUsec div 1000000)
   timeout.tv_usec = Suseconds(timeoutUsec mod 1000000)
 
   subproc.initSubprocess(binloc, @[exe] & args)
@@ -162,16 +213,80 @@ proc runCommand*(exe:  string,
   if capture != SpIoNone:
     subproc.setCapture(capture, combineCapture)
 
+  if newProcessGroup:
+    subproc.useProcessGroup()
+  if deadlineUsec > 0:
+    var deadline: Timeval
+    deadline.tv_sec  = Time(deadlineUsec div 1000000)
+    deadline.tv_usec = Suseconds(deadlineUsec mod 1000000)
+    subproc.setDeadline(deadline)
+  if cpuLimitSec > 0:
+    subproc.setCpuLimit(uint64(cpuLimitSec))
+  if memoryLimit > 0:
+    subproc.setMemoryLimit(uint64(memoryLimit))
+  if fdLimit > 0:
+    subproc.setFdLimit(uint64(fdLimit))
+  if recordTo != "" and not subproc.recordTo(recordTo, recordInput = true):
+    raise newException(IOError, "Could not open " & recordTo &
+                                " for recording.")
+
   if newStdIn != "":
     discard subproc.pipeToStdin(newStdin, closeStdin)
-  subproc.run()
 
+proc getExecOutput*(subproc: var SubProcess, waitForExit = true): ExecOutput =
+  ## Collects the results of a subprocess that has finished running.
   result          = ExecOutput()
   result.pid      = subproc.getPid()
   result.exitCode = subproc.getExitCode(waitForExit)
   result.stdout   = subproc.getStdout()
   result.stdin    = subproc.getStdin()
   result.stderr   = subproc.getStderr()
+  result.timedOut = subproc.timedOut()
+
+proc runCommand*(exe:  string,
+                 args: seq[string],
+                 newStdin                = "",
+                 closeStdIn              = false,
+                 pty                     = false,
+                 passthrough             = SpIoNone,
+                 passStderrToStdin       = false,
+                 capture                 = SpIoOutErr,
+                 combineCapture          = false,
+                 timeoutUsec             = 1000,
+                 env:  openarray[string] = [],
+                 waitForExit             = true,
+                 newProcessGroup         = false,
+                 deadlineUsec            = 0,
+                 cpuLimitSec             = 0,
+                 memoryLimit             = 0,
+                 fdLimit                 = 0,
+                 recordTo                = ""): ExecOutput =
+  ## One-shot interface.
+  ##
+  ## If `newProcessGroup` is true, the child gets its own process
+  ## group, and (when `waitForExit` is true) anything it leaves
+  ## running is killed once it's done. If `deadlineUsec` is non-zero,
+  ## the child's whole process tree is killed if it runs longer than
+  ## that; check `timedOut` in the result.
+  ##
+  ## The limits get applied in the child via `setrlimit()` before the
+  ## exec; zero means no limit.  `memoryLimit` is in bytes, and caps
+  ## the address space.
+  ##
+  ## If `recordTo` is given, the session gets recorded there in
+  ## asciicast format; see `recordTo()`.
+  var subproc: SubProcess
+
+  subproc.initCommand(exe, args, newStdin, closeStdin, pty, passthrough,
+                      passStderrToStdin, capture, combineCapture,
+                      timeoutUsec, env, newProcessGroup, deadlineUsec,
+                      cpuLimitSec, memoryLimit, fdLimit, recordTo)
+  subproc.run()
+
+  result = subproc.getExecOutput(waitForExit)
+
+  if newProcessGroup and waitForExit:
+    subproc.killTree()
 
 template getStdout*(o: ExecOutput): string = o.stdout
 template getStderr*(o: ExecOutput): string = o.stderr
@@ -197,11 +312,146 @@ proc runCmdGetEverything*(exe:  string,
                     passthrough = if passthrough: SpIoAll else: SpIoNone,
                     timeoutUSec = timeoutUsec, capture = SpIoOutErr, waitForExit = ensureExit)
 
-proc runPager*(s: string) =
+proc openPtySession*(s: var PtySession, shell = "/bin/sh",
+                     args: openarray[string] = [],
+                     env:  openarray[string] = [],
+                     rawParent = false): bool =
+  ## Starts a shell on a pty that stays around for running a series
+  ## of commands via `runInSession()`, so that we only allocate a pty
+  ## once. Call `close()` when done.
+  ##
+  ## Set `rawParent` if commands will be interactive; our terminal
+  ## gets put in raw mode once here, and restored on `close()`,
+  ## instead of flipping modes around every command.
+  var
+    argv = allocCStringArray(@[shell] & @args)
+    envp: cStringArray = nil
+
+  if len(env) != 0:
+    envp = allocCStringArray(env)
+
+  # The child has exec'd by the time this returns, so these are safe
+  # to free.
+  result = s.pty_session_open(cstring(shell), argv, envp, rawParent)
+
+  deallocCStringArray(argv)
+  if envp != nil:
+    deallocCStringArray(envp)
+
+proc runInSession*(s: var PtySession, cmd: string, passthrough = false,
+                   timeoutUsec = 0): ExecOutput =
+  ## Runs a command (in shell syntax) through a session opened with
+  ## `openPtySession()`. Output comes back in `stdout`; since it's a
+  ## pty, stderr is mixed in. The command's stdin is /dev/null, unless
+  ## the session has `rawParent` set and `passthrough` is on, in which
+  ## case what the user types goes to it.
+  ##
+  ## A command that doesn't parse (an unterminated quote, say) fails
+  ## with the shell's usual non-zero status, and the session stays
+  ## usable.
+  ##
+  ## If the command doesn't finish in `timeoutUsec` (when non-zero),
+  ## it gets interrupted, `timedOut` is set, and the session stays
+  ## usable. With the default of 0, this waits for as long as the
+  ## command runs, which is forever if it's waiting on input from a
+  ## user who never types anything. If the shell itself goes away, `exitCode` is -1,
+  ## and the session's `open` field will be false.
+  var
+    timeout: Timeval
+    tptr:    ptr Timeval = nil
+    outlen:  csize_t
+
+  if timeoutUsec > 0:
+    timeout.tv_sec  = Time(timeoutUsec div 1000000)
+    timeout.tv_usec = Suseconds(timeoutUsec mod 1000000)
+    tptr            = addr timeout
+
+  result     = ExecOutput(pid: s.pid)
+  let ok     = s.pty_session_run(cstring(cmd), csize_t(cmd.len()), tptr,
+                                 passthrough)
+  let output = s.pty_session_output(addr outlen)
+
+  if outlen != 0:
+    result.stdout = binaryCstringToString(output, int(outlen))
+
+  if ok:
+    result.exitCode = int(s.pty_session_status())
+  else:
+    result.exitCode = -1
+    result.timedOut = s.open
+
+proc replayAsciicast*(path: string, speed = 1.0, maxIdle = 0.0,
+                      output = stdout) =
+  ## Plays back an asciicast v2 recording, writing its output events
+  ## to `output`. Events are read one line at a time, so recordings
+  ## don't need to fit in memory.
+  ##
+  ## `speed` scales playback time (2.0 plays twice as fast; zero or
+  ## less plays without pausing). If `maxIdle` is positive, pauses in
+  ## the recording are capped at that many seconds before scaling.
   var
-    exe:   string
-    flags: seq[string]
+    f      = open(path)
+    line:  string
+    last   = 0.0
+    played = 0.0
+
+  defer:
+    f.close()
+
+  if not f.readLine(line):
+    return
+
+  if parseJson(line){"version"}.getInt() != 2:
+    raise newException(ValueError, path & ": not an asciicast v2 file.")
+
+  let start = ticks(getMonoTime())
+
+  while f.readLine(line):
+    if line.len() == 0:
+      continue
+
+    let event = parseJson(line)
 
+    if event.kind != JArray or event.len() < 3:
+      continue
+
+    if event[1].getStr() != "o":
+      continue
+
+    let ts    = event[0].getFloat()
+    var delay = ts - last
+
+    last = ts
+
+    if maxIdle > 0 and delay > maxIdle:
+      delay = maxIdle
+
+    if speed > 0:
+      # Sleep relative to when playback started, so rounding doesn't
+      # accumulate over long recordings.
+      played += delay / speed
+      let wait = played - float(ticks(getMonoTime()) - start) / 1e9
+      if wait > 0:
+        sleep(int(wait * 1000))
+
+    output.write(event[2].getStr())
+    output.flushFile()
+
+proc findPager*(): (string, seq[string]) =
+  ## Returns the pager to use (`less`, if there is one, else `more`)
+  ## and the flags to pass it.
+  let less = findAllExePaths("less")
+  if len(less) > 0:
+    return (less[0], @["-r", "-F"])
+
+  let more = findAllExePaths("more")
+  if len(more) > 0:
+    return (more[0], @[])
+
+  raise newException(ValueError,
+                     "Could not find 'more' or 'less' in your path.")
+
+proc runPager*(s: string) =
   if s == "":
     return
 
@@ -209,17 +459,7 @@ proc runPager*(s: string) =
     echo s
     return
 
-  let less = findAllExePaths("less")
-  if len(less) > 0:
-    exe   = less[0]
-    flags = @["-r", "-F"]
-  else:
-    let more = findAllExePaths("more")
-    if len(more) > 0:
-      exe = more[0]
-    else:
-      raise newException(ValueError,
-                         "Could not find 'more' or 'less' in your path.")
+  let (exe, flags) = findPager()
 
   runInteractiveCmd(exe, flags, s)
 
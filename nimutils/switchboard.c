@@ -1,6 +1,11 @@
 /*
  * Currently, we're using select() here, not epoll(), etc.
  */
+#if defined(__linux__)
+#include <sys/epoll.h>
+#elif defined(__APPLE__)
+#include <sys/event.h>
+#endif
 #ifndef SWITCHBOARD_H__
 #include "switchboard.h"
 #if defined(SB_DEBUG) || defined(SB_TEST)
@@ -1228,7 +1233,7 @@ sb_destroy(switchboard_t *ctx, bool free_parties)
 	fd_party_t     *fdobj = get_fd_obj(cur);
 	subscription_t *sub   = fdobj->subscribers;
 	
-	while (sub->subscriber) {
+	while (sub) {
 	    subscription_t *next_sub = sub->next;
 	    free(sub);
 	    sub = next_sub;
@@ -1370,6 +1375,92 @@ sb_operate_switchboard(switchboard_t *ctx, bool loop)
     return false;
 }
 
+/*
+ * For driving a switchboard from someone else's event loop. Returns
+ * a single descriptor (epoll on Linux, kqueue on macOS) that polls
+ * as readable whenever any descriptor the switchboard is waiting on
+ * is ready. Keep it current with `sb_sync_poll_fd()` before each
+ * wait, and when it fires, call `sb_operate_switchboard()` once, with
+ * a zero I/O timeout.
+ */
+int
+sb_new_poll_fd()
+{
+#if defined(__linux__)
+    return epoll_create1(EPOLL_CLOEXEC);
+#else
+    return kqueue();
+#endif
+}
+
+/*
+ * Updates the poll descriptor to match what the switchboard wants to
+ * select() on right now.
+ *
+ * Returns -1 when the switchboard is done. Otherwise, returns the
+ * number of descriptors that can't be watched through the poll
+ * descriptor (epoll refuses regular files, for instance). Those are
+ * always ready, so if this is non-zero, the caller should run the
+ * switchboard without waiting.
+ */
+int
+sb_sync_poll_fd(switchboard_t *ctx, int poll_fd)
+{
+    int unwatchable = 0;
+
+    if (ctx->done && !waiting_writes(ctx)) {
+	return -1;
+    }
+
+    set_fdinfo(ctx);
+
+    if (ctx->done && !waiting_writes(ctx)) {
+	return -1;
+    }
+
+    for (int fd = 0; fd < ctx->max_fd; fd++) {
+	bool want_read  = FD_ISSET(fd, &ctx->readset);
+	bool want_write = FD_ISSET(fd, &ctx->writeset);
+
+#if defined(__linux__)
+	struct epoll_event ev = { 0, };
+
+	if (!want_read && !want_write) {
+	    epoll_ctl(poll_fd, EPOLL_CTL_DEL, fd, &ev);
+	    continue;
+	}
+
+	ev.events  = (want_read ? EPOLLIN : 0) | (want_write ? EPOLLOUT : 0);
+	ev.data.fd = fd;
+
+	if (epoll_ctl(poll_fd, EPOLL_CTL_MOD, fd, &ev) == 0) {
+	    continue;
+	}
+	if (errno == ENOENT && epoll_ctl(poll_fd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+	    continue;
+	}
+	unwatchable++;
+#else
+	struct kevent change;
+
+	EV_SET(&change, fd, EVFILT_READ, want_read ? EV_ADD : EV_DELETE,
+	       0, 0, NULL);
+	if (kevent(poll_fd, &change, 1, NULL, 0, NULL) == -1 && want_read) {
+	    unwatchable++;
+	    continue;
+	}
+
+	EV_SET(&change, fd, EVFILT_WRITE, want_write ? EV_ADD : EV_DELETE,
+	       0, 0, NULL);
+	if (kevent(poll_fd, &change, 1, NULL, 0, NULL) == -1 && want_write) {
+	    unwatchable++;
+	}
+#endif
+    }
+
+    return unwatchable;
+}
+
 /*
  * Operates a setup switchboard, returning a result and dealing w/
  * memory management on exit.
@@ -11,6 +11,10 @@
 #include <limits.h>
 #include <signal.h>
 #include <termios.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <sys/types.h>
@@ -250,6 +254,37 @@ typedef struct switchboard_t {
 
 typedef sb_result_t sp_result_t;
 
+/*
+ * Records a session in asciicast v2 format (one JSON header line,
+ * then one JSON array per chunk of I/O). Events are streamed to the
+ * file through a small buffer, so long sessions don't accumulate in
+ * memory.
+ */
+struct asciicast_t;
+
+// One per recorded stream, since each needs its own UTF-8 carry-over.
+typedef struct {
+    party_t             party;
+    struct asciicast_t *rec;
+    char                kind;      // 'o' or 'i'.
+    char                tail[4];   // Incomplete UTF-8 from the last chunk.
+    int                 tail_len;
+} asciicast_stream_t;
+
+typedef struct asciicast_t {
+    int                fd;
+    bool               record_input;
+    struct timespec    start;
+    char              *buf;
+    size_t             len;
+    size_t             cap;
+    asciicast_stream_t out;
+    asciicast_stream_t err;
+    asciicast_stream_t in;
+} asciicast_t;
+
+#define ASCIICAST_FLUSH_AT 16384
+
 typedef struct {
     switchboard_t  sb;
     bool           run;
@@ -277,8 +312,24 @@ typedef struct {
     party_t        capture_stderr;
     struct termios saved_termcap;
     struct dcb_t  *deferred_cbs;
+    bool           new_pgroup;        // Child gets its own process group.
+    bool           new_session;       // Child gets its own session.
+    bool           user_timeout_set;
+    struct timeval user_timeout;      // What subproc_set_timeout() asked for.
+    bool           deadline_set;
+    bool           deadline_fired;
+    bool           timed_out;
+    struct timeval deadline_len;      // Wall clock budget for the child.
+    struct timespec deadline;         // Absolute, CLOCK_MONOTONIC.
+    rlim_t         cpu_limit;         // 0 means "leave it alone".
+    rlim_t         memory_limit;
+    rlim_t         fd_limit;
+    asciicast_t   *recorder;
 } subprocess_t;
 
+// After a deadline kill, how long we keep draining pipes before giving up.
+#define SP_DEADLINE_GRACE_USEC 100000
+
 #define SP_IO_STDIN     1
 #define SP_IO_STDOUT    2
 #define SP_IO_STDERR    4
@@ -297,6 +348,29 @@ typedef struct dcb_t {
     party_t            *to_free;
 } deferred_cb_t;
 
+/*
+ * A long-lived shell (or other coprocess that takes shell syntax) on
+ * a single pty. Commands get written to it one at a time, followed by
+ * a sentinel that reports the exit status, so we can tell where each
+ * command's output ends without spawning anything new.
+ */
+typedef struct {
+    pid_t          pid;
+    int            pty_fd;
+    bool           open;
+    bool           raw_parent;     // We put the parent tty in raw mode.
+    unsigned long  token;          // Bumped for each command.
+    int            last_status;
+    char          *buf;            // Output from the most recent command.
+    size_t         len;
+    size_t         cap;
+    struct termios saved_termcap;
+} pty_session_t;
+
+// Commands end with: PTY_SENTINEL PTY_SENTINEL_TAG <token>:<status> PTY_SENTINEL
+#define PTY_SENTINEL     '\036'
+#define PTY_SENTINEL_TAG "NIMU"
+
 extern ssize_t read_one(int, char *, size_t);
 extern bool write_data(int, char *, size_t);
 extern void sb_init_party_listener(switchboard_t *, party_t *, int,
@@ -340,6 +414,14 @@ extern bool subproc_set_io_callback(subprocess_t *, unsigned char,
 extern void subproc_set_timeout(subprocess_t *, struct timeval *);
 extern void subproc_clear_timeout(subprocess_t *);
 extern bool subproc_use_pty(subprocess_t *);
+extern bool subproc_set_new_pgroup(subprocess_t *, bool);
+extern bool subproc_set_new_session(subprocess_t *, bool);
+extern bool subproc_set_deadline(subprocess_t *, struct timeval *);
+extern bool subproc_set_cpu_limit(subprocess_t *, rlim_t);
+extern bool subproc_set_memory_limit(subprocess_t *, rlim_t);
+extern bool subproc_set_fd_limit(subprocess_t *, rlim_t);
+extern bool subproc_timed_out(subprocess_t *);
+extern void subproc_kill_tree(subprocess_t *, int);
 extern void subproc_start(subprocess_t *);
 extern bool subproc_poll(subprocess_t *);
 extern void subproc_prepare_results(subprocess_t *);
@@ -358,7 +440,19 @@ extern void termcap_get(struct termios *);
 extern void termcap_set(struct termios *);
 extern void termcap_set_typical_parent();
 extern void process_status_check(monitor_t *, bool);
+extern int sb_new_poll_fd();
+extern int sb_sync_poll_fd(switchboard_t *, int);
+extern int subproc_sync_poll_fd(subprocess_t *, int);
+extern bool subproc_check_exited(subprocess_t *);
 // pty params.
+extern bool pty_session_open(pty_session_t *, char *, char *[], char *[],
+			     bool);
+extern bool pty_session_run(pty_session_t *, char *, size_t,
+			    struct timeval *, bool);
+extern char *pty_session_output(pty_session_t *, size_t *);
+extern int pty_session_status(pty_session_t *);
+extern void pty_session_close(pty_session_t *);
 // ASCII Cinema.
+extern bool subproc_record_asciicast(subprocess_t *, char *, bool);
 #endif
 
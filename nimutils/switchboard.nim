@@ -49,6 +49,17 @@ proc operateSwitchboard*(ctx: var Switchboard, toCompletion: bool): bool
 template run*(ctx: var Switchboard, toCompletion = false) =
   operateSwitchboard(ctx, toCompletion)
 
+proc newPollFd*(): cint {.cdecl, importc: "sb_new_poll_fd", nodecl.}
+  ## Returns an epoll (Linux) or kqueue (macOS) descriptor that can be
+  ## kept in sync with a switchboard via `syncPollFd()`, and handed to
+  ## an external event loop.
+
+proc syncPollFd*(ctx: var Switchboard, pollFd: cint): cint
+    {.cdecl, importc: "sb_sync_poll_fd", nodecl.}
+  ## Makes `pollFd` watch whatever the switchboard is waiting on.
+  ## Returns -1 once the switchboard is done, otherwise the number
+  ## of descriptors that couldn't be watched (which are always ready).
+
 proc close*(ctx: var Switchboard) = ctx.sb_destroy(false)
 
 # Not yet wrapped:
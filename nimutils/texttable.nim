@@ -5,7 +5,7 @@
 # I don't factor out non-printable spaces right now, I just count runes.
 
 import rope_construct, rope_ansirender, markdown, unicode, std/terminal,
-       unicodeid
+       unicodeid, rope_base, rope_prerender
 
 proc formatCellsAsMarkdownList*(base: seq[seq[string]],
                                 toEmph: openarray[string],
@@ -48,7 +48,7 @@ proc formatCellsAsHtmlTable*(base:            seq[seq[string]],
       for i, cell in row:
         result &= "<tr><th>" & headers[i] & "</th><td>"
         if mToHtml:
-          result &= cell.markdownToHtml()
+          cell.markdownToHtml(result)
         else:
           result &= cell
         result &= "</td></tr>"
@@ -68,13 +68,119 @@ proc formatCellsAsHtmlTable*(base:            seq[seq[string]],
       for cell in row:
         result &= "<td>"
         if mToHtml:
-          result &= cell.markdownToHtml()
+          cell.markdownToHtml(result)
         else:
           result &= cell
         result &= "</td>"
       result &= "</tr>"
     result &= "</tbody></table>"
 
+proc cellToRope(cell: string, tag: string, mToRope: bool): Rope =
+  # The same thing `formatCellsAsHtmlTable()` and then
+  # `htmlStringToRope()` would give for the cell.
+  let contents = if mToRope: cell.markdownToRope(unwrap = false)
+                 else: cell.htmlStringToRope(false, unwrap = false)
+
+  return Rope(kind: RopeTaggedContainer, tag: tag, contained: contents)
+
+proc rowToRope(row: openarray[string], mToRope: bool): Rope =
+  result = Rope(kind: RopeTableRow, tag: "tr")
+
+  for cell in row:
+    result.cells.add(cell.cellToRope("td", mToRope))
+
+proc headersToRope(headers: openarray[string]): Rope =
+  var row = Rope(kind: RopeTableRow, tag: "tr")
+
+  for item in headers:
+    row.cells.add(item.cellToRope("th", false))
+
+  return Rope(kind: RopeTableRows, tag: "thead", cells: @[row])
+
+proc toColInfo(widthPcts: openarray[int]): seq[ColInfo] =
+  for pct in widthPcts:
+    result.add(ColInfo(span: 1, widthPct: pct))
+
+proc formatCellsAsRopeTable*(base:            seq[seq[string]],
+                             headers:         openarray[string] = [],
+                             mToRope         = true,
+                             verticalHeaders = false,
+                             widthPcts:       openarray[int] = []): Rope =
+  ## Builds the rope that `formatCellsAsHtmlTable()` would turn into,
+  ## without producing and then parsing the HTML. `widthPcts` gives
+  ## each column's width as a percentage; by default they're even.
+  if len(base) == 0:
+    raise newException(ValueError, "Table is empty.")
+
+  if verticalHeaders:
+    var last: Rope
+
+    for row in base:
+      if len(headers) != len(row):
+        raise newException(ValueError, "Can't omit headers when doing " &
+          "one cell per table")
+
+      let tbody = Rope(kind: RopeTableRows, tag: "tbody")
+      for i, cell in row:
+        tbody.cells.add(Rope(kind: RopeTableRow, tag: "tr",
+                             cells: @[headers[i].cellToRope("th", false),
+                                      cell.cellToRope("td", mToRope)]))
+
+      let table = Rope(kind: RopeTable, tag: "table", tbody: tbody,
+                       colInfo: widthPcts.toColInfo())
+      if last == nil:
+        result = table
+      else:
+        last.next = table
+      last = table
+  else:
+    result = Rope(kind: RopeTable, tag: "table",
+                  colInfo: widthPcts.toColInfo(),
+                  tbody: Rope(kind: RopeTableRows, tag: "tbody"))
+
+    if len(headers) != 0:
+      result.thead = headers.headersToRope()
+
+    for row in base:
+      result.tbody.cells.add(row.rowToRope(mToRope))
+
+proc printTable*(base:      seq[seq[string]],
+                 headers:   openarray[string] = [],
+                 file      = stdout,
+                 mToRope   = true,
+                 widthPcts: openarray[int] = [],
+                 chunkRows = 256,
+                 width     = -1) =
+  ## Prints a table as it goes, `chunkRows` rows at a time, with the
+  ## same column widths throughout, so the first rows of a huge table
+  ## show up right away, and only one chunk's worth of ropes and
+  ## rendered lines is held at once. The output is the same as
+  ## printing the whole `formatCellsAsRopeTable()` rope.
+  let
+    colInfo = widthPcts.toColInfo()
+    step    = max(2, chunkRows + chunkRows mod 2) # Keeps row colors in step.
+  var
+    w     = newAnsiWriter(file)
+    start = 0
+
+  while true:
+    let
+      stop  = min(start + step, base.len())
+      chunk = Rope(kind: RopeTable, tag: "table", colInfo: colInfo,
+                   tbody: Rope(kind: RopeTableRows, tag: "tbody"))
+
+    if start == 0 and len(headers) != 0:
+      chunk.thead = headers.headersToRope()
+    for i in start ..< stop:
+      chunk.tbody.cells.add(base[i].rowToRope(mToRope))
+
+    w.render(chunk.preRenderTableChunk(start == 0, stop == base.len(), width))
+    w.flush()
+
+    if stop == base.len():
+      break
+    start = stop
+
 proc filterEmptyColumns*(inrows: seq[seq[string]],
                          headings: openarray[string],
                          emptyVals = ["", "None", "<em>None</em>", "[]"]):
@@ -140,14 +246,16 @@ proc instantTable*(cells: seq[string], html = false): string =
 
   rows.add(row)
 
-  result = rows.formatCellsAsHtmlTable()
-
-  if not html:
-    result = result.stylizeHtml()
+  if html:
+    result = rows.formatCellsAsHtmlTable()
+  else:
+    result = rows.formatCellsAsRopeTable().preRenderFlat().
+             preRenderBoxToAnsiString()
 
 proc instantTableWithHeaders*(cells: seq[seq[string]]): string =
   let
     headers = cells[0]
     rest    = cells[1 .. ^1]
 
-  return rest.formatCellsAsHtmlTable(headers).stylizeHtml()
+  return rest.formatCellsAsRopeTable(headers).preRenderFlat().
+           preRenderBoxToAnsiString()
@@ -5,7 +5,7 @@
 ## :Author: John Viega (john@crashoverride.com)
 ## :Copyright: 2022
 
-import streams, unicode, strutils, std/terminal, misc
+import streams, unicode, strutils, tables, std/terminal, misc
 import unicodedb/properties, unicodedb/widths
 
 const magicRune* = Rune(0x200b)
@@ -118,23 +118,6 @@ proc isIdContinue*(r: Rune): bool =
 
   return false
 
-proc isValidId*(s: string): bool =
-  ## Return true if the input string is a valid identifier per the
-  ## unicode spec.
-  if s.len() == 0:
-    return false
-
-  let l = s.runeLenAt(0)
-
-  if not s.runeAt(0).isIdStart():
-    return false
-
-  for rune in s[l .. ^1].runes():
-    if not rune.isIdContinue():
-      return false
-
-  return true
-
 proc readRune*(s: Stream): Rune =
   ## Read a single rune from a stream.
   var
@@ -183,7 +166,11 @@ template isSeparator*(r: Rune): bool =
   r in [Rune(0x000d), Rune(0x000a), Rune(0x0085), Rune(0x000b),
         Rune(0x2028), Rune(0x2029), Rune(0x000c)]
 
-proc runeWidth*(r: Rune): int =
+proc computeRuneWidth*(r: Rune): int =
+  ## What `runeWidth()` returns, worked out from the Unicode
+  ## properties. The tables below get built from this at compile
+  ## time; it's exported so the tests can check them against it. Use
+  ## `runeWidth()` instead; this is much slower.
   let category = r.unicodeCategory()
 
   if int(r) in [0xfe0f]:
@@ -206,6 +193,468 @@ proc runeWidth*(r: Rune): int =
   else:
     return 1
 
+const
+  # The width trie: the top 9 bits of a codepoint pick a middle block,
+  # the next 6 pick a leaf, and the low 6 pick the width within it.
+  # Identical blocks are shared, which is what keeps this small.
+  rwLeafBits = 6
+  rwMidBits  = 6
+  rwLeafSize = 1 shl rwLeafBits
+  rwMidSize  = 1 shl rwMidBits
+  rwTopSize  = 0x110000 shr (rwLeafBits + rwMidBits)
+
+proc buildWidthTables(): (seq[uint16], seq[uint16], seq[uint8]) =
+  # Planes 4 through 13 are unassigned and 15 and 16 are private use,
+  # so they all come out as width 1; we only look up the rest.
+  var
+    top:    seq[uint16]
+    mids:   seq[uint16]
+    leaves: seq[uint8]
+    seenMid  = initTable[seq[uint16], int]()
+    seenLeaf = initTable[seq[uint8], int]()
+    mid      = newSeq[uint16](rwMidSize)
+    leaf     = newSeq[uint8](rwLeafSize)
+
+  for t in 0 ..< rwTopSize:
+    for m in 0 ..< rwMidSize:
+      for l in 0 ..< rwLeafSize:
+        let cp = (((t shl rwMidBits) + m) shl rwLeafBits) + l
+        if cp < 0x40000 or (cp >= 0xe0000 and cp < 0xf0000):
+          leaf[l] = uint8(Rune(cp).computeRuneWidth())
+        else:
+          leaf[l] = 1
+
+      if leaf notin seenLeaf:
+        seenLeaf[leaf] = len(leaves) div rwLeafSize
+        leaves &= leaf
+      mid[m] = uint16(seenLeaf[leaf])
+
+    if mid notin seenMid:
+      seenMid[mid] = len(mids) div rwMidSize
+      mids &= mid
+    top.add(uint16(seenMid[mid]))
+
+  return (top, mids, leaves)
+
+proc toWidthArray[N: static int, T](s: seq[T]): array[N, T] =
+  for i in 0 ..< N:
+    result[i] = s[i]
+
+const
+  rwTables = buildWidthTables()
+  rwTop    = toWidthArray[rwTopSize, uint16](rwTables[0])
+  rwMids   = toWidthArray[rwTables[1].len(), uint16](rwTables[1])
+  rwLeaves = toWidthArray[rwTables[2].len(), uint8](rwTables[2])
+
+proc runeWidth*(r: Rune): int =
+  ## Returns how many terminal columns the codepoint takes up: 0, 1
+  ## or 2. This is a table lookup; the tables are built at compile
+  ## time.
+  let cp = int(r)
+
+  if cp < 0x80:
+    return 1
+  if cp > 0x10ffff:
+    return 1
+
+  let
+    mid  = int(rwTop[cp shr (rwLeafBits + rwMidBits)])
+    leaf = int(rwMids[mid * rwMidSize +
+                      ((cp shr rwLeafBits) and (rwMidSize - 1))])
+
+  return int(rwLeaves[leaf * rwLeafSize + (cp and (rwLeafSize - 1))])
+
+{.emit: """
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Returns how many bytes at the front of `s` are ASCII.
+static size_t
+ascii_prefix_len(const char *s, size_t n) {
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 32 <= n; i += 32) {
+        __m256i v    = _mm256_loadu_si256((const __m256i *)(s + i));
+        unsigned m   = (unsigned)_mm256_movemask_epi8(v);
+        if (m) {
+            return i + __builtin_ctz(m);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        __m128i v    = _mm_loadu_si128((const __m128i *)(s + i));
+        unsigned m   = (unsigned)_mm_movemask_epi8(v);
+        if (m) {
+            return i + __builtin_ctz(m);
+        }
+    }
+#else
+    for (; i + 16 <= n; i += 16) {
+        uint64_t a, b;
+        memcpy(&a, s + i, 8);
+        memcpy(&b, s + i + 8, 8);
+        if ((a | b) & 0x8080808080808080ULL) {
+            break;
+        }
+    }
+#endif
+    while (i < n && !(s[i] & 0x80)) {
+        i++;
+    }
+    return i;
+}
+
+// Same, for codepoints. Anything above 0x7f stops the run, including
+// style markers.
+static size_t
+u32_ascii_prefix_len(const uint32_t *s, size_t n) {
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i hi8 = _mm256_set1_epi32(~0x7f);
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        if (!_mm256_testz_si256(v, hi8)) {
+            break;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i hi4  = _mm_set1_epi32(~0x7f);
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + i + 4));
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + i + 8));
+        __m128i d = _mm_loadu_si128((const __m128i *)(s + i + 12));
+        __m128i o = _mm_and_si128(_mm_or_si128(_mm_or_si128(a, b),
+                                               _mm_or_si128(c, d)), hi4);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(o, zero)) != 0xffff) {
+            break;
+        }
+    }
+#else
+    for (; i + 4 <= n; i += 4) {
+        if ((s[i] | s[i + 1] | s[i + 2] | s[i + 3]) & ~0x7fU) {
+            break;
+        }
+    }
+#endif
+    while (i < n && s[i] < 0x80) {
+        i++;
+    }
+    return i;
+}
+
+// Decodes one multi-byte sequence at the front of `s`. Returns its
+// length, 0 if it's invalid (overlong, a surrogate, past U+10FFFF, or
+// a bad continuation byte), or -1 if `s` ends partway through it.
+static inline int
+utf8_seq(const unsigned char *s, size_t n, uint32_t *cp) {
+    unsigned c = s[0];
+    int      len;
+    uint32_t v, min;
+
+    if (c >= 0xc2 && c <= 0xdf) {
+        len = 2; v = c & 0x1f; min = 0x80;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        len = 3; v = c & 0x0f; min = 0x800;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        len = 4; v = c & 0x07; min = 0x10000;
+    } else {
+        return 0;
+    }
+
+    for (int i = 1; i < len; i++) {
+        if ((size_t)i >= n) {
+            return -1;
+        }
+        if ((s[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        v = (v << 6) | (s[i] & 0x3f);
+    }
+
+    if (v < min || v > 0x10ffff || (v >= 0xd800 && v <= 0xdfff)) {
+        return 0;
+    }
+
+    *cp = v;
+    return len;
+}
+
+// Widens `n` ASCII bytes to codepoints.
+static inline void
+widen_ascii(const unsigned char *s, size_t n, uint32_t *out) {
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        __m128i b = _mm_loadl_epi64((const __m128i *)(s + i));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_cvtepu8_epi32(b));
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        __m128i v  = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        __m128i *o  = (__m128i *)(out + i);
+
+        _mm_storeu_si128(o,     _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128(o + 1, _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128(o + 2, _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128(o + 3, _mm_unpackhi_epi16(hi, zero));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = s[i];
+    }
+}
+
+// Decodes UTF-8 into `out`, which needs room for `max` codepoints
+// (never more than `n` get written). Stops at the first sequence that
+// is invalid or cut off by the end of the input, or when `out` is
+// full. Returns how many codepoints were written; `*used` gets how
+// many bytes were consumed, and `*cut` is set if we stopped because
+// the input ended mid-sequence.
+static size_t
+utf8_decode(const char *src, size_t n, uint32_t *out, size_t max,
+            size_t *used, int *cut) {
+    const unsigned char *s = (const unsigned char *)src;
+    size_t               i = 0, o = 0;
+
+    *cut = 0;
+
+    while (i < n && o < max) {
+        size_t room = n - i < max - o ? n - i : max - o;
+        size_t run  = ascii_prefix_len((const char *)s + i, room);
+
+        widen_ascii(s + i, run, out + o);
+        i += run;
+        o += run;
+
+        if (i == n || o == max) {
+            break;
+        }
+
+        int len = utf8_seq(s + i, n - i, out + o);
+        if (len <= 0) {
+            *cut = len < 0;
+            break;
+        }
+        i += (size_t)len;
+        o += 1;
+    }
+
+    *used = i;
+    return o;
+}
+
+// Returns the offset of the first invalid (or cut off) sequence, or
+// `n` if it's all valid.
+static size_t
+utf8_validate(const char *src, size_t n) {
+    const unsigned char *s = (const unsigned char *)src;
+    size_t               i = 0;
+    uint32_t             cp;
+
+    while (i < n) {
+        i += ascii_prefix_len((const char *)s + i, n - i);
+        if (i == n) {
+            break;
+        }
+
+        int len = utf8_seq(s + i, n - i, &cp);
+        if (len <= 0) {
+            break;
+        }
+        i += (size_t)len;
+    }
+
+    return i;
+}
+""".}
+
+proc ascii_prefix_len(s: pointer, n: csize_t): csize_t {.cdecl, importc,
+                                                          nodecl.}
+proc u32_ascii_prefix_len(s: pointer, n: csize_t): csize_t {.cdecl, importc,
+                                                              nodecl.}
+
+proc utf8_decode(s: pointer, n: csize_t, dst: pointer, max: csize_t,
+                 used: var csize_t, cut: var cint): csize_t {.cdecl, importc,
+                                                              nodecl.}
+proc utf8_validate(s: pointer, n: csize_t): csize_t {.cdecl, importc, nodecl.}
+
+proc asciiPrefixLen*(s: openArray[char]): int =
+  ## Returns how many characters at the front of `s` are ASCII. Each
+  ## of those is one column wide.
+  if len(s) == 0:
+    return 0
+  return int(ascii_prefix_len(unsafeAddr s[0], csize_t(len(s))))
+
+proc asciiPrefixLen*(s: openArray[uint32]): int =
+  ## Same, for codepoints. Style markers end the run.
+  if len(s) == 0:
+    return 0
+  return int(u32_ascii_prefix_len(unsafeAddr s[0], csize_t(len(s))))
+
+const replacementChar = 0xfffd'u32
+
+proc validUtf8Len*(s: openArray[char]): int =
+  ## Returns how many bytes at the front of `s` are valid UTF-8; if
+  ## it's all valid, that's `len(s)`. ASCII runs get checked a vector
+  ## at a time.
+  if len(s) == 0:
+    return 0
+  return int(utf8_validate(unsafeAddr s[0], csize_t(len(s))))
+
+template isValidUtf8*(s: openArray[char]): bool =
+  s.validUtf8Len() == len(s)
+
+proc decodeUtf8*(s: openArray[char], dst: var seq[uint32]) =
+  ## Appends the codepoints in `s` to `dst`. ASCII runs get widened a
+  ## vector at a time. Each byte that isn't part of a valid sequence
+  ## becomes U+FFFD.
+  let start = dst.len()
+  var
+    i = 0
+    o = start
+
+  # There are never more codepoints than bytes.
+  dst.setLen(start + len(s))
+
+  while i < len(s):
+    var
+      used: csize_t
+      cut:  cint
+    let n = utf8_decode(unsafeAddr s[i], csize_t(len(s) - i), addr dst[o],
+                        csize_t(len(s) - i), used, cut)
+    o += int(n)
+    i += int(used)
+    if i < len(s):
+      dst[o] = replacementChar
+      o     += 1
+      i     += 1
+
+  dst.setLen(o)
+
+proc decodeUtf8*(s: openArray[char]): seq[uint32] =
+  s.decodeUtf8(result)
+
+template utf8ToRunes*(s: openArray[char]): seq[Rune] =
+  ## Like `toRunes()`, but see `decodeUtf8()`.
+  cast[seq[Rune]](s.decodeUtf8())
+
+iterator decodedRunes*(s: openArray[char]): uint32 =
+  ## Yields the codepoints in `s`, decoding a block at a time into a
+  ## buffer on the stack. Invalid bytes come out as U+FFFD.
+  var
+    buf: array[256, uint32]
+    i    = 0
+
+  while i < len(s):
+    var
+      used: csize_t
+      cut:  cint
+    let n = int(utf8_decode(unsafeAddr s[i], csize_t(len(s) - i),
+                            addr buf[0], csize_t(len(buf)), used, cut))
+    i += int(used)
+    for k in 0 ..< n:
+      yield buf[k]
+    if i < len(s) and n < len(buf):
+      yield replacementChar
+      i += 1
+
+proc isValidId*(s: string): bool =
+  ## Return true if the input string is a valid identifier per the
+  ## unicode spec.
+  if s.len() == 0:
+    return false
+
+  var first = true
+
+  # Invalid UTF-8 comes out as U+FFFD, which can't be in an id.
+  for cp in s.decodedRunes():
+    if first:
+      if not Rune(cp).isIdStart():
+        return false
+      first = false
+    elif not Rune(cp).isIdContinue():
+      return false
+
+  return true
+
+type RuneReader* = object
+  ## Reads runes from a stream, decoding a block of bytes at a time,
+  ## where `readRune()` on the stream itself goes a byte at a time.
+  stream:    Stream
+  blockSize: int
+  bytes:     string      # Read, but not decoded yet.
+  runes:     seq[uint32] # Decoded, but not read yet.
+  pos:       int
+
+proc newRuneReader*(s: Stream, blockSize = 4096): RuneReader =
+  result = RuneReader(stream: s, blockSize: max(blockSize, 4))
+
+proc fill(r: var RuneReader): bool =
+  # Decodes the next block; returns false at the end of the stream. A
+  # sequence that straddles blocks waits for the rest of its bytes.
+  r.runes.setLen(0)
+  r.pos = 0
+
+  while r.runes.len() == 0:
+    let have = r.bytes.len()
+
+    r.bytes.setLen(have + r.blockSize)
+    let got = r.stream.readData(addr r.bytes[have], r.blockSize)
+    r.bytes.setLen(have + got)
+
+    if r.bytes.len() == 0:
+      return false
+
+    var
+      used: csize_t
+      cut:  cint
+
+    r.runes.setLen(r.bytes.len())
+    let n = int(utf8_decode(addr r.bytes[0], csize_t(r.bytes.len()),
+                            addr r.runes[0], csize_t(r.runes.len()), used,
+                            cut))
+    r.runes.setLen(n)
+
+    let left = r.bytes.len() - int(used)
+    if n == 0 and left != 0 and (cut == 0 or got == 0):
+      raise newException(ValueError, "Invalid UTF8 sequence")
+    if left != 0:
+      moveMem(addr r.bytes[0], addr r.bytes[int(used)], left)
+    r.bytes.setLen(left)
+
+  return true
+
+proc atEnd*(r: var RuneReader): bool =
+  return r.pos >= r.runes.len() and not r.fill()
+
+proc readRune*(r: var RuneReader): Rune =
+  ## Like `readRune()` on a stream, returns Rune(0) once the stream is
+  ## done, and raises ValueError on invalid UTF-8.
+  if r.atEnd():
+    return Rune(0)
+  result = Rune(r.runes[r.pos])
+  r.pos += 1
+
+proc peekRune*(r: var RuneReader): Rune =
+  if r.atEnd():
+    return Rune(0)
+  result = Rune(r.runes[r.pos])
+
 template runeWidth*(r: uint32): int =
   if r > 0x0010ffff:
     0
@@ -213,20 +662,56 @@ template runeWidth*(r: uint32): int =
     Rune(r).runeWidth()
 
 proc runeLength*(s: string): int =
-  for r in s.toRunes():
-    result += r.runeWidth()
+  ## Returns how many columns `s` takes up. ASCII runs get counted in
+  ## bulk, and the rest gets decoded a block at a time.
+  var
+    buf: array[64, uint32]
+    i    = 0
+
+  while i < len(s):
+    let run = s.toOpenArray(i, len(s) - 1).asciiPrefixLen()
+    result += run
+    i      += run
+
+    if i < len(s):
+      var
+        used: csize_t
+        cut:  cint
+      let n = int(utf8_decode(unsafeAddr s[i], csize_t(len(s) - i),
+                              addr buf[0], csize_t(len(buf)), used, cut))
+      for k in 0 ..< n:
+        result += buf[k].runeWidth()
+      i += int(used)
+      if n == 0:
+        result += 1 # An invalid byte, which would print as U+FFFD.
+        i      += 1
 
 proc truncateToWidth*(l: seq[uint32], width: int): seq[uint32] =
-  var total = 0
-
-  for ch in l:
+  var
+    total = 0
+    i     = 0
+
+  result = newSeqOfCap[uint32](len(l))
+
+  while i < len(l):
+    # ASCII runs are all width 1, so we can take them in one go.
+    let run = l.toOpenArray(i, len(l) - 1).asciiPrefixLen()
+    if run != 0:
+      let keep = max(0, min(run, width - total))
+      if keep != 0:
+        result.add(l.toOpenArray(i, i + keep - 1))
+      total += run
+      i     += run
+      continue
+
+    let ch = l[i]
     if ch > 0x0010ffff:
       result.add(ch)
     else:
-      let w = ch.runeWidth()
-      total += w
+      total += ch.runeWidth()
       if total <= width:
         result.add(ch)
+    i += 1
 
 proc count*[T](list: seq[T], target: T): int =
   result = 0
@@ -305,10 +790,18 @@ proc indentWrap*( s: string,
         for k in i..<j: result.add(s[k])
     i = j
 
-proc u32LineLength*(line: seq[uint32]): int =
-  for item in line:
-    if item <= 0x10ffff:
-      result += item.runeWidth()
+proc u32LineLength*(line: openArray[uint32]): int =
+  var i = 0
+
+  while i < len(line):
+    let run = line.toOpenArray(i, len(line) - 1).asciiPrefixLen()
+    result += run
+    i      += run
+
+    if i < len(line):
+      if line[i] <= 0x10ffff:
+        result += line[i].runeWidth()
+      i += 1
 
 proc toWords*(line: seq[uint32]): seq[seq[uint32]] =
   var cur: seq[uint32]
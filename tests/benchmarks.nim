@@ -0,0 +1,290 @@
+## Micro-benchmarks. These aren't part of the unit tests; run them
+## with:
+##
+##     nim c -r -d:release tests/benchmarks.nim
+##
+## or `nimble bench`, which only runs the render pipeline stages and
+## also writes the results to bench.json. With `--pipeline`, only the
+## pipeline stages run; `--json:<file>` writes their results out as
+## JSON. Allocation counts need `-d:nimAllocStats`; otherwise they're
+## reported as -1.
+
+import nimutils, std/monotimes, times, strformat, unicode, json, parseopt
+from posix import getrusage, Rusage, RUSAGE_SELF
+
+proc paragraph(size: int): seq[uint32] =
+  # One line of `size` codepoints, with no newlines, so the wrapper
+  # has to chew through all of it in one go.
+  const words = ["lorem", "ipsum", "dolor", "sit", "amet,", "consectetur",
+                 "adipiscing", "elit"]
+  var i = 0
+
+  result = newSeqOfCap[uint32](size + 16)
+  while result.len() < size:
+    for ch in words[i mod len(words)]:
+      result.add(uint32(ch))
+    result.add(uint32(' '))
+    i += 1
+
+template timeMs(code: untyped): float =
+  let start = getMonoTime()
+  code
+  float((getMonoTime() - start).inMicroseconds()) / 1000.0
+
+proc benchWrap(mb: int) =
+  let
+    text  = paragraph(mb * 1024 * 1024)
+    style = newStyle(overflow = OWrap)
+  var
+    plane = TextPlane(lines: @[text])
+
+  let ms = timeMs(plane.wrapToWidth(style, 80))
+
+  echo fmt"wrap {mb:>2} MB paragraph: {ms:>9.2f} ms, " &
+       fmt"{plane.lines.len()} lines"
+
+proc benchWidth(mb: int) =
+  let text = paragraph(mb * 1024 * 1024)
+  var
+    str   = $(Rune(0x4e16)) # One wide character, then all ASCII.
+    total = 0
+
+  for ch in text:
+    str.add(char(ch))
+
+  let
+    u32Ms = timeMs(total += text.u32LineLength())
+    strMs = timeMs(total += str.runeLength())
+
+  echo fmt"width {mb:>2} MB: u32LineLength {u32Ms:>9.2f} ms, " &
+       fmt"runeLength {strMs:>9.2f} ms ({total} cols)"
+
+proc helpPage(sections: int): string =
+  # Roughly what our help pages look like, repeated.
+  for i in 0 ..< sections:
+    result.add(fmt"""
+## Section {i}
+
+Some *emphasized* text, some **strong** text, a [link](https://example.com/{i})
+and a bit of `inline code`, wrapped across
+a couple of lines &amp; with an entity.
+
+- First item
+- Second item, with *style*
+  - A nested item
+
+| Option | Default | Description |
+|--------|---------|-------------|
+| `--foo` | true | Does the foo thing. |
+| `--bar` | 12 | How much bar. |
+
+```
+some code {i}
+  indented
+```
+
+""")
+
+proc benchMarkdown(sections: int) =
+  let
+    doc      = helpPage(sections)
+    viaMs    = timeMs(discard doc.markdownToHtml().htmlStringToRope(false))
+    directMs = timeMs(discard doc.markdownToRope())
+
+  echo fmt"markdown {sections:>4} sections: via HTML {viaMs:>9.2f} ms, " &
+       fmt"direct {directMs:>9.2f} ms"
+
+proc benchHtmlParse(sections: int) =
+  let
+    html      = helpPage(sections).markdownToHtml()
+    treeMs    = timeMs(discard html.parseDocument())
+    compactMs = timeMs(discard html.parseDocumentCompact())
+
+  echo fmt"html parse {sections:>4} sections: HtmlNode {treeMs:>9.2f} ms, " &
+       fmt"compact {compactMs:>9.2f} ms"
+
+proc benchTable(nRows: int) =
+  var rows: seq[seq[string]]
+
+  for i in 0 ..< nRows:
+    rows.add(@["row " & $(i), "*some* text", "`code`", "more text"])
+
+  let
+    viaMs    = timeMs(discard rows.formatCellsAsHtmlTable().stylizeHtml())
+    directMs = timeMs(discard rows.formatCellsAsRopeTable().preRenderFlat().
+                              preRenderBoxToAnsiString())
+
+  echo fmt"table {nRows:>5} rows: via HTML {viaMs:>9.2f} ms, " &
+       fmt"direct {directMs:>9.2f} ms"
+
+proc appendPlus(n: int): Rope =
+  for i in 0 ..< n:
+    result = result + Rope(kind: RopeAtom, text: ($(i)).toRunes())
+
+proc appendBuilder(n: int): Rope =
+  var b: RopeBuilder
+
+  for i in 0 ..< n:
+    b.add(Rope(kind: RopeAtom, text: ($(i)).toRunes()))
+  result = b.toRope()
+
+proc benchAppend(n: int) =
+  # `+` walks the whole chain each time, so it goes up 4x per step.
+  let
+    plusMs    = timeMs(discard appendPlus(n))
+    builderMs = timeMs(discard appendBuilder(n))
+
+  echo fmt"append {n:>6} pieces: + {plusMs:>9.2f} ms, " &
+       fmt"RopeBuilder {builderMs:>9.2f} ms"
+
+proc benchDecode(mb: int) =
+  let text = paragraph(mb * 1024 * 1024)
+  var str = $(Rune(0x4e16)) # Make sure it isn't all ASCII.
+
+  for ch in text:
+    str.add(char(ch))
+
+  let
+    toRunesMs = timeMs(discard str.toRunes())
+    decodeMs  = timeMs(discard str.decodeUtf8())
+
+  echo fmt"decode {mb:>2} MB: toRunes {toRunesMs:>9.2f} ms, " &
+       fmt"decodeUtf8 {decodeMs:>9.2f} ms"
+
+# The render pipeline, a stage at a time, on synthetic documents of
+# increasing size. For each stage we report time per input rune, how
+# many allocations it made, and how much the heap grew (after a full
+# collection beforehand, so it's roughly the stage's peak), along with
+# the process's peak RSS so far.
+
+type StageResult = object
+  stage:      string
+  size:       int
+  runes:      int
+  ms:         float
+  nsPerRune:  float
+  allocs:     int
+  heapGrowth: int
+  maxRssKb:   int
+
+var stageResults: seq[StageResult]
+
+proc maxRssKb(): int =
+  var usage: Rusage
+
+  if getrusage(RUSAGE_SELF, addr usage) == 0:
+    result = int(usage.ru_maxrss)
+
+template stage(name: string, n, nRunes: int, code: untyped) =
+  GC_fullCollect()
+  clearRenderCache() # Every stage starts cold.
+
+  when defined(nimAllocStats):
+    let allocsBefore = getAllocStats()
+  let memBefore = getTotalMem()
+
+  let ms = timeMs(code)
+
+  var res = StageResult(stage: name, size: n, runes: nRunes, ms: ms,
+                        nsPerRune: ms * 1_000_000.0 / float(max(nRunes, 1)),
+                        allocs: -1, heapGrowth: getTotalMem() - memBefore,
+                        maxRssKb: maxRssKb())
+  when defined(nimAllocStats):
+    res.allocs = (getAllocStats() - allocsBefore).allocCount
+
+  stageResults.add(res)
+  echo fmt"{name:<16} {n:>6}: {ms:>9.2f} ms, {res.nsPerRune:>8.1f} ns/rune, " &
+       fmt"{res.allocs:>9} allocs, heap +{res.heapGrowth div 1024:>7} KB"
+
+proc benchPipeline(sections: int) =
+  let
+    doc    = helpPage(sections)
+    nRunes = doc.runeLen()
+  var
+    rope:  Rope
+    plane: FlatTextPlane
+
+  stage("markdownToRope", sections, nRunes):
+    rope = doc.markdownToRope()
+  stage("preRender", sections, nRunes):
+    plane = rope.preRenderFlat(80)
+  stage("ansi", sections, nRunes):
+    discard plane.preRenderBoxToAnsiString()
+  stage("stylizeMd", sections, nRunes):
+    discard doc.stylizeMd(80)
+  stage("measure", sections, nRunes):
+    discard rope.measure(80)
+
+proc benchPipelineText(kb: int) =
+  let
+    text  = paragraph(kb * 1024)
+    style = newStyle(overflow = OWrap)
+  var
+    str   = newStringOfCap(text.len())
+    plane = TextPlane(lines: @[text])
+
+  for ch in text:
+    str.add(char(ch))
+
+  stage("wrapToWidth", kb, text.len()):
+    plane.wrapToWidth(style, 80)
+  stage("stylize", kb, text.len()):
+    discard str.stylize(80)
+
+proc benchPipelineTable(nRows: int) =
+  var
+    rows:   seq[seq[string]]
+    nRunes: int
+
+  for i in 0 ..< nRows:
+    rows.add(@["row " & $(i), "*some* text", "`code`", "more text"])
+    for cell in rows[^1]:
+      nRunes += cell.runeLen()
+
+  let table = rows.formatCellsAsRopeTable()
+
+  stage("table preRender", nRows, nRunes):
+    discard table.preRenderFlat(100)
+
+proc runPipeline() =
+  for sections in [50, 100, 200, 400]:
+    benchPipeline(sections)
+  for kb in [64, 128, 256, 512]:
+    benchPipelineText(kb)
+  for nRows in [500, 1000, 2000, 4000]:
+    benchPipelineTable(nRows)
+
+when isMainModule:
+  var
+    jsonPath     = ""
+    pipelineOnly = false
+
+  for kind, key, val in getopt():
+    if kind == cmdLongOption and key == "json":
+      jsonPath = val
+    elif kind == cmdLongOption and key == "pipeline":
+      pipelineOnly = true
+
+  runPipeline()
+
+  if jsonPath != "":
+    writeFile(jsonPath, pretty(%stageResults) & "\n")
+
+  if pipelineOnly:
+    quit(0)
+
+  # Time should roughly double with each step.
+  for mb in [1, 2, 4, 8]:
+    benchWrap(mb)
+  for mb in [1, 2, 4, 8]:
+    benchWidth(mb)
+  for sections in [100, 200, 400, 800]:
+    benchMarkdown(sections)
+  for sections in [100, 200, 400, 800]:
+    benchHtmlParse(sections)
+  for nRows in [1000, 2000, 4000, 8000]:
+    benchTable(nRows)
+  for n in [5000, 10000, 20000, 40000]:
+    benchAppend(n)
+  for mb in [1, 2, 4, 8]:
+    benchDecode(mb)
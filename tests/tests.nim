@@ -1,12 +1,14 @@
 ## Unit tests.
 
-import unittest
+import unittest, unicode
 import nimutils
 import nimutils/box
 import nimutils/unicodeid
 import nimutils/randwords # large code size, not imported by default.
 import nimutils/either    # Not working well, not import by default.
-import tables
+import nimutils/asyncsubproc
+import asyncdispatch
+import tables, streams, options
 import json
 import os
 
@@ -183,6 +185,459 @@ suite "misc":
     check resolvePath("") == getCurrentDir()
     check resolvePath("~fred") == joinPath(base, "fred")
     check resolvePath("../../src/../../eoeoeo") == "/Users/eoeoeo"
+  test "exe cache":
+    let uncached = findAllExePaths("sh", useCache = false)
+
+    prewarmExeCache(["sh"])
+    check findAllExePaths("sh") == uncached
+    check findAllExePaths("sh") == uncached
+    clearExeCache()
+    check findAllExePaths("sh") == uncached
+
+    # A relative extra path means something else after a chdir.
+    let
+      oldDir  = getCurrentDir()
+      withIt  = getTempDir() / "nimutils-exe-a"
+      without = getTempDir() / "nimutils-exe-b"
+      tool    = withIt / "bin" / "nimutils-test-tool"
+
+    createDir(withIt / "bin")
+    createDir(without / "bin")
+    writeFile(tool, "#!/bin/sh\n")
+    setFilePermissions(tool, {fpUserRead, fpUserExec})
+
+    setCurrentDir(withIt)
+    check findAllExePaths("nimutils-test-tool", @["bin"], false).len() == 1
+    setCurrentDir(without)
+    check findAllExePaths("nimutils-test-tool", @["bin"], false).len() == 0
+    setCurrentDir(oldDir)
+    removeDir(withIt)
+    removeDir(without)
+  test "deadline":
+    let res = runCommand("sh", @["-c", "echo hi; sleep 30 & sleep 30"],
+                         newProcessGroup = true, deadlineUsec = 200000)
+    check res.timedOut
+    check res.stdout == "hi\n"
+  test "pty session":
+    var session: PtySession
+
+    check session.openPtySession()
+    var res = session.runInSession("echo one")
+    check res.stdout == "one\n"
+    check res.exitCode == 0
+    res = session.runInSession("false")
+    check res.exitCode == 1
+    res = session.runInSession("echo \"unterminated", timeoutUsec = 5000000)
+    check not res.timedOut
+    check res.exitCode != 0
+    res = session.runInSession("echo 'still here'")
+    check res.stdout == "still here\n"
+    # Reading stdin gets EOF, rather than the rest of our input.
+    res = session.runInSession("read x; echo got:$x", timeoutUsec = 5000000)
+    check not res.timedOut
+    check res.stdout == "got:\n"
+    res = session.runInSession("echo next")
+    check res.stdout == "next\n"
+    check res.exitCode == 0
+    session.close()
+  test "async subproc":
+    let
+      f1 = runCommandAsync("sh", @["-c", "sleep 0.2; echo one"])
+      f2 = runCommandAsync("sh", @["-c", "echo two"])
+      res = waitFor all(f1, f2)
+
+    check res[0].stdout == "one\n"
+    check res[1].stdout == "two\n"
+  test "asciicast":
+    let
+      castFile = getTempDir() / "nimutils-test.cast"
+      outFile  = getTempDir() / "nimutils-test.out"
+
+    # The sleep splits a UTF-8 character across two events.
+    discard runCommand("sh", @["-c", "printf 'h\\303'; sleep 0.1; " &
+                                     "printf '\\251\\n'"],
+                       recordTo = castFile)
+    var f = open(outFile, fmWrite)
+    replayAsciicast(castFile, speed = 0, output = f)
+    f.close()
+    check readFile(outFile) == "h\u00e9\n"
+    removeFile(castFile)
+    removeFile(outFile)
+  test "flat text plane":
+    var plane = TextPlane(lines: @[@[1'u32, 2], @[3'u32], @[4'u32, 5, 6]]).
+                toFlatTextPlane()
+
+    check plane.lineCount() == 3
+    check @(plane.lineRunes(2)) == @[4'u32, 5, 6]
+    plane.append(plane[1 .. 2])
+    check plane.toTextPlane().lines == @[@[1'u32, 2], @[3'u32],
+                                         @[4'u32, 5, 6, 3], @[4'u32, 5, 6]]
+    plane.splice(1, 3, [7'u32, 8, 9])
+    check plane.toTextPlane().lines == @[@[1'u32, 2], @[7'u32, 8, 9],
+                                         @[4'u32, 5, 6]]
+    plane.deleteLines(0, 1)
+    check plane.offsets == @[0, 3, 6]
+  test "soft wrap":
+    let style = newStyle(overflow = OWrap)
+
+    proc wrapped(s: string, width: int): seq[string] =
+      # Returns the non-empty lines, with the style markers dropped.
+      var plane = TextPlane(lines: @[@[style.getStyleId()] &
+                                     cast[seq[uint32]](s.toRunes()) &
+                                     @[StylePop]])
+      plane.wrapToWidth(style, width)
+      for line in plane.lines:
+        var text: seq[Rune]
+        for ch in line:
+          if ch <= 0x10ffff:
+            text.add(Rune(ch))
+        if text.len() != 0:
+          result.add($text)
+
+    # A line that fits exactly doesn't split.
+    check wrapped("hello world", 11) == @["hello world"]
+    check wrapped("hello world", 10) == @["hello", "world"]
+    # Wide characters at the boundary still make progress, even when
+    # one doesn't fit on a line by itself.
+    check wrapped("\u4e16\u754c\u4e16\u754c", 3) ==
+          @["\u4e16", "\u754c", "\u4e16", "\u754c"]
+    check wrapped("\u4e16\u754c", 1) == @["\u4e16", "\u754c"]
+  test "ansi writer":
+    let
+      outFile = getTempDir() / "nimutils-ansi.out"
+      plane   = "# Hi\n\nSome *text* here.".htmlStringToRope().
+                preRenderFlat(width = 40)
+
+    var
+      f = open(outFile, fmWrite)
+      w = newAnsiWriter(f, flushAt = 8)
+
+    w.render(plane)
+    w.flush()
+    f.close()
+    check readFile(outFile) == plane.preRenderBoxToAnsiString()
+
+    f = open(outFile, fmWrite)
+    var fdWriter = newAnsiWriter(f.getFileHandle(), flushAt = 8)
+    fdWriter.render(plane)
+    fdWriter.flush()
+    f.close()
+    check readFile(outFile) == plane.preRenderBoxToAnsiString()
+
+    # A single run of text has no newline of its own.
+    f = open(outFile, fmWrite)
+    "just text".print(f, md = false, ensureNl = false)
+    "just text".print(f, md = false)
+    f.close()
+    let once = "just text".stylizeHtml()
+    check '\n' notin once
+    check readFile(outFile) == once & once & "\n"
+    removeFile(outFile)
+  test "style registry":
+    let
+      a  = newStyle(fgColor = "red")
+      b  = newStyle(bold = BoldOn)
+      id = a.getStyleId()
+
+    check id == a.getStyleId()
+    check id.idToStyle() == a
+    check a.mergeStyles(b) != a.mergeStyles(b)
+    discard b.getStyleId()
+    check a.mergeStyles(b) == a.mergeStyles(b)
+  test "line breaks":
+    proc opps(s: string): seq[int] =
+      var codepoints: seq[uint32]
+      for r in s.runes():
+        codepoints.add(uint32(r))
+      return codepoints.lineBreakOpps()
+
+    check opps("hello  world") == @[5]
+    check opps("well-known (sic) 10-20") == @[5, 10, 16]
+    check opps("a\u00a0b, c!") == @[4]
+    check lineBreakClass(uint32('(')) == LbOP
+    check lineBreakClass(0x4e00) == LbID
+  test "style memo":
+    let
+      base   = newStyle(fgColor = "red")
+      change = newStyle(bgColor = "blue")
+
+    discard base.getStyleId()
+    discard change.getStyleId()
+
+    let first = base.mergeStyles(change)
+    check first.textColor == some("red")
+    check base.mergeStyles(change) == first
+
+    base.textColor = some("green")
+    invalidateRenderCaches()
+
+    let second = base.mergeStyles(change)
+    check second.textColor == some("green")
+    check second.bgColor == some("blue")
+  test "render cache":
+    let r = "<table><tr><td>one</td><td>two</td></tr></table>".
+            htmlStringToRope()
+
+    clearRenderCache()
+    let
+      first  = r.preRender(width = 30).lines
+      before = getRenderCacheStats()
+
+    check r.preRender(width = 30).lines == first
+    check getRenderCacheStats().hits == before.hits + 1
+    check (r + "<p>more</p>".htmlStringToRope()).preRender(width = 30).
+          lines.len() > first.len()
+    check getRenderCacheStats().hitRate() > 0
+  test "parallel layout":
+    var html = "<table><thead><tr>"
+    for col in 0 ..< 6:
+      html &= "<th>Column " & $(col) & "</th>"
+    html &= "</tr></thead><tbody>"
+    for row in 0 ..< 16:
+      html &= "<tr>"
+      for col in 0 ..< 6:
+        html &= "<td><em>cell</em> " & $(row) & "." & $(col) &
+                " with enough text to wrap</td>"
+      html &= "</tr>"
+    html &= "</tbody></table>"
+
+    let table = html.htmlStringToRope()
+
+    clearRenderCache()
+    setParallelLayout(true)
+    let parallel = table.preRender(width = 60).lines
+    clearRenderCache()
+    setParallelLayout(false)
+    let sequential = table.preRender(width = 60).lines
+    setParallelLayout(true)
+
+    check parallel == sequential
+  test "lazy render":
+    let r = "# One\n\nSome text.\n\n| a | b |\n|---|---|\n| 1 | 2 |\n".
+            htmlStringToRope()
+    var lines: seq[seq[uint32]]
+
+    for line in r.preRenderLines(width = 40):
+      lines.add(line)
+
+    check lines == r.preRender(width = 40).lines
+  test "markdown to rope":
+    let docs = ["just *one* thing",
+                "# Title\n\nSome *text* &amp; a [link](http://x.com/a b).\n\n" &
+                "- one\n  ```\n  code\n  ```\n  after\n- [x] two\n\n" &
+                "| a | b |\n|---|---|\n| 1 | 2 |\n\nline  \nbreak\n"]
+
+    for doc in docs:
+      check doc.markdownToRope().preRender(width = 40).lines ==
+            doc.markdownToHtml().htmlStringToRope(false).
+            preRender(width = 40).lines
+  test "compact html":
+    let tree = parseDocumentCompact("<p class=x>Hi <a href='y'>there</a></p>")
+    var kids: seq[HtmlNodeView]
+
+    for body in tree.root.children:
+      for item in body.children:
+        kids.add(item)
+
+    check kids.len() == 1
+    check kids[0].tagName() == "p"
+    check kids[0].getAttr("class") == "x"
+    check not kids[0].hasAttr("href")
+    for item in kids[0].children:
+      if item.kind == HtmlText:
+        check item.contents() == "Hi "
+      else:
+        check item.getAttr("href") == "y"
+  test "rope blobs":
+    let
+      r    = "# Hi\n\nSome *text*.\n\n| a | b |\n|---|---|\n| 1 | 2 |\n".
+             htmlStringToRope()
+      blob = r.serializeRope()
+      docs = toRopeFileTable([("a.md", "*hi*"), ("b.rope", blob)])
+
+    check blob.deserializeRope().serializeRope() == blob
+    check blob.deserializeRope().preRender(width = 40).lines ==
+          r.preRender(width = 40).lines
+    check docs["b"].serializeRope() == blob
+    check docs["a"].tag == "em"
+    expect ValueError:
+      discard blob[0 ..< ^1].deserializeRope()
+  test "markdown writers":
+    var
+      doc      = "# Hi\n\n"
+      appended = "x"
+      streamed = ""
+      chunks   = 0
+
+    for i in 0 ..< 200:
+      doc.add("Some *text* & more. ")
+
+    doc.markdownToHtml(appended)
+    check appended == "x" & doc.markdownToHtml()
+
+    proc collect(chunk: openarray[char]) =
+      chunks += 1
+      for c in chunk:
+        streamed.add(c)
+
+    doc.markdownToHtml(collect, chunkSize = 256)
+    check streamed == doc.markdownToHtml()
+    check chunks > 1
+
+    proc fail(chunk: openarray[char]) =
+      raise newException(ValueError, "full")
+
+    expect ValueError:
+      doc.markdownToHtml(fail, chunkSize = 256)
+  test "direct tables":
+    var rows: seq[seq[string]]
+
+    for i in 0 ..< 9:
+      rows.add(@["row " & $(i), "*some* text", "`code`"])
+
+    let
+      headers = ["Name", "Text", "Code"]
+      direct  = rows.formatCellsAsRopeTable(headers)
+      viaHtml = rows.formatCellsAsHtmlTable(headers).htmlStringToRope(false)
+    var chunked: seq[seq[uint32]]
+
+    check direct.preRender(width = 60).lines ==
+          viaHtml.preRender(width = 60).lines
+    for plane in direct.preRenderTableChunks(chunkRows = 3, width = 60):
+      chunked.add(plane.toTextPlane().lines)
+    check chunked == direct.preRender(width = 60).lines
+    expect ValueError:
+      discard rows.formatCellsAsRopeTable(["Name"], verticalHeaders = true)
+  test "screen diff":
+    proc frame(lines: varargs[string]): TextPlane =
+      result = TextPlane()
+      for line in lines:
+        var l: seq[uint32]
+        for r in line.runes():
+          l.add(uint32(r))
+        result.lines.add(l)
+
+    var d = newScreenDiffer()
+
+    check d.update(frame("abc", "def")) == "\e[?25labc\ndef\n\e[?25h"
+    check d.update(frame("abc", "def")) == ""
+    check d.update(frame("abd", "def")) ==
+          "\e[?25l\e[2A\r\e[2Cd\e[2B\r\e[?25h"
+    check d.update(frame("x 10% y", "def")) ==
+          "\e[?25l\e[2A\rx 10% y\e[2B\r\e[?25h"
+    check d.update(frame("x 20% y", "def")) ==
+          "\e[?25l\e[2A\r\e[2C2\e[2B\r\e[?25h"
+    check d.update(frame("x 20% y")) == "\e[?25l\e[1A\r\e[J\e[?25h"
+    check d.update(frame("x 20% y", "more", "lines")) ==
+          "\e[?25lmore\nlines\n\e[?25h"
+  test "rope builder":
+    var b: RopeBuilder
+
+    for i in 0 ..< 100:
+      b.add(Rope(kind: RopeAtom, text: ($(i)).toRunes()))
+
+    let
+      r    = b.toRope()
+      tail = Rope(kind: RopeAtom, text: "x".toRunes())
+      both = r & tail
+
+    check b.len() == 100
+    check both != r and both.next != r.next
+    check both.next.text == r.next.text
+    expect ValueError:
+      b.add(r.next)
+    expect ValueError:
+      discard r + r.next.next
+    b.add(tail)
+    check b.len() == 101
+  test "measure":
+    # The ropes the other rendering tests use, plus some lists whose
+    # hangs take something off the width.
+    var
+      rows:    seq[seq[string]]
+      numbers: string
+      b:       RopeBuilder
+
+    for i in 0 ..< 9:
+      rows.add(@["row " & $(i), "*some* text", "`code`"])
+    for i in 0 ..< 12:
+      numbers &= $(i + 1) & ". item " & $(i) & " with some text to wrap\n"
+    for i in 0 ..< 20:
+      b.add(Rope(kind: RopeAtom, text: ($(i)).toRunes()))
+
+    let ropes = @[
+      """
+# Title
+
+Some *emphasized* text and a [link](https://example.com), wrapped
+across a couple of lines.
+
+- One
+- Two, with a longer item that will need to wrap at narrow widths
+  1. Nested
+
+| A | B |
+|---|---|
+| `x` | Some longer cell text here |
+""".markdownToRope(),
+      "just *one* thing".markdownToRope(),
+      ("# Title\n\nSome *text* &amp; a [link](http://x.com/a b).\n\n" &
+       "- one\n  ```\n  code\n  ```\n  after\n- [x] two\n\n" &
+       "| a | b |\n|---|---|\n| 1 | 2 |\n\nline  \nbreak\n").
+      markdownToRope(),
+      "<table><tr><td>one</td><td>two</td></tr></table>".htmlStringToRope(),
+      "# One\n\nSome text.\n\n| a | b |\n|---|---|\n| 1 | 2 |\n".
+      htmlStringToRope(),
+      rows.formatCellsAsRopeTable(["Name", "Text", "Code"]),
+      numbers.markdownToRope(),
+      b.toRope()]
+
+    for r in ropes:
+      for width in [20, 40, 80]:
+        let
+          plane  = r.preRender(width)
+          extent = r.measure(width)
+        var widest = 0
+
+        for line in plane.lines:
+          widest = max(widest, line.u32LineLength())
+
+        check extent.height == plane.lines.len()
+        check extent.width == widest
+  test "width table":
+    # Every codepoint, including the planes the tables assume are
+    # all width 1.
+    var mismatches = 0
+    for cp in 0 .. 0x10ffff:
+      if Rune(cp).runeWidth() != Rune(cp).computeRuneWidth():
+        mismatches += 1
+    check mismatches == 0
+  test "utf8":
+    check decodeUtf8("a\xc3\xa9\xe4\xb8\x96\xf0\x9f\x98\x80") ==
+          @[0x61'u32, 0xe9, 0x4e16, 0x1f600]
+    check decodeUtf8("ab\xffc\xe4\xb8") == @[0x61'u32, 0x62, 0xfffd, 0x63,
+                                                0xfffd, 0xfffd]
+    check "plain ascii \xc3\xa9".isValidUtf8()
+    check "ab\xffc".validUtf8Len() == 2
+    check not "\xc0\x80".isValidUtf8() # Overlong.
+
+    let text = "Some ascii, then \u4e16\u754c and \U0001f600, " &
+               "long enough to cross a few blocks."
+    var
+      reader = newRuneReader(newStringStream(text), blockSize = 4)
+      runes: seq[Rune]
+
+    check reader.peekRune() == Rune('S')
+    while not reader.atEnd():
+      runes.add(reader.readRune())
+    check runes == text.toRunes()
+    check reader.readRune() == Rune(0)
+
+    check "a\u4e16b".runeLength() == 4
+    check "ab\xffc".runeLength() == 4
+    check "foo_bar1".isValidId()
+    check not "1foo".isValidId()
+    check not "foo\xff".isValidId()
   test "random":
     let
       words = getRandomWords(3)